@@ -3,9 +3,19 @@
  */
 
 #include <tmax_pmem.h>
+#include <tmax_pmem_sort.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
 int main()
 {
     const char *dir = "/pmem/tmp/";
@@ -36,6 +46,36 @@ int main()
     printf("[%s] addr: %s\n", __func__, (char *)addr);
 
     pmem_free(addr, &pfile);
+
+    // Sort records in a region; the small DRAM budget makes pmem_sort merge through a scratch region
+    uint64_t *records;
+    size_t nrecords = 1 << 20, n;
+    records = (uint64_t *)pmem_malloc(dir, NULL, nrecords * sizeof(uint64_t), &pfile);
+    if (records == NULL)
+    {
+        printf("[%s] pmem_malloc failed\n", __func__);
+        goto exit;
+    }
+    for (n = 0; n < nrecords; n++)
+        records[n] = (n * 2654435761UL) % nrecords;
+    if (pmem_sort(records, nrecords, sizeof(uint64_t), compare_u64, dir, 1 << 20, 0) != SUCCESS)
+    {
+        printf("[%s] pmem_sort failed\n", __func__);
+        pmem_free(records, &pfile);
+        goto exit;
+    }
+    for (n = 0; n < nrecords; n++)
+    {
+        if (records[n] != n)
+        {
+            printf("[%s] pmem_sort: record %zu is %llu\n", __func__, n, (unsigned long long)records[n]);
+            pmem_free(records, &pfile);
+            goto exit;
+        }
+    }
+    printf("[%s] pmem_sort: %zu records sorted\n", __func__, nrecords);
+
+    pmem_free(records, &pfile);
     return 0;
 exit:
     return -1;
@@ -1,6 +1,13 @@
+#ifndef TMAX_PMEM_H
+#define TMAX_PMEM_H
+
 #include <stddef.h>
 #include <stdio.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 enum
 {
     /**
@@ -33,6 +40,16 @@ enum
      */
     ERROR_INVALID = -13,
 
+    /**
+     * Error: Requested entry does not exist.
+     */
+    ERROR_NOT_FOUND = -14,
+
+    /**
+     * Error: Not enough space left in the region.
+     */
+    ERROR_NOSPACE = -15,
+
     /**
      * Error: Unspecified run-time error.
      */
@@ -40,14 +57,36 @@ enum
 
 };
 
+struct pmem_prof_sample;
+
 struct pmem_file
 {
-    int fd;              // file descriptor
-    size_t current_size; // current size of the file
-    char *fullpath;      // full path of the file
+    int fd;                          // file descriptor
+    size_t current_size;             // current size of the file
+    char *fullpath;                  // full path of the file
+    size_t reserved_size;            // size of the reserved address range, 0 if the region cannot grow in place
+    struct pmem_prof_sample *sample; // set if the heap profiler sampled the allocation
+    unsigned long minor_faults;      // faults taken by pmem_prefault_region()
+    unsigned long major_faults;
 };
 
 void *pmem_malloc(const char *dir, void *addr, size_t size, struct pmem_file **pfile_ptr);
 int pmem_create_tmpfile(const char *dir, struct pmem_file **pfile_ptr);
 int pmem_free(void *addr, struct pmem_file **pfile_ptr);
-int pmem_cleanup_all(const char *dir);
\ No newline at end of file
+int pmem_cleanup_all(const char *dir);
+void *pmem_open(const char *path, void *addr, struct pmem_file **pfile_ptr);
+int pmem_close(void *addr, struct pmem_file **pfile_ptr);
+void pmem_persist(const void *addr, size_t len);
+void *pmem_memcpy_nt(void *dst, const void *src, size_t len);
+void *pmem_memcpy_from(void *dst, const void *src, size_t len);
+void *pmem_resize(void *addr, size_t size, struct pmem_file **pfile_ptr);
+int pmem_prefault(void *addr, size_t len);
+void *pmem_reserve(const char *dir, size_t reserve, size_t size, struct pmem_file **pfile_ptr);
+void *pmem_remap_reserved(void *addr, size_t reserve, struct pmem_file **pfile_ptr);
+int pmem_extend(void *addr, size_t size, struct pmem_file **pfile_ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
\ No newline at end of file
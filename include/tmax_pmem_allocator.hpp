@@ -0,0 +1,432 @@
+#ifndef TMAX_PMEM_ALLOCATOR_HPP
+#define TMAX_PMEM_ALLOCATOR_HPP
+
+/**
+ * @brief Allocator template whose behaviour is chosen at compile time by policies, so that the hot path has no
+ * runtime branches on configuration.
+ *
+ *     using session_alloc = pmem::allocator<pmem::backend::heap, pmem::threading::spin,
+ *                                           pmem::size_classes::geometric<16, 4096, 4>>;
+ *     session_alloc a("/pmem/tmp", 16UL << 30);
+ *     void *p = a.allocate(200);
+ *     a.deallocate(p, 200);
+ *
+ * Backend      provides spans and large blocks: map(size) / unmap(ptr, size).
+ * Threading    is the lock type guarding the free lists: lock() / unlock().
+ * SizeClasses  provides the constexpr class table: count, max_size, size(c), index(size).
+ * Persistence  is told about every allocator metadata write into the region: publish(ptr, size). Defaults to none.
+ *
+ * The free lists and size class state live in DRAM and the backend region is removed with the allocator, so nothing
+ * allocated here survives the process; use the heap or the containers for data that has to. persistence::flush only
+ * orders the free-list links written into freed blocks, e.g. for a backend that keeps its region.
+ *
+ * Requires C++17.
+ */
+
+#include <tmax_pmem_heap.h>
+#include <sched.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace pmem
+{
+
+namespace backend
+{
+/**
+ * @brief Spans and large blocks from one sparse pmem heap region, removed with the allocator.
+ */
+class heap
+{
+public:
+    heap(const char *dir, std::size_t capacity)
+    {
+        if (pmem_heap_create(dir, capacity, &heap_) != SUCCESS)
+            throw std::bad_alloc();
+    }
+
+    ~heap()
+    {
+        (void)pmem_heap_destroy(heap_);
+    }
+
+    heap(const heap &) = delete;
+    heap &operator=(const heap &) = delete;
+
+    void *map(std::size_t size) noexcept
+    {
+        return pmem_heap_alloc(heap_, size, page_size);
+    }
+
+    void unmap(void *ptr, std::size_t size) noexcept
+    {
+        pmem_heap_free(heap_, ptr, size, page_size);
+    }
+
+private:
+    static constexpr std::size_t page_size = 4096;
+    struct pmem_heap *heap_ = nullptr;
+};
+
+/**
+ * @brief Spans and large blocks from the DRAM heap, e.g. to test a configuration without PMEM.
+ */
+struct dram
+{
+    void *map(std::size_t size) noexcept
+    {
+        return ::operator new(size, std::align_val_t(4096), std::nothrow);
+    }
+
+    void unmap(void *ptr, std::size_t) noexcept
+    {
+        ::operator delete(ptr, std::align_val_t(4096));
+    }
+};
+} // namespace backend
+
+namespace threading
+{
+/**
+ * @brief No locking, for allocators owned by a single thread.
+ */
+struct single
+{
+    void lock() noexcept
+    {
+    }
+    void unlock() noexcept
+    {
+    }
+};
+
+using mutex = std::mutex;
+
+/**
+ * @brief Test-and-set spin lock, for short critical sections under low contention. Waiters pause between attempts and
+ * yield the CPU once the holder has kept the lock for a while, e.g. because it was preempted.
+ */
+class spin
+{
+public:
+    void lock() noexcept
+    {
+        for (unsigned spins = 0; flag_.test_and_set(std::memory_order_acquire); spins++)
+        {
+            if (spins < 64)
+            {
+#if defined(__SSE2__)
+                _mm_pause();
+#endif
+            }
+            else
+                sched_yield();
+        }
+    }
+    void unlock() noexcept
+    {
+        flag_.clear(std::memory_order_release);
+    }
+
+private:
+    std::atomic_flag flag_ = ATOMIC_FLAG_INIT;
+};
+} // namespace threading
+
+namespace persistence
+{
+/**
+ * @brief Volatile use: allocator metadata is never flushed.
+ */
+struct none
+{
+    static void publish(const void *, std::size_t) noexcept
+    {
+    }
+};
+
+/**
+ * @brief Flush allocator metadata written into the region to the PMEM.
+ */
+struct flush
+{
+    static void publish(const void *ptr, std::size_t size) noexcept
+    {
+        pmem_persist(ptr, size);
+    }
+};
+} // namespace persistence
+
+namespace size_classes
+{
+namespace detail
+{
+constexpr std::size_t max_classes = 256;
+
+template <std::size_t Min, std::size_t Max, unsigned Steps>
+constexpr std::pair<std::array<std::size_t, max_classes>, std::size_t> make_geometric()
+{
+    std::array<std::size_t, max_classes> sizes{};
+    std::size_t n = 0;
+
+    for (std::size_t base = Min; base < Max; base *= 2)
+    {
+        for (unsigned s = 0; s < Steps; s++)
+        {
+            std::size_t size = (base + base * s / Steps + Min - 1) / Min * Min;
+            if (size <= Max && (n == 0 || size > sizes[n - 1]))
+                sizes[n++] = size;
+        }
+    }
+    if (n == 0 || sizes[n - 1] < Max)
+        sizes[n++] = Max;
+
+    return {sizes, n};
+}
+
+// lookup[i] is the first class holding (i + 1) * Min bytes
+template <std::size_t Min, std::size_t Max>
+constexpr std::array<std::uint16_t, Max / Min> make_lookup(const std::array<std::size_t, max_classes> &sizes)
+{
+    std::array<std::uint16_t, Max / Min> lookup{};
+    std::size_t c = 0;
+
+    for (std::size_t i = 0; i < Max / Min; i++)
+    {
+        while (sizes[c] < (i + 1) * Min)
+            c++;
+        lookup[i] = static_cast<std::uint16_t>(c);
+    }
+
+    return lookup;
+}
+} // namespace detail
+
+/**
+ * @brief Steps classes per power of two between Min and Max, rounded to multiples of Min.
+ */
+template <std::size_t Min, std::size_t Max, unsigned Steps>
+struct geometric
+{
+    static_assert(Min >= sizeof(void *) && (Min & (Min - 1)) == 0, "Min must be a power of two holding a pointer");
+    static_assert(Max % Min == 0 && Max >= Min, "Max must be a multiple of Min");
+    static_assert(Steps >= 1, "at least one class per power of two");
+
+    static constexpr auto table = detail::make_geometric<Min, Max, Steps>();
+    static constexpr std::size_t count = table.second;
+    static constexpr std::size_t max_size = Max;
+    static constexpr auto lookup = detail::make_lookup<Min, Max>(table.first);
+
+    static constexpr std::size_t size(std::size_t c) noexcept
+    {
+        return table.first[c];
+    }
+
+    static constexpr std::size_t index(std::size_t n) noexcept
+    {
+        return lookup[(n - 1) / Min];
+    }
+};
+
+/**
+ * @brief Classes every Step bytes up to Max.
+ */
+template <std::size_t Step, std::size_t Max>
+struct linear
+{
+    static_assert(Step >= sizeof(void *) && Step % sizeof(void *) == 0, "Step must hold a pointer");
+    static_assert(Max % Step == 0 && Max >= Step, "Max must be a multiple of Step");
+
+    static constexpr std::size_t count = Max / Step;
+    static constexpr std::size_t max_size = Max;
+
+    static constexpr std::size_t size(std::size_t c) noexcept
+    {
+        return (c + 1) * Step;
+    }
+
+    static constexpr std::size_t index(std::size_t n) noexcept
+    {
+        return (n - 1) / Step;
+    }
+};
+} // namespace size_classes
+
+template <class Backend, class Threading, class SizeClasses, class Persistence = persistence::none>
+class allocator
+{
+public:
+    using backend_type = Backend;
+    using threading_type = Threading;
+    using size_classes_type = SizeClasses;
+    using persistence_type = Persistence;
+
+    // Spans hold at least 8 blocks of the largest class
+    static constexpr std::size_t span_size =
+        SizeClasses::max_size * 8 > (64u << 10) ? (SizeClasses::max_size * 8 + 4095) / 4096 * 4096 : (64u << 10);
+
+    template <class... Args>
+    explicit allocator(Args &&...args) : backend_(std::forward<Args>(args)...)
+    {
+    }
+
+    ~allocator()
+    {
+        for (auto &span : spans_)
+            backend_.unmap(span, span_size);
+    }
+
+    allocator(const allocator &) = delete;
+    allocator &operator=(const allocator &) = delete;
+
+    /**
+     * @brief Allocate size bytes. Blocks up to SizeClasses::max_size come from the class free lists, larger ones
+     * straight from the backend. Throws std::bad_alloc when the backend is exhausted.
+     */
+    void *allocate(std::size_t size)
+    {
+        if (size == 0)
+            size = 1;
+        if (size > SizeClasses::max_size)
+        {
+            std::lock_guard<Threading> guard(lock_);
+            void *ptr = backend_.map(size);
+            if (ptr == nullptr)
+                throw std::bad_alloc();
+            return ptr;
+        }
+
+        const std::size_t c = SizeClasses::index(size);
+        std::lock_guard<Threading> guard(lock_);
+        free_list &cls = classes_[c];
+
+        if (cls.head != nullptr)
+        {
+            void *ptr = cls.head;
+            cls.head = *static_cast<void **>(ptr);
+            return ptr;
+        }
+        if (cls.bump == nullptr || cls.bump + SizeClasses::size(c) > cls.end)
+        {
+            char *span = static_cast<char *>(backend_.map(span_size));
+            if (span == nullptr)
+                throw std::bad_alloc();
+            try
+            {
+                spans_.push_back(span);
+            }
+            catch (...)
+            {
+                backend_.unmap(span, span_size);
+                throw;
+            }
+            cls.bump = span;
+            cls.end = span + span_size;
+        }
+        void *ptr = cls.bump;
+        cls.bump += SizeClasses::size(c);
+        return ptr;
+    }
+
+    /**
+     * @brief Free a block. size must be the size passed to allocate().
+     */
+    void deallocate(void *ptr, std::size_t size) noexcept
+    {
+        if (ptr == nullptr)
+            return;
+        if (size == 0)
+            size = 1;
+        std::lock_guard<Threading> guard(lock_);
+        if (size > SizeClasses::max_size)
+        {
+            backend_.unmap(ptr, size);
+            return;
+        }
+
+        free_list &cls = classes_[SizeClasses::index(size)];
+        *static_cast<void **>(ptr) = cls.head;
+        Persistence::publish(ptr, sizeof(void *));
+        cls.head = ptr;
+    }
+
+    Backend &backend() noexcept
+    {
+        return backend_;
+    }
+
+private:
+    struct free_list
+    {
+        void *head = nullptr;
+        char *bump = nullptr;
+        char *end = nullptr;
+    };
+
+    Backend backend_;
+    Threading lock_;
+    std::array<free_list, SizeClasses::count> classes_{};
+    std::vector<void *> spans_;
+};
+
+/**
+ * @brief Standard allocator view of a pmem::allocator, for std containers.
+ */
+template <class T, class Alloc>
+class stl_allocator
+{
+public:
+    using value_type = T;
+
+    explicit stl_allocator(Alloc &alloc) noexcept : alloc_(&alloc)
+    {
+    }
+
+    template <class U>
+    stl_allocator(const stl_allocator<U, Alloc> &other) noexcept : alloc_(other.underlying())
+    {
+    }
+
+    T *allocate(std::size_t n)
+    {
+        return static_cast<T *>(alloc_->allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T *ptr, std::size_t n) noexcept
+    {
+        alloc_->deallocate(ptr, n * sizeof(T));
+    }
+
+    Alloc *underlying() const noexcept
+    {
+        return alloc_;
+    }
+
+    template <class U>
+    bool operator==(const stl_allocator<U, Alloc> &other) const noexcept
+    {
+        return alloc_ == other.underlying();
+    }
+
+    template <class U>
+    bool operator!=(const stl_allocator<U, Alloc> &other) const noexcept
+    {
+        return alloc_ != other.underlying();
+    }
+
+private:
+    Alloc *alloc_;
+};
+
+} // namespace pmem
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef TMAX_PMEM_BTREE_H
+#define TMAX_PMEM_BTREE_H
+
+#include <tmax_pmem.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum
+{
+    /**
+     * Flush every update to the PMEM before returning, so that the leaves survive a crash.
+     */
+    PMEM_BTREE_PERSIST = 1 << 0
+};
+
+struct pmem_btree;
+
+/**
+ * Called by pmem_btree_scan() for every entry in key order. Returning non-zero stops the scan.
+ */
+typedef int (*pmem_btree_scan_cb)(uint64_t key, uint64_t value, void *arg);
+
+int pmem_btree_create(const char *dir, size_t capacity, int flags, struct pmem_btree **tree_ptr);
+int pmem_btree_open(const char *path, int flags, struct pmem_btree **tree_ptr);
+int pmem_btree_get(struct pmem_btree *tree, uint64_t key, uint64_t *value);
+int pmem_btree_put(struct pmem_btree *tree, uint64_t key, uint64_t value);
+int pmem_btree_remove(struct pmem_btree *tree, uint64_t key);
+int pmem_btree_scan(struct pmem_btree *tree, uint64_t lo, uint64_t hi, pmem_btree_scan_cb cb, void *arg);
+size_t pmem_btree_count(struct pmem_btree *tree);
+const char *pmem_btree_path(struct pmem_btree *tree);
+int pmem_btree_close(struct pmem_btree *tree);
+int pmem_btree_destroy(struct pmem_btree *tree);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
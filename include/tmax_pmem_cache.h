@@ -0,0 +1,24 @@
+#ifndef TMAX_PMEM_CACHE_H
+#define TMAX_PMEM_CACHE_H
+
+#include <tmax_pmem.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct pmem_cache;
+
+int pmem_cache_create(const char *dir, int fd, size_t page_size, size_t nframes, struct pmem_cache **cache_ptr);
+int pmem_cache_put(struct pmem_cache *cache, uint64_t pageno, const void *page, int dirty);
+int pmem_cache_get(struct pmem_cache *cache, uint64_t pageno, void *page);
+int pmem_cache_invalidate(struct pmem_cache *cache, uint64_t pageno);
+int pmem_cache_flush(struct pmem_cache *cache);
+int pmem_cache_destroy(struct pmem_cache *cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef TMAX_PMEM_DIR_H
+#define TMAX_PMEM_DIR_H
+
+#include <tmax_pmem.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Layout of a PMEM directory:
+ *
+ *   <dir>/pmem.proc.<pid>.<starttime>/pmem.XXXXXX           regions of the process, starttime from /proc/<pid>/stat
+ *   <dir>/pmem.proc.<pid>.<starttime>/<shard>/pmem.XXXXXX   the same with TMAX_PMEM_SHARDS > 1, shard by thread
+ *   <dir>/pmem.proc.<pid>.<starttime>/.lease                locked with flock() by the process while it lives
+ *   <dir>/pmem.proc.<pid>.<starttime>/.kept                 regions kept by pmem_close(), one relative path per line
+ *   <dir>/pmem.trash/                                       subdirectories of dead processes, deleted in the background
+ *
+ * With TMAX_PMEM_OWNER_DIRS=0 or pmem_set_owner_dirs(0) regions are created as <dir>/pmem.XXXXXX instead.
+ */
+#define PMEM_DIR_OWNER_PREFIX "pmem.proc."
+#define PMEM_DIR_LEASE ".lease"
+#define PMEM_DIR_KEPT ".kept"
+#define PMEM_DIR_TRASH "pmem.trash"
+#define PMEM_DIR_MAX_SHARDS 64
+
+int pmem_set_shards(unsigned int shards);
+void pmem_set_owner_dirs(int enable);
+int pmem_reclaim(const char *dir, unsigned long *owners);
+int pmem_reclaim_legacy(const char *dir, unsigned long *files);
+int pmem_cleanup_wait(void);
+
+// Layout, used by the library
+int pmem_dir_owner(const char *dir, char *path, size_t len);
+int pmem_dir_owner_dead(const char *dir, const char *name);
+int pmem_dir_trash(const char *dir, const char *name);
+int pmem_dir_keep(const char *path);
+int pmem_dir_purge(const char *dir);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
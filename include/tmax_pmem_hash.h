@@ -0,0 +1,35 @@
+#ifndef TMAX_PMEM_HASH_H
+#define TMAX_PMEM_HASH_H
+
+#include <tmax_pmem.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum
+{
+    /**
+     * Flush every update to the PMEM before returning, so that the table survives a crash.
+     */
+    PMEM_HASH_PERSIST = 1 << 0
+};
+
+struct pmem_hash;
+
+int pmem_hash_create(const char *dir, size_t capacity, int flags, struct pmem_hash **hash_ptr);
+int pmem_hash_open(const char *path, int flags, struct pmem_hash **hash_ptr);
+int pmem_hash_get(struct pmem_hash *hash, uint64_t key, uint64_t *value);
+int pmem_hash_put(struct pmem_hash *hash, uint64_t key, uint64_t value);
+int pmem_hash_remove(struct pmem_hash *hash, uint64_t key);
+size_t pmem_hash_count(struct pmem_hash *hash);
+const char *pmem_hash_path(struct pmem_hash *hash);
+int pmem_hash_close(struct pmem_hash *hash);
+int pmem_hash_destroy(struct pmem_hash *hash);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef TMAX_PMEM_HEAP_H
+#define TMAX_PMEM_HEAP_H
+
+#include <tmax_pmem.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct pmem_heap;
+
+int pmem_heap_create(const char *dir, size_t capacity, struct pmem_heap **heap_ptr);
+void *pmem_heap_alloc(struct pmem_heap *heap, size_t size, size_t alignment);
+void pmem_heap_free(struct pmem_heap *heap, void *ptr, size_t size, size_t alignment);
+int pmem_heap_contains(const struct pmem_heap *heap, const void *ptr);
+const char *pmem_heap_path(const struct pmem_heap *heap);
+int pmem_heap_snapshot(struct pmem_heap *heap, size_t limit, void **snapshot, size_t *len);
+int pmem_heap_detach(struct pmem_heap *heap, void *snapshot, size_t len);
+int pmem_heap_destroy(struct pmem_heap *heap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
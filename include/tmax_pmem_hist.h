@@ -0,0 +1,46 @@
+#ifndef TMAX_PMEM_HIST_H
+#define TMAX_PMEM_HIST_H
+
+#include <stdint.h>
+#include <tmax_pmem.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Log-linear buckets: values below 2^PMEM_HIST_SUB_BITS exactly, above that 2^PMEM_HIST_SUB_BITS buckets per power of
+// two, i.e. within 1/32 of the value. Values from 2^PMEM_HIST_MAX_SHIFT ns (about 18 minutes) on share the last bucket.
+#define PMEM_HIST_SUB_BITS 5
+#define PMEM_HIST_MAX_SHIFT 40
+#define PMEM_HIST_BUCKETS (((PMEM_HIST_MAX_SHIFT - PMEM_HIST_SUB_BITS + 1) << PMEM_HIST_SUB_BITS) + 1)
+
+enum
+{
+    PMEM_HIST_MALLOC,         // pmem_malloc() and pmem_reserve()
+    PMEM_HIST_FREE,           // pmem_free()
+    PMEM_HIST_CREATE_TMPFILE, // pmem_create_tmpfile()
+    PMEM_HIST_MMAP,           // mmap() steps of the above
+    PMEM_HIST_MUNMAP,         // munmap() steps of the above
+    PMEM_HIST_OPS
+};
+
+struct pmem_hist
+{
+    uint64_t count;
+    uint64_t sum; // ns
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[PMEM_HIST_BUCKETS];
+};
+
+void pmem_hist_record(int op, uint64_t ns);
+int pmem_hist_snapshot(int op, struct pmem_hist *hist);
+void pmem_hist_merge(struct pmem_hist *dst, const struct pmem_hist *src);
+uint64_t pmem_hist_percentile(const struct pmem_hist *hist, double percentile);
+const char *pmem_hist_name(int op);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
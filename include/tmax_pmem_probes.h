@@ -0,0 +1,46 @@
+#ifndef TMAX_PMEM_PROBES_H
+#define TMAX_PMEM_PROBES_H
+
+/*
+ * Statically defined tracepoints (USDT) of the library, provider tmax_pmem. With <sys/sdt.h> (systemtap-sdt-dev) at
+ * build time every probe is a single nop plus a note in the ELF file, which bpftrace, perf and systemtap turn into a
+ * breakpoint only while they trace it. Without the header, or with TMAX_PMEM_NO_PROBES defined, the probes compile to
+ * nothing.
+ *
+ *   alloc_entry(dir, size)               pmem_malloc(), pmem_reserve()
+ *   alloc_return(dir, addr, size, ns)    addr is NULL on failure
+ *   free_entry(addr, size)               pmem_free()
+ *   free_return(addr, size, ns, err)
+ *   create(dir, path, ns, err)           temporary file created, path NULL on failure
+ *   mmap(addr, size, ns)                 file mapped
+ *   munmap(addr, size, ns)
+ *   unlink(path, ns, err)                from the reaper thread if releases are deferred
+ *   cleanup_entry(dir)                   pmem_cleanup_all()
+ *   cleanup_return(dir, owners, ns, err) owners is the number of dead processes reclaimed
+ *
+ * Sizes are in bytes, durations in nanoseconds, err is 0 or one of the ERROR_* codes. For example:
+ *
+ *   bpftrace -e 'usdt:./example1:tmax_pmem:alloc_return { @ns[str(arg0)] = hist(arg3); }'
+ *   perf probe -x ./example1 sdt_tmax_pmem:unlink && perf record -e sdt_tmax_pmem:unlink -a
+ */
+
+#if !defined(TMAX_PMEM_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PMEM_PROBES_ENABLED 1
+#endif
+#endif
+
+#ifdef PMEM_PROBES_ENABLED
+#define PMEM_PROBE1(name, a) DTRACE_PROBE1(tmax_pmem, name, a)
+#define PMEM_PROBE2(name, a, b) DTRACE_PROBE2(tmax_pmem, name, a, b)
+#define PMEM_PROBE3(name, a, b, c) DTRACE_PROBE3(tmax_pmem, name, a, b, c)
+#define PMEM_PROBE4(name, a, b, c, d) DTRACE_PROBE4(tmax_pmem, name, a, b, c, d)
+#else
+#define PMEM_PROBE1(name, a) ((void)(a))
+#define PMEM_PROBE2(name, a, b) ((void)(a), (void)(b))
+#define PMEM_PROBE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#define PMEM_PROBE4(name, a, b, c, d) ((void)(a), (void)(b), (void)(c), (void)(d))
+#endif
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef TMAX_PMEM_PROF_H
+#define TMAX_PMEM_PROF_H
+
+#include <tmax_pmem.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int pmem_prof_start(size_t rate);
+int pmem_prof_stop(void);
+int pmem_prof_dump(const char *path);
+
+// Recording, used by the library
+void pmem_prof_alloc(struct pmem_file *pfile, size_t size);
+void pmem_prof_free(struct pmem_file *pfile);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
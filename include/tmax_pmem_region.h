@@ -0,0 +1,30 @@
+#ifndef TMAX_PMEM_REGION_H
+#define TMAX_PMEM_REGION_H
+
+#include <tmax_pmem.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct pmem_region_info
+{
+    size_t size;                // bytes of the file mapped
+    size_t resident;            // bytes of the file in memory, by mincore()
+    size_t present;             // bytes mapped in the page tables of the process, by /proc/self/pagemap
+    size_t dirty;               // bytes written and not yet written back in the mappings of the region, by smaps
+    size_t pmd_mapped;          // bytes mapped by 2 MiB page table entries (PMD) in the mappings of the region
+    size_t vma_size;            // bytes of the mappings behind dirty and pmd_mapped, more than size if merged
+    size_t pte_mapped;          // bytes mapped by 4 KiB page table entries (PTE)
+    unsigned long minor_faults; // faults taken by pmem_prefault_region() on the region
+    unsigned long major_faults;
+};
+
+int pmem_prefault_region(void *addr, struct pmem_file **pfile_ptr);
+int pmem_region_info(void *addr, const struct pmem_file *pfile, struct pmem_region_info *info);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,170 @@
+#ifndef TMAX_PMEM_REGION_HPP
+#define TMAX_PMEM_REGION_HPP
+
+/**
+ * @brief Move-only owner of a pmem_malloc region. The mapping and the backing file are released by the destructor,
+ * also when an exception unwinds the stack.
+ *
+ *     pmem::region r("/pmem/tmp", 1 << 30);
+ *     r.prefault();
+ *     auto records = r.as<record>();
+ *
+ * Requires C++20.
+ */
+
+#include <tmax_pmem.h>
+#include <algorithm>
+#include <cstddef>
+#include <new>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <sys/mman.h>
+
+namespace pmem
+{
+
+class region
+{
+public:
+    region() noexcept = default;
+
+    region(const char *dir, std::size_t size)
+    {
+        addr_ = pmem_malloc(dir, nullptr, size, &file_);
+        if (addr_ == nullptr)
+            throw std::bad_alloc();
+    }
+
+    ~region()
+    {
+        reset();
+    }
+
+    region(const region &) = delete;
+    region &operator=(const region &) = delete;
+
+    region(region &&other) noexcept
+        : addr_(std::exchange(other.addr_, nullptr)), file_(std::exchange(other.file_, nullptr))
+    {
+    }
+
+    region &operator=(region &&other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            addr_ = std::exchange(other.addr_, nullptr);
+            file_ = std::exchange(other.file_, nullptr);
+        }
+        return *this;
+    }
+
+    /**
+     * @brief Unmap the region and remove its backing file. The region is empty afterwards.
+     */
+    void reset() noexcept
+    {
+        if (addr_ != nullptr)
+            (void)pmem_free(addr_, &file_);
+        addr_ = nullptr;
+        file_ = nullptr;
+    }
+
+    explicit operator bool() const noexcept
+    {
+        return addr_ != nullptr;
+    }
+
+    void *data() const noexcept
+    {
+        return addr_;
+    }
+
+    std::size_t size() const noexcept
+    {
+        return file_ ? file_->current_size : 0;
+    }
+
+    const char *path() const noexcept
+    {
+        return file_ ? file_->fullpath : nullptr;
+    }
+
+    std::span<std::byte> bytes() const noexcept
+    {
+        return {static_cast<std::byte *>(addr_), size()};
+    }
+
+    /**
+     * @brief The region as an array of T, truncated to whole elements.
+     */
+    template <typename T>
+    std::span<T> as() const noexcept
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "pmem::region views need trivially copyable types");
+        return {static_cast<T *>(addr_), size() / sizeof(T)};
+    }
+
+    /**
+     * @brief The object of type T at byte offset in the region.
+     */
+    template <typename T>
+    T &at(std::size_t offset) const noexcept
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "pmem::region views need trivially copyable types");
+        return *reinterpret_cast<T *>(static_cast<std::byte *>(addr_) + offset);
+    }
+
+    /**
+     * @brief Grow or shrink the region. The mapping may move, so views taken before are invalidated. On failure the
+     * region is unchanged and std::bad_alloc is thrown, as it is for an empty region, e.g. a moved-from one.
+     */
+    void resize(std::size_t size)
+    {
+        if (file_ == nullptr)
+            throw std::bad_alloc();
+        void *addr = pmem_resize(addr_, size, &file_);
+        if (addr == nullptr)
+            throw std::bad_alloc();
+        addr_ = addr;
+    }
+
+    /**
+     * @brief Populate the page tables of the region, or of part of it, ahead of use.
+     */
+    void prefault(std::size_t offset = 0, std::size_t len = std::size_t(-1)) const noexcept
+    {
+        if (offset >= size())
+            return;
+        (void)pmem_prefault(static_cast<std::byte *>(addr_) + offset, std::min(len, size() - offset));
+    }
+
+    /**
+     * @brief madvise() the region, or part of it, e.g. with MADV_SEQUENTIAL or MADV_HUGEPAGE.
+     */
+    bool advise(int advice, std::size_t offset = 0, std::size_t len = std::size_t(-1)) const noexcept
+    {
+        if (offset >= size())
+            return false;
+        return madvise(static_cast<std::byte *>(addr_) + offset, std::min(len, size() - offset), advice) == 0;
+    }
+
+    /**
+     * @brief Write back the cache lines of the region, or of part of it, to the PMEM.
+     */
+    void persist(std::size_t offset = 0, std::size_t len = std::size_t(-1)) const noexcept
+    {
+        if (offset >= size())
+            return;
+        pmem_persist(static_cast<std::byte *>(addr_) + offset, std::min(len, size() - offset));
+    }
+
+private:
+    void *addr_ = nullptr;
+    struct pmem_file *file_ = nullptr;
+};
+
+} // namespace pmem
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef TMAX_PMEM_RELEASE_H
+#define TMAX_PMEM_RELEASE_H
+
+#include <tmax_pmem.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int pmem_release_async(size_t queue);
+int pmem_release_flush(void);
+
+// Deferral, used by pmem_free()
+int pmem_release_defer(int fd, char *fullpath);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef TMAX_PMEM_RESOURCE_HPP
+#define TMAX_PMEM_RESOURCE_HPP
+
+/**
+ * @brief std::pmr adapters over the pmem heap, so that pmr containers can keep their storage on the PMEM.
+ *
+ *     pmem::synchronized_pool_resource pool("/pmem/tmp", 64UL << 30);
+ *     std::pmr::vector<int> v(&pool);
+ *
+ * Requires C++17.
+ */
+
+#include <tmax_pmem_heap.h>
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+
+namespace pmem
+{
+
+/**
+ * @brief Memory resource allocating from a pmem heap. All allocations share one sparse backing file, which is
+ * removed when the resource is destroyed. Thread-safe.
+ */
+class memory_resource : public std::pmr::memory_resource
+{
+public:
+    memory_resource(const char *dir, std::size_t capacity)
+    {
+        if (pmem_heap_create(dir, capacity, &heap_) != SUCCESS)
+            throw std::bad_alloc();
+    }
+
+    ~memory_resource() override
+    {
+        (void)pmem_heap_destroy(heap_);
+    }
+
+    memory_resource(const memory_resource &) = delete;
+    memory_resource &operator=(const memory_resource &) = delete;
+
+    struct pmem_heap *heap() const noexcept
+    {
+        return heap_;
+    }
+
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        void *p = pmem_heap_alloc(heap_, bytes, alignment);
+        if (p == nullptr)
+            throw std::bad_alloc();
+        return p;
+    }
+
+    void do_deallocate(void *p, std::size_t bytes, std::size_t alignment) override
+    {
+        pmem_heap_free(heap_, p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+
+private:
+    struct pmem_heap *heap_ = nullptr;
+};
+
+namespace detail
+{
+// Constructed before the pool base class, which keeps a pointer to it
+struct upstream_holder
+{
+    memory_resource upstream;
+
+    upstream_holder(const char *dir, std::size_t capacity) : upstream(dir, capacity)
+    {
+    }
+};
+} // namespace detail
+
+/**
+ * @brief Thread-safe pool of size classes on top of its own pmem memory_resource. Small allocations are served from
+ * pools without taking the heap lock.
+ */
+class synchronized_pool_resource : private detail::upstream_holder, public std::pmr::synchronized_pool_resource
+{
+public:
+    synchronized_pool_resource(const char *dir, std::size_t capacity, const std::pmr::pool_options &options = {})
+        : detail::upstream_holder(dir, capacity), std::pmr::synchronized_pool_resource(options, &upstream)
+    {
+    }
+
+    memory_resource *pmem_resource() noexcept
+    {
+        return &upstream;
+    }
+};
+
+} // namespace pmem
+
+#endif
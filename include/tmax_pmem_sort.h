@@ -0,0 +1,17 @@
+#ifndef TMAX_PMEM_SORT_H
+#define TMAX_PMEM_SORT_H
+
+#include <tmax_pmem.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int pmem_sort(void *base, size_t nmemb, size_t size, int (*compar)(const void *, const void *), const char *dir,
+              size_t dram_bytes, int nthreads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
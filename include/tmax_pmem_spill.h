@@ -0,0 +1,29 @@
+#ifndef TMAX_PMEM_SPILL_H
+#define TMAX_PMEM_SPILL_H
+
+#include <tmax_pmem.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct pmem_spill;
+struct pmem_spill_run;
+struct pmem_spill_reader;
+
+int pmem_spill_create(const char *dir, size_t capacity, const char *fallback_dir, struct pmem_spill **spill_ptr);
+int pmem_spill_open(struct pmem_spill *spill, struct pmem_spill_run **run_ptr);
+int pmem_spill_append(struct pmem_spill_run *run, const void *buf, size_t len);
+int pmem_spill_seal(struct pmem_spill_run *run);
+size_t pmem_spill_size(struct pmem_spill_run *run);
+int pmem_spill_reader_open(struct pmem_spill_run *run, struct pmem_spill_reader **reader_ptr);
+int pmem_spill_read(struct pmem_spill_reader *reader, void *buf, size_t len, size_t *nread);
+int pmem_spill_reader_close(struct pmem_spill_reader *reader);
+int pmem_spill_delete(struct pmem_spill_run *run);
+int pmem_spill_destroy(struct pmem_spill *spill);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
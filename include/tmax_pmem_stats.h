@@ -0,0 +1,113 @@
+#ifndef TMAX_PMEM_STATS_H
+#define TMAX_PMEM_STATS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <tmax_pmem.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Size class i counts regions of up to 4 KiB << i bytes, the last class all larger ones
+#define PMEM_STATS_MIN_SHIFT 12
+#define PMEM_STATS_SIZE_CLASSES 24
+
+// failures[i] counts the error code -i, the last entry ERROR_RUNTIME and any other code
+#define PMEM_STATS_ERRORS 17
+
+// latency[op][i] counts calls that took [2^i, 2^(i+1)) ns
+#define PMEM_STATS_LATENCY_BUCKETS 32
+
+#define PMEM_STATS_DIRS 16
+#define PMEM_STATS_PATH_LEN 128
+#define PMEM_STATS_TOP_SITES 16
+#define PMEM_STATS_SITE_LEN 96
+
+// Shared memory segments are named PMEM_STATS_SEGMENT_PREFIX<pid>
+#define PMEM_STATS_SEGMENT_PREFIX "tmax_pmem_stats."
+#define PMEM_STATS_SEGMENT_MAGIC 0x504d454d53544154ULL
+#define PMEM_STATS_SEGMENT_VERSION 1
+
+enum
+{
+    PMEM_STATS_MKSTEMP,
+    PMEM_STATS_FTRUNCATE,
+    PMEM_STATS_MMAP,
+    PMEM_STATS_MUNMAP,
+    PMEM_STATS_UNLINK,
+    PMEM_STATS_SYSCALLS
+};
+
+enum
+{
+    PMEM_STATS_ALLOC,
+    PMEM_STATS_FREE,
+    PMEM_STATS_OPS
+};
+
+struct pmem_stats
+{
+    int64_t live_regions;    // regions mapped by pmem_malloc(), pmem_reserve() and pmem_open()
+    int64_t bytes_mapped;    // address space of the live regions, including reservations
+    int64_t bytes_committed; // size of the files behind the live regions
+    uint64_t allocs[PMEM_STATS_SIZE_CLASSES]; // pmem_malloc() and pmem_reserve() by initial size
+    uint64_t frees[PMEM_STATS_SIZE_CLASSES];  // pmem_free() by final size
+    uint64_t failures[PMEM_STATS_ERRORS];
+    uint64_t syscalls[PMEM_STATS_SYSCALLS];   // number of calls
+    uint64_t syscall_ns[PMEM_STATS_SYSCALLS]; // time spent in them
+    uint64_t latency[PMEM_STATS_OPS][PMEM_STATS_LATENCY_BUCKETS];
+};
+
+struct pmem_stats_dir
+{
+    char path[PMEM_STATS_PATH_LEN];
+    int64_t regions;
+    int64_t committed;
+};
+
+struct pmem_stats_site
+{
+    char name[PMEM_STATS_SITE_LEN]; // symbol+offset of the caller of pmem_malloc() or pmem_reserve()
+    uint64_t allocs;
+    uint64_t bytes;
+};
+
+struct pmem_stats_segment
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t interval_ms; // publishing interval
+    uint64_t seq;         // odd while an update is in progress
+    pid_t pid;
+    char comm[16];
+    uint64_t updated_ns; // CLOCK_REALTIME of the last update
+    struct pmem_stats stats;
+    struct pmem_stats_dir dirs[PMEM_STATS_DIRS];
+    struct pmem_stats_site sites[PMEM_STATS_TOP_SITES];
+};
+
+int pmem_stats(struct pmem_stats *stats);
+int pmem_stats_size_class(size_t size);
+int pmem_stats_dirs(struct pmem_stats_dir *dirs, int max);
+int pmem_stats_sites(struct pmem_stats_site *sites, int max);
+int pmem_stats_publish(unsigned int interval_ms);
+int pmem_stats_unpublish(void);
+int pmem_stats_read_segment(const struct pmem_stats_segment *shared, struct pmem_stats_segment *copy);
+
+// Recording, used by the library
+uint64_t pmem_stats_clock(void);
+uint64_t pmem_stats_syscall(int call, uint64_t start);
+uint64_t pmem_stats_latency(int op, uint64_t start);
+void pmem_stats_map(size_t committed, size_t mapped, int alloc);
+void pmem_stats_unmap(size_t committed, size_t mapped, int alloc);
+void pmem_stats_resize(int64_t committed, int64_t mapped);
+void pmem_stats_dir(const char *fullpath, int64_t regions, int64_t committed);
+void pmem_stats_site(const void *caller, size_t size);
+int pmem_stats_failure(int err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
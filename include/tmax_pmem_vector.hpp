@@ -0,0 +1,621 @@
+#ifndef TMAX_PMEM_VECTOR_HPP
+#define TMAX_PMEM_VECTOR_HPP
+
+/**
+ * @brief Containers that grow in place on the PMEM. Each container owns one region from pmem_reserve(): the address
+ * range for its largest size is reserved up front and growth only extends the file behind it, so elements are never
+ * copied and pointers into the container stay valid until it shrinks.
+ *
+ *     pmem::vector<record> v("/pmem/tmp");
+ *     v.push_back(r);
+ *     pmem::string s("/pmem/tmp");
+ *     s += "key=";
+ *
+ * With Persistent = true the size is kept in a header at the start of the file and every append is flushed before the
+ * size is published, so the container can be reopened with open() after close() or a crash.
+ *
+ * Requires C++17.
+ */
+
+#include <tmax_pmem.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace pmem
+{
+
+/**
+ * @brief Address space reserved for a container unless told otherwise. It costs no memory.
+ */
+constexpr std::size_t default_reserve = std::size_t(1) << 36;
+
+namespace detail
+{
+constexpr std::uint64_t vector_magic = 0x31524f5443455650ULL; // "PVECTOR1"
+
+// Start of the file of a persistent container
+struct vector_header
+{
+    std::uint64_t magic;
+    std::uint64_t elem_size;
+    std::uint64_t size;
+};
+} // namespace detail
+
+template <class T, bool Persistent = false>
+class vector
+{
+    static_assert(!Persistent || std::is_trivially_copyable_v<T>, "persistent pmem::vector needs trivially copyable types");
+
+public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using reference = T &;
+    using const_reference = const T &;
+    using pointer = T *;
+    using const_pointer = const T *;
+    using iterator = T *;
+    using const_iterator = const T *;
+
+    vector() noexcept = default;
+
+    /**
+     * @brief Create an empty vector in a new file in dir, which can grow to reserve bytes.
+     */
+    explicit vector(const char *dir, std::size_t reserve = default_reserve)
+    {
+        base_ = static_cast<char *>(pmem_reserve(dir, reserve, data_offset + sizeof(T), &file_));
+        if (base_ == nullptr)
+            throw std::bad_alloc();
+        if constexpr (Persistent)
+        {
+            *header() = detail::vector_header{detail::vector_magic, sizeof(T), 0};
+            pmem_persist(header(), sizeof(detail::vector_header));
+        }
+    }
+
+    /**
+     * @brief Map a persistent vector kept by close(). The mapping is moved into a reservation of reserve bytes, so the
+     * vector grows in place again. Throws std::runtime_error if the file does not hold a vector of T.
+     */
+    static vector open(const char *path, std::size_t reserve = default_reserve)
+    {
+        static_assert(Persistent, "only persistent vectors can be reopened");
+
+        struct pmem_file *file;
+        void *addr = pmem_open(path, nullptr, &file);
+        if (addr == nullptr)
+            throw std::bad_alloc();
+
+        const auto *hdr = static_cast<const detail::vector_header *>(addr);
+        const std::size_t size = file->current_size;
+        if (size < data_offset || hdr->magic != detail::vector_magic || hdr->elem_size != sizeof(T) ||
+            hdr->size > (size - data_offset) / sizeof(T))
+        {
+            (void)pmem_close(addr, &file);
+            throw std::runtime_error("not a pmem::vector of this type");
+        }
+
+        void *base = pmem_remap_reserved(addr, std::max(reserve, size), &file);
+        if (base == nullptr)
+        {
+            (void)pmem_close(addr, &file);
+            throw std::bad_alloc();
+        }
+
+        vector v;
+        v.base_ = static_cast<char *>(base);
+        v.file_ = file;
+        v.size_ = v.header()->size;
+        return v;
+    }
+
+    ~vector()
+    {
+        reset();
+    }
+
+    vector(const vector &) = delete;
+    vector &operator=(const vector &) = delete;
+
+    vector(vector &&other) noexcept
+        : base_(std::exchange(other.base_, nullptr)), file_(std::exchange(other.file_, nullptr)),
+          size_(std::exchange(other.size_, 0))
+    {
+    }
+
+    vector &operator=(vector &&other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            base_ = std::exchange(other.base_, nullptr);
+            file_ = std::exchange(other.file_, nullptr);
+            size_ = std::exchange(other.size_, 0);
+        }
+        return *this;
+    }
+
+    /**
+     * @brief Destroy the elements, unmap the region and remove its file. The vector is empty afterwards.
+     */
+    void reset() noexcept
+    {
+        if (base_ == nullptr)
+            return;
+        destroy(begin(), end());
+        (void)pmem_free(base_, &file_);
+        base_ = nullptr;
+        file_ = nullptr;
+        size_ = 0;
+    }
+
+    /**
+     * @brief Unmap the region but keep its file for open(). The vector is empty afterwards.
+     */
+    void close() noexcept
+    {
+        static_assert(Persistent, "only persistent vectors can be kept");
+
+        if (base_ == nullptr)
+            return;
+        (void)pmem_close(base_, &file_);
+        base_ = nullptr;
+        file_ = nullptr;
+        size_ = 0;
+    }
+
+    const char *path() const noexcept
+    {
+        return file_ ? file_->fullpath : nullptr;
+    }
+
+    std::size_t size() const noexcept
+    {
+        return size_;
+    }
+
+    bool empty() const noexcept
+    {
+        return size_ == 0;
+    }
+
+    std::size_t capacity() const noexcept
+    {
+        return file_ ? (file_->current_size - data_offset) / sizeof(T) : 0;
+    }
+
+    std::size_t max_size() const noexcept
+    {
+        return file_ ? (file_->reserved_size - data_offset) / sizeof(T) : 0;
+    }
+
+    T *data() noexcept
+    {
+        return reinterpret_cast<T *>(base_ + data_offset);
+    }
+
+    const T *data() const noexcept
+    {
+        return reinterpret_cast<const T *>(base_ + data_offset);
+    }
+
+    iterator begin() noexcept
+    {
+        return data();
+    }
+
+    iterator end() noexcept
+    {
+        return data() + size_;
+    }
+
+    const_iterator begin() const noexcept
+    {
+        return data();
+    }
+
+    const_iterator end() const noexcept
+    {
+        return data() + size_;
+    }
+
+    T &operator[](std::size_t i) noexcept
+    {
+        return data()[i];
+    }
+
+    const T &operator[](std::size_t i) const noexcept
+    {
+        return data()[i];
+    }
+
+    T &at(std::size_t i)
+    {
+        if (i >= size_)
+            throw std::out_of_range("pmem::vector::at");
+        return data()[i];
+    }
+
+    const T &at(std::size_t i) const
+    {
+        if (i >= size_)
+            throw std::out_of_range("pmem::vector::at");
+        return data()[i];
+    }
+
+    T &front() noexcept
+    {
+        return data()[0];
+    }
+
+    T &back() noexcept
+    {
+        return data()[size_ - 1];
+    }
+
+    /**
+     * @brief Make room for n elements. The elements stay where they are.
+     */
+    void reserve(std::size_t n)
+    {
+        if (n > capacity())
+            grow(n);
+    }
+
+    template <class... Args>
+    T &emplace_back(Args &&...args)
+    {
+        if (size_ == capacity())
+            grow(size_ + 1);
+        T *slot = data() + size_;
+        ::new (static_cast<void *>(slot)) T(std::forward<Args>(args)...);
+        if constexpr (Persistent)
+            pmem_persist(slot, sizeof(T));
+        publish(size_ + 1);
+        return *slot;
+    }
+
+    void push_back(const T &value)
+    {
+        emplace_back(value);
+    }
+
+    void push_back(T &&value)
+    {
+        emplace_back(std::move(value));
+    }
+
+    void pop_back() noexcept
+    {
+        std::destroy_at(data() + size_ - 1);
+        publish(size_ - 1);
+    }
+
+    /**
+     * @brief Append n elements copied from first. Trivially copyable elements of a persistent vector are written with
+     * non-temporal stores.
+     */
+    void append(const T *first, std::size_t n)
+    {
+        if (size_ + n > capacity())
+            grow(size_ + n);
+        if constexpr (Persistent)
+            (void)pmem_memcpy_nt(data() + size_, first, n * sizeof(T));
+        else
+            std::uninitialized_copy_n(first, n, data() + size_);
+        publish(size_ + n);
+    }
+
+    void resize(std::size_t n)
+    {
+        if (n < size_)
+        {
+            destroy(data() + n, end());
+            publish(n);
+            return;
+        }
+        reserve(n);
+        std::uninitialized_value_construct(end(), data() + n);
+        if constexpr (Persistent)
+            pmem_persist(end(), (n - size_) * sizeof(T));
+        publish(n);
+    }
+
+    void resize(std::size_t n, const T &value)
+    {
+        if (n < size_)
+        {
+            destroy(data() + n, end());
+            publish(n);
+            return;
+        }
+        reserve(n);
+        std::uninitialized_fill(end(), data() + n, value);
+        if constexpr (Persistent)
+            pmem_persist(end(), (n - size_) * sizeof(T));
+        publish(n);
+    }
+
+    void clear() noexcept
+    {
+        destroy(begin(), end());
+        publish(0);
+    }
+
+    /**
+     * @brief Give the pages behind the last element back to the file system and the reservation.
+     */
+    void shrink_to_fit() noexcept
+    {
+        if (base_ != nullptr)
+            (void)pmem_extend(base_, data_offset + std::max<std::size_t>(size_, 1) * sizeof(T), &file_);
+    }
+
+    /**
+     * @brief Write back elements [first, first + n) after changing them in place, e.g. through operator[].
+     */
+    void persist(std::size_t first = 0, std::size_t n = std::size_t(-1)) const noexcept
+    {
+        if (first >= size_)
+            return;
+        pmem_persist(data() + first, std::min(n, size_ - first) * sizeof(T));
+    }
+
+private:
+    static constexpr std::size_t data_offset =
+        Persistent ? std::max<std::size_t>(64, alignof(T)) : 0;
+
+    detail::vector_header *header() const noexcept
+    {
+        return reinterpret_cast<detail::vector_header *>(base_);
+    }
+
+    // Extend the file to hold at least n elements, doubling to keep the number of calls logarithmic
+    void grow(std::size_t n)
+    {
+        if (base_ == nullptr || n > max_size())
+            throw std::bad_alloc();
+        std::size_t want = std::min(std::max(n, capacity() * 2), max_size());
+        if (pmem_extend(base_, data_offset + want * sizeof(T), &file_) != SUCCESS)
+            throw std::bad_alloc();
+    }
+
+    // Set the size; a persistent vector publishes it after the elements it covers
+    void publish(std::size_t n) noexcept
+    {
+        size_ = n;
+        if constexpr (Persistent)
+        {
+            header()->size = n;
+            pmem_persist(&header()->size, sizeof(header()->size));
+        }
+    }
+
+    static void destroy(T *first, T *last) noexcept
+    {
+        if constexpr (!std::is_trivially_destructible_v<T>)
+            std::destroy(first, last);
+    }
+
+    char *base_ = nullptr;
+    struct pmem_file *file_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+/**
+ * @brief NUL-terminated string over a pmem::vector of characters. The terminator is kept in the spare capacity, so
+ * c_str() is always valid and appends never copy the existing characters.
+ */
+template <class CharT, bool Persistent = false>
+class basic_string
+{
+public:
+    using value_type = CharT;
+    using size_type = std::size_t;
+    using iterator = CharT *;
+    using const_iterator = const CharT *;
+    using view_type = std::basic_string_view<CharT>;
+
+    basic_string() noexcept = default;
+
+    explicit basic_string(const char *dir, std::size_t reserve = default_reserve) : chars_(dir, reserve)
+    {
+        terminate();
+    }
+
+    basic_string(const char *dir, view_type s, std::size_t reserve = default_reserve) : chars_(dir, reserve)
+    {
+        append(s);
+    }
+
+    /**
+     * @brief Map a persistent string kept by close().
+     */
+    static basic_string open(const char *path, std::size_t reserve = default_reserve)
+    {
+        basic_string s;
+        s.chars_ = vector<CharT, Persistent>::open(path, reserve);
+        s.chars_.reserve(s.chars_.size() + 1);
+        s.terminate();
+        return s;
+    }
+
+    basic_string(basic_string &&) noexcept = default;
+    basic_string &operator=(basic_string &&) noexcept = default;
+
+    void reset() noexcept
+    {
+        chars_.reset();
+    }
+
+    void close() noexcept
+    {
+        chars_.close();
+    }
+
+    const char *path() const noexcept
+    {
+        return chars_.path();
+    }
+
+    std::size_t size() const noexcept
+    {
+        return chars_.size();
+    }
+
+    std::size_t length() const noexcept
+    {
+        return chars_.size();
+    }
+
+    bool empty() const noexcept
+    {
+        return chars_.empty();
+    }
+
+    std::size_t capacity() const noexcept
+    {
+        return chars_.capacity() ? chars_.capacity() - 1 : 0;
+    }
+
+    CharT *data() noexcept
+    {
+        return chars_.data();
+    }
+
+    const CharT *data() const noexcept
+    {
+        return chars_.data();
+    }
+
+    const CharT *c_str() const noexcept
+    {
+        static const CharT empty_string[1] = {};
+        return chars_.capacity() ? chars_.data() : empty_string;
+    }
+
+    iterator begin() noexcept
+    {
+        return chars_.begin();
+    }
+
+    iterator end() noexcept
+    {
+        return chars_.end();
+    }
+
+    const_iterator begin() const noexcept
+    {
+        return chars_.begin();
+    }
+
+    const_iterator end() const noexcept
+    {
+        return chars_.end();
+    }
+
+    CharT &operator[](std::size_t i) noexcept
+    {
+        return chars_[i];
+    }
+
+    const CharT &operator[](std::size_t i) const noexcept
+    {
+        return chars_[i];
+    }
+
+    operator view_type() const noexcept
+    {
+        return view_type(c_str(), size());
+    }
+
+    void reserve(std::size_t n)
+    {
+        chars_.reserve(n + 1);
+    }
+
+    basic_string &append(const CharT *s, std::size_t n)
+    {
+        chars_.reserve(chars_.size() + n + 1);
+        chars_.append(s, n);
+        terminate();
+        return *this;
+    }
+
+    basic_string &append(view_type s)
+    {
+        return append(s.data(), s.size());
+    }
+
+    void push_back(CharT c)
+    {
+        chars_.reserve(chars_.size() + 2);
+        chars_.push_back(c);
+        terminate();
+    }
+
+    basic_string &operator+=(view_type s)
+    {
+        return append(s);
+    }
+
+    basic_string &operator+=(CharT c)
+    {
+        push_back(c);
+        return *this;
+    }
+
+    void resize(std::size_t n, CharT c = CharT())
+    {
+        chars_.reserve(n + 1);
+        chars_.resize(n, c);
+        terminate();
+    }
+
+    void clear() noexcept
+    {
+        chars_.clear();
+        terminate();
+    }
+
+    void shrink_to_fit() noexcept
+    {
+        chars_.shrink_to_fit();
+    }
+
+    void persist() const noexcept
+    {
+        chars_.persist();
+    }
+
+private:
+    // The terminator lies beyond the size, so it is never needed to recover a persistent string
+    void terminate() noexcept
+    {
+        if (chars_.capacity() > chars_.size())
+            chars_.data()[chars_.size()] = CharT();
+    }
+
+    vector<CharT, Persistent> chars_;
+};
+
+using string = basic_string<char>;
+using persistent_string = basic_string<char, true>;
+
+template <class T>
+using persistent_vector = vector<T, true>;
+
+} // namespace pmem
+
+#endif
@@ -0,0 +1,566 @@
+/**
+ * @brief Allocator micro-benchmark. Measures the latency distribution of every allocation and free, and the throughput,
+ * across block sizes, thread counts and allocate/free patterns, and prints the results as JSON.
+ *
+ *     pmem_bench -d /pmem/tmp -b malloc,heap -s 64,4096,1m -t 1,2,4,8 -p lifo,fifo,random,prodcons > bench.json
+ *
+ * Backends:
+ *   malloc    pmem_malloc() / pmem_free(), one file per block
+ *   heap      pmem_heap_alloc() / pmem_heap_free() on one shared heap
+ *
+ * Patterns, each thread keeping up to window blocks alive:
+ *   lifo      allocate window blocks, free them newest first
+ *   fifo      once window blocks are alive, free the oldest before every allocation
+ *   random    replace a random one of window slots on every step
+ *   prodcons  threads in pairs: one allocates and hands the blocks over a queue, the other frees them
+ */
+
+#define _GNU_SOURCE
+#include <tmax_pmem.h>
+#include <tmax_pmem_heap.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_MAX_LIST 32
+
+enum bench_backend
+{
+    BENCH_MALLOC,
+    BENCH_HEAP
+};
+
+enum bench_pattern
+{
+    BENCH_LIFO,
+    BENCH_FIFO,
+    BENCH_RANDOM,
+    BENCH_PRODCONS
+};
+
+static const char *bench_backend_names[] = {"malloc", "heap"};
+static const char *bench_pattern_names[] = {"lifo", "fifo", "random", "prodcons"};
+
+struct bench_block
+{
+    void *addr;
+    struct pmem_file *pfile;
+};
+
+// Single producer, single consumer queue between the threads of a pair
+struct bench_queue
+{
+    struct bench_block *slots;
+    size_t capacity;
+    size_t head; // next slot to pop, written by the consumer
+    size_t tail; // next slot to push, written by the producer
+};
+
+struct bench_run
+{
+    const char *dir;
+    enum bench_backend backend;
+    enum bench_pattern pattern;
+    struct pmem_heap *heap;
+    size_t size;
+    size_t ops;    // allocations per thread
+    size_t window; // blocks alive per thread
+    pthread_barrier_t barrier;
+    int failed;
+};
+
+struct bench_thread
+{
+    struct bench_run *run;
+    pthread_t tid;
+    unsigned id;
+    struct bench_queue *queue; // prodcons only
+    int producer;
+    uint64_t *alloc_ns;
+    size_t nalloc;
+    uint64_t *free_ns;
+    size_t nfree;
+};
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_alloc(struct bench_thread *t, struct bench_block *b)
+{
+    struct bench_run *run = t->run;
+    uint64_t start = bench_now();
+
+    if (run->backend == BENCH_HEAP)
+        b->addr = pmem_heap_alloc(run->heap, run->size, 16);
+    else
+        b->addr = pmem_malloc(run->dir, NULL, run->size, &b->pfile);
+    t->alloc_ns[t->nalloc++] = bench_now() - start;
+    if (b->addr == NULL)
+    {
+        __atomic_store_n(&run->failed, 1, __ATOMIC_RELAXED);
+        return ERROR_MMAP;
+    }
+    // Touch the block like a caller would
+    *(volatile char *)b->addr = 1;
+
+    return SUCCESS;
+}
+
+static void bench_free(struct bench_thread *t, struct bench_block *b)
+{
+    struct bench_run *run = t->run;
+    uint64_t start = bench_now();
+
+    if (run->backend == BENCH_HEAP)
+        pmem_heap_free(run->heap, b->addr, run->size, 16);
+    else
+        (void)pmem_free(b->addr, &b->pfile);
+    t->free_ns[t->nfree++] = bench_now() - start;
+    b->addr = NULL;
+}
+
+static void bench_lifo(struct bench_thread *t, struct bench_block *blocks)
+{
+    size_t done = 0;
+
+    while (done < t->run->ops)
+    {
+        size_t n = t->run->window < t->run->ops - done ? t->run->window : t->run->ops - done;
+        size_t i;
+
+        for (i = 0; i < n; i++)
+            if (bench_alloc(t, &blocks[i]))
+                break;
+        while (i > 0)
+            bench_free(t, &blocks[--i]);
+        done += n;
+        if (t->run->failed)
+            return;
+    }
+}
+
+static void bench_fifo(struct bench_thread *t, struct bench_block *blocks)
+{
+    size_t window = t->run->window;
+    size_t i;
+
+    for (i = 0; i < t->run->ops && !t->run->failed; i++)
+    {
+        struct bench_block *b = &blocks[i % window];
+        if (b->addr != NULL)
+            bench_free(t, b);
+        (void)bench_alloc(t, b);
+    }
+    for (i = 0; i < window; i++)
+        if (blocks[i].addr != NULL)
+            bench_free(t, &blocks[i]);
+}
+
+static void bench_random(struct bench_thread *t, struct bench_block *blocks)
+{
+    uint64_t x = 0x9E3779B97F4A7C15ULL * (t->id + 1);
+    size_t window = t->run->window;
+    size_t i;
+
+    for (i = 0; i < t->run->ops && !t->run->failed; i++)
+    {
+        struct bench_block *b;
+
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        b = &blocks[x % window];
+        if (b->addr != NULL)
+            bench_free(t, b);
+        (void)bench_alloc(t, b);
+    }
+    for (i = 0; i < window; i++)
+        if (blocks[i].addr != NULL)
+            bench_free(t, &blocks[i]);
+}
+
+static void bench_produce(struct bench_thread *t)
+{
+    struct bench_queue *q = t->queue;
+    size_t i;
+
+    for (i = 0; i < t->run->ops; i++)
+    {
+        struct bench_block b = {NULL, NULL};
+
+        if (t->run->failed || bench_alloc(t, &b))
+            break;
+        // The consumer drains the queue until it sees the end marker, so waiting for a slot always ends
+        while (q->tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == q->capacity)
+            ;
+        q->slots[q->tail % q->capacity] = b;
+        __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+    }
+    // An empty block tells the consumer to stop
+    while (q->tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == q->capacity)
+        ;
+    q->slots[q->tail % q->capacity].addr = NULL;
+    __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+}
+
+static void bench_consume(struct bench_thread *t)
+{
+    struct bench_queue *q = t->queue;
+
+    for (;;)
+    {
+        struct bench_block b;
+
+        while (__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == q->head)
+            ;
+        b = q->slots[q->head % q->capacity];
+        __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+        if (b.addr == NULL)
+            return;
+        bench_free(t, &b);
+    }
+}
+
+static void *bench_thread_main(void *arg)
+{
+    struct bench_thread *t = (struct bench_thread *)arg;
+    struct bench_block *blocks = (struct bench_block *)calloc(t->run->window, sizeof(struct bench_block));
+
+    pthread_barrier_wait(&t->run->barrier);
+    if (blocks == NULL)
+    {
+        __atomic_store_n(&t->run->failed, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        switch (t->run->pattern)
+        {
+        case BENCH_LIFO:
+            bench_lifo(t, blocks);
+            break;
+        case BENCH_FIFO:
+            bench_fifo(t, blocks);
+            break;
+        case BENCH_RANDOM:
+            bench_random(t, blocks);
+            break;
+        case BENCH_PRODCONS:
+            if (t->producer)
+                bench_produce(t);
+            else
+                bench_consume(t);
+            break;
+        }
+    }
+    pthread_barrier_wait(&t->run->barrier);
+    free(blocks);
+
+    return NULL;
+}
+
+static int bench_cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void bench_print_latency(const char *name, uint64_t *ns, size_t n)
+{
+    static const double percentiles[] = {50, 90, 99, 99.9};
+    static const char *labels[] = {"p50", "p90", "p99", "p999"};
+    long double sum = 0;
+    size_t i;
+
+    printf("\"%s\": {\"count\": %zu", name, n);
+    if (n == 0)
+    {
+        printf("}");
+        return;
+    }
+    qsort(ns, n, sizeof(uint64_t), bench_cmp_u64);
+    for (i = 0; i < n; i++)
+        sum += ns[i];
+    printf(", \"mean\": %.1f, \"min\": %llu", (double)(sum / n), (unsigned long long)ns[0]);
+    for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+    {
+        size_t rank = (size_t)(percentiles[i] / 100.0 * (n - 1) + 0.5);
+        printf(", \"%s\": %llu", labels[i], (unsigned long long)ns[rank]);
+    }
+    printf(", \"max\": %llu}", (unsigned long long)ns[n - 1]);
+}
+
+/**
+ * @brief Run one configuration and print its JSON object. Producer-consumer runs use an even number of threads; with
+ * fewer than two nothing is run or printed.
+ */
+static int bench_one(struct bench_run *run, unsigned nthreads, int first)
+{
+    struct bench_thread *threads;
+    struct bench_queue *queues = NULL;
+    uint64_t *alloc_ns, *free_ns;
+    size_t nalloc = 0, nfree = 0;
+    uint64_t start, elapsed;
+    unsigned i;
+    int err = SUCCESS;
+
+    if (run->pattern == BENCH_PRODCONS)
+        nthreads &= ~1u;
+    if (nthreads == 0)
+        return ERROR_INVALID;
+
+    threads = (struct bench_thread *)calloc(nthreads, sizeof(struct bench_thread));
+    alloc_ns = (uint64_t *)malloc(nthreads * run->ops * sizeof(uint64_t));
+    free_ns = (uint64_t *)malloc(nthreads * run->ops * sizeof(uint64_t));
+    if (run->pattern == BENCH_PRODCONS)
+        queues = (struct bench_queue *)calloc(nthreads / 2, sizeof(struct bench_queue));
+    if (threads == NULL || alloc_ns == NULL || free_ns == NULL || (run->pattern == BENCH_PRODCONS && queues == NULL))
+    {
+        err = ERROR_MALLOC;
+        goto exit;
+    }
+    for (i = 0; i < nthreads; i++)
+    {
+        threads[i].run = run;
+        threads[i].id = i;
+        threads[i].alloc_ns = alloc_ns + (size_t)i * run->ops;
+        threads[i].free_ns = free_ns + (size_t)i * run->ops;
+        if (queues != NULL)
+        {
+            struct bench_queue *q = &queues[i / 2];
+            if (i % 2 == 0)
+            {
+                q->capacity = run->window;
+                q->slots = (struct bench_block *)calloc(q->capacity, sizeof(struct bench_block));
+                if (q->slots == NULL)
+                {
+                    err = ERROR_MALLOC;
+                    goto exit;
+                }
+            }
+            threads[i].queue = q;
+            threads[i].producer = i % 2 == 0;
+        }
+    }
+
+    run->failed = 0;
+    pthread_barrier_init(&run->barrier, NULL, nthreads + 1);
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&threads[i].tid, NULL, bench_thread_main, &threads[i]);
+    pthread_barrier_wait(&run->barrier);
+    start = bench_now();
+    pthread_barrier_wait(&run->barrier);
+    elapsed = bench_now() - start;
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i].tid, NULL);
+    pthread_barrier_destroy(&run->barrier);
+
+    // Gather the samples of all threads at the front of the arrays
+    for (i = 0; i < nthreads; i++)
+    {
+        memmove(alloc_ns + nalloc, threads[i].alloc_ns, threads[i].nalloc * sizeof(uint64_t));
+        nalloc += threads[i].nalloc;
+        memmove(free_ns + nfree, threads[i].free_ns, threads[i].nfree * sizeof(uint64_t));
+        nfree += threads[i].nfree;
+    }
+
+    printf("%s    {\"backend\": \"%s\", \"pattern\": \"%s\", \"size\": %zu, \"threads\": %u, \"window\": %zu, ",
+           first ? "" : ",\n", bench_backend_names[run->backend], bench_pattern_names[run->pattern], run->size, nthreads,
+           run->window);
+    printf("\"ok\": %s, \"seconds\": %.6f, \"ops_per_sec\": %.1f,\n     ", run->failed ? "false" : "true",
+           elapsed / 1e9, elapsed ? nalloc / (elapsed / 1e9) : 0.0);
+    bench_print_latency("alloc_ns", alloc_ns, nalloc);
+    printf(",\n     ");
+    bench_print_latency("free_ns", free_ns, nfree);
+    printf("}");
+    fflush(stdout);
+
+exit:
+    if (queues != NULL)
+        for (i = 0; i < nthreads / 2; i++)
+            free(queues[i].slots);
+    free(queues);
+    free(alloc_ns);
+    free(free_ns);
+    free(threads);
+    return err;
+}
+
+static int bench_parse_size(const char *s, size_t *size)
+{
+    char *end;
+    unsigned long long v;
+
+    errno = 0;
+    v = strtoull(s, &end, 10);
+    if (errno || end == s)
+        return ERROR_INVALID;
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        v <<= 10;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        v <<= 20;
+        end++;
+        break;
+    case 'g':
+    case 'G':
+        v <<= 30;
+        end++;
+        break;
+    }
+    if (*end != '\0' || v == 0)
+        return ERROR_INVALID;
+    *size = v;
+
+    return SUCCESS;
+}
+
+// Parse a comma separated list of sizes
+static int bench_parse_sizes(char *s, size_t *list, int *n)
+{
+    char *tok, *save;
+
+    for (*n = 0, tok = strtok_r(s, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save))
+        if (*n == BENCH_MAX_LIST || bench_parse_size(tok, &list[(*n)++]))
+            return ERROR_INVALID;
+
+    return *n ? SUCCESS : ERROR_INVALID;
+}
+
+// Parse a comma separated list of names
+static int bench_parse_names(char *s, const char **names, int nnames, int *list, int *n)
+{
+    char *tok, *save;
+
+    for (*n = 0, tok = strtok_r(s, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save))
+    {
+        int i;
+        for (i = 0; i < nnames && strcmp(tok, names[i]); i++)
+            ;
+        if (i == nnames || *n == BENCH_MAX_LIST)
+            return ERROR_INVALID;
+        list[(*n)++] = i;
+    }
+
+    return *n ? SUCCESS : ERROR_INVALID;
+}
+
+static void bench_usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-d dir] [-b malloc,heap] [-s sizes] [-t threads] [-p lifo,fifo,random,prodcons]\n"
+            "          [-n ops per thread] [-w window] [-c heap capacity]\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    char default_backends[] = "malloc,heap";
+    char default_sizes[] = "64,4k,64k,1m";
+    char default_threads[] = "1,2,4";
+    char default_patterns[] = "lifo,fifo,random,prodcons";
+    char *backends_arg = default_backends, *sizes_arg = default_sizes;
+    char *threads_arg = default_threads, *patterns_arg = default_patterns;
+    size_t sizes[BENCH_MAX_LIST], threads[BENCH_MAX_LIST];
+    int backends[BENCH_MAX_LIST], patterns[BENCH_MAX_LIST];
+    int nsizes, nthreads, nbackends, npatterns;
+    size_t capacity = 4UL << 30;
+    struct bench_run run;
+    char host[256] = "";
+    int b, p, s, t, opt, first = 1;
+
+    memset(&run, 0, sizeof(run));
+    run.dir = "/pmem/tmp";
+    run.ops = 1000;
+    run.window = 64;
+
+    while ((opt = getopt(argc, argv, "d:b:s:t:p:n:w:c:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            run.dir = optarg;
+            break;
+        case 'b':
+            backends_arg = optarg;
+            break;
+        case 's':
+            sizes_arg = optarg;
+            break;
+        case 't':
+            threads_arg = optarg;
+            break;
+        case 'p':
+            patterns_arg = optarg;
+            break;
+        case 'n':
+            if (bench_parse_size(optarg, &run.ops))
+                goto usage;
+            break;
+        case 'w':
+            if (bench_parse_size(optarg, &run.window))
+                goto usage;
+            break;
+        case 'c':
+            if (bench_parse_size(optarg, &capacity))
+                goto usage;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (bench_parse_names(backends_arg, bench_backend_names, 2, backends, &nbackends) ||
+        bench_parse_sizes(sizes_arg, sizes, &nsizes) || bench_parse_sizes(threads_arg, threads, &nthreads) ||
+        bench_parse_names(patterns_arg, bench_pattern_names, 4, patterns, &npatterns))
+        goto usage;
+
+    (void)gethostname(host, sizeof(host) - 1);
+    printf("{\"benchmark\": \"pmem_bench\", \"host\": \"%s\", \"cpus\": %ld, \"dir\": \"%s\", \"timestamp\": %ld,\n",
+           host, sysconf(_SC_NPROCESSORS_ONLN), run.dir, (long)time(NULL));
+    printf(" \"ops_per_thread\": %zu, \"results\": [\n", run.ops);
+
+    for (b = 0; b < nbackends; b++)
+    {
+        run.backend = (enum bench_backend)backends[b];
+        run.heap = NULL;
+        if (run.backend == BENCH_HEAP && pmem_heap_create(run.dir, capacity, &run.heap) != SUCCESS)
+        {
+            fprintf(stderr, "[%s] could not create a heap of %zu bytes in %s\n", __func__, capacity, run.dir);
+            continue;
+        }
+        for (s = 0; s < nsizes; s++)
+            for (p = 0; p < npatterns; p++)
+                for (t = 0; t < nthreads; t++)
+                {
+                    run.size = sizes[s];
+                    run.pattern = (enum bench_pattern)patterns[p];
+                    if (bench_one(&run, (unsigned)threads[t], first) == SUCCESS)
+                        first = 0;
+                }
+        if (run.heap != NULL)
+            (void)pmem_heap_destroy(run.heap);
+    }
+    printf("\n]}\n");
+
+    return 0;
+
+usage:
+    bench_usage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,292 @@
+/**
+ * @brief Directory scaling benchmark. Threads create and delete named files in a loop, as pmem_malloc() and pmem_free()
+ * do, across thread and shard counts, and report the throughput, latencies and sleeps on locks as JSON. Without shards
+ * all threads of the process serialise on the lock of one directory.
+ *
+ *     pmem_dirbench -d /pmem/tmp -t 1,4,16,64 -S 1,4,16,64 > dirbench.json
+ *
+ * Each thread keeps up to window files alive, deleting the oldest before every creation, so the directories hold as
+ * many entries as a busy process would.
+ */
+
+#define _GNU_SOURCE
+#include <tmax_pmem.h>
+#include <tmax_pmem_dir.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DIRBENCH_MAX_LIST 32
+
+struct dirbench_run
+{
+    const char *dir;
+    size_t ops;    // creations per thread
+    size_t window; // files alive per thread
+    pthread_barrier_t barrier;
+    int failed;
+};
+
+struct dirbench_thread
+{
+    struct dirbench_run *run;
+    pthread_t tid;
+    uint64_t *create_ns;
+    size_t ncreate;
+    uint64_t *unlink_ns;
+    size_t nunlink;
+};
+
+static uint64_t dirbench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void dirbench_unlink(struct dirbench_thread *t, struct pmem_file *file)
+{
+    uint64_t start = dirbench_now();
+
+    (void)close(file->fd);
+    (void)unlink(file->fullpath);
+    t->unlink_ns[t->nunlink++] = dirbench_now() - start;
+    free(file->fullpath);
+    file->fullpath = NULL;
+}
+
+static void *dirbench_thread_main(void *arg)
+{
+    struct dirbench_thread *t = (struct dirbench_thread *)arg;
+    struct dirbench_run *run = t->run;
+    struct pmem_file *files = (struct pmem_file *)calloc(run->window, sizeof(struct pmem_file));
+    struct pmem_file *file;
+    uint64_t start;
+    size_t i;
+
+    pthread_barrier_wait(&run->barrier);
+    for (i = 0; files != NULL && i < run->ops && !__atomic_load_n(&run->failed, __ATOMIC_RELAXED); i++)
+    {
+        file = &files[i % run->window];
+        if (file->fullpath != NULL)
+            dirbench_unlink(t, file);
+        start = dirbench_now();
+        if (pmem_create_tmpfile(run->dir, &file) != SUCCESS)
+        {
+            __atomic_store_n(&run->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        t->create_ns[t->ncreate++] = dirbench_now() - start;
+    }
+    for (i = 0; files != NULL && i < run->window; i++)
+        if (files[i].fullpath != NULL)
+            dirbench_unlink(t, &files[i]);
+    if (files == NULL)
+        __atomic_store_n(&run->failed, 1, __ATOMIC_RELAXED);
+    pthread_barrier_wait(&run->barrier);
+    free(files);
+
+    return NULL;
+}
+
+static int dirbench_cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void dirbench_print_latency(const char *name, uint64_t *ns, size_t n)
+{
+    static const double percentiles[] = {50, 90, 99, 99.9};
+    static const char *labels[] = {"p50", "p90", "p99", "p999"};
+    long double sum = 0;
+    size_t i;
+
+    printf("\"%s\": {\"count\": %zu", name, n);
+    if (n == 0)
+    {
+        printf("}");
+        return;
+    }
+    qsort(ns, n, sizeof(uint64_t), dirbench_cmp_u64);
+    for (i = 0; i < n; i++)
+        sum += ns[i];
+    printf(", \"mean\": %.1f, \"min\": %llu", (double)(sum / n), (unsigned long long)ns[0]);
+    for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+    {
+        size_t rank = (size_t)(percentiles[i] / 100.0 * (n - 1) + 0.5);
+        printf(", \"%s\": %llu", labels[i], (unsigned long long)ns[rank]);
+    }
+    printf(", \"max\": %llu}", (unsigned long long)ns[n - 1]);
+}
+
+/**
+ * @brief Run one configuration and print its JSON object.
+ */
+static int dirbench_one(struct dirbench_run *run, unsigned nthreads, unsigned shards, int first)
+{
+    struct dirbench_thread *threads;
+    uint64_t *create_ns, *unlink_ns;
+    size_t ncreate = 0, nunlink = 0;
+    struct rusage before, after;
+    uint64_t start, elapsed;
+    long sleeps;
+    unsigned i;
+    int err = SUCCESS;
+
+    if (nthreads == 0 || pmem_set_shards(shards) != SUCCESS)
+        return ERROR_INVALID;
+
+    threads = (struct dirbench_thread *)calloc(nthreads, sizeof(struct dirbench_thread));
+    create_ns = (uint64_t *)malloc(nthreads * run->ops * sizeof(uint64_t));
+    unlink_ns = (uint64_t *)malloc(nthreads * run->ops * sizeof(uint64_t));
+    if (threads == NULL || create_ns == NULL || unlink_ns == NULL)
+    {
+        err = ERROR_MALLOC;
+        goto exit;
+    }
+    for (i = 0; i < nthreads; i++)
+    {
+        threads[i].run = run;
+        threads[i].create_ns = create_ns + (size_t)i * run->ops;
+        threads[i].unlink_ns = unlink_ns + (size_t)i * run->ops;
+    }
+
+    run->failed = 0;
+    pthread_barrier_init(&run->barrier, NULL, nthreads + 1);
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&threads[i].tid, NULL, dirbench_thread_main, &threads[i]);
+    pthread_barrier_wait(&run->barrier);
+    (void)getrusage(RUSAGE_SELF, &before);
+    start = dirbench_now();
+    pthread_barrier_wait(&run->barrier);
+    elapsed = dirbench_now() - start;
+    (void)getrusage(RUSAGE_SELF, &after);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i].tid, NULL);
+    pthread_barrier_destroy(&run->barrier);
+
+    // Gather the samples of all threads at the front of the arrays
+    for (i = 0; i < nthreads; i++)
+    {
+        memmove(create_ns + ncreate, threads[i].create_ns, threads[i].ncreate * sizeof(uint64_t));
+        ncreate += threads[i].ncreate;
+        memmove(unlink_ns + nunlink, threads[i].unlink_ns, threads[i].nunlink * sizeof(uint64_t));
+        nunlink += threads[i].nunlink;
+    }
+    sleeps = after.ru_nvcsw - before.ru_nvcsw;
+
+    printf("%s    {\"threads\": %u, \"shards\": %u, \"window\": %zu, ", first ? "" : ",\n", nthreads, shards,
+           run->window);
+    printf("\"ok\": %s, \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"sleeps_per_op\": %.3f,\n     ",
+           run->failed ? "false" : "true", elapsed / 1e9, elapsed ? ncreate / (elapsed / 1e9) : 0.0,
+           ncreate ? (double)sleeps / ncreate : 0.0);
+    dirbench_print_latency("create_ns", create_ns, ncreate);
+    printf(",\n     ");
+    dirbench_print_latency("unlink_ns", unlink_ns, nunlink);
+    printf("}");
+    fflush(stdout);
+
+exit:
+    free(create_ns);
+    free(unlink_ns);
+    free(threads);
+    return err;
+}
+
+static int dirbench_parse_number(const char *s, size_t *v)
+{
+    char *end;
+
+    errno = 0;
+    *v = strtoul(s, &end, 10);
+    if (errno || end == s || *end != '\0' || *v == 0)
+        return ERROR_INVALID;
+
+    return SUCCESS;
+}
+
+// Parse a comma separated list of positive numbers
+static int dirbench_parse_numbers(char *s, size_t *list, int *n)
+{
+    char *tok, *save;
+
+    for (*n = 0, tok = strtok_r(s, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save))
+        if (*n == DIRBENCH_MAX_LIST || dirbench_parse_number(tok, &list[(*n)++]))
+            return ERROR_INVALID;
+
+    return *n ? SUCCESS : ERROR_INVALID;
+}
+
+int main(int argc, char **argv)
+{
+    char default_threads[] = "1,2,4,8";
+    char default_shards[] = "1,4,16";
+    char *threads_arg = default_threads, *shards_arg = default_shards;
+    size_t threads[DIRBENCH_MAX_LIST], shards[DIRBENCH_MAX_LIST];
+    struct dirbench_run run;
+    int nthreads, nshards, s, t, opt, first = 1;
+    char host[256] = "";
+
+    memset(&run, 0, sizeof(run));
+    run.dir = "/pmem/tmp";
+    run.ops = 10000;
+    run.window = 64;
+
+    while ((opt = getopt(argc, argv, "d:t:S:n:w:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            run.dir = optarg;
+            break;
+        case 't':
+            threads_arg = optarg;
+            break;
+        case 'S':
+            shards_arg = optarg;
+            break;
+        case 'n':
+            if (dirbench_parse_number(optarg, &run.ops))
+                goto usage;
+            break;
+        case 'w':
+            if (dirbench_parse_number(optarg, &run.window))
+                goto usage;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (dirbench_parse_numbers(threads_arg, threads, &nthreads) || dirbench_parse_numbers(shards_arg, shards, &nshards))
+        goto usage;
+    for (s = 0; s < nshards; s++)
+        if (shards[s] > PMEM_DIR_MAX_SHARDS)
+            goto usage;
+
+    (void)gethostname(host, sizeof(host) - 1);
+    printf("{\"benchmark\": \"pmem_dirbench\", \"host\": \"%s\", \"cpus\": %ld, \"dir\": \"%s\", \"timestamp\": %ld,\n",
+           host, sysconf(_SC_NPROCESSORS_ONLN), run.dir, (long)time(NULL));
+    printf(" \"ops_per_thread\": %zu, \"results\": [\n", run.ops);
+
+    for (s = 0; s < nshards; s++)
+        for (t = 0; t < nthreads; t++)
+            if (dirbench_one(&run, (unsigned)threads[t], (unsigned)shards[s], first) == SUCCESS)
+                first = 0;
+    printf("\n]}\n");
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-d dir] [-t threads] [-S shards, at most %d] [-n ops per thread] [-w window]\n", argv[0],
+            PMEM_DIR_MAX_SHARDS);
+    return 1;
+}
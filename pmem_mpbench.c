@@ -0,0 +1,549 @@
+/**
+ * @brief Multi-process allocation benchmark. Forks N processes that allocate and free in a loop against one directory
+ * and reports aggregate throughput, tail latency and signs of file system contention, as JSON.
+ *
+ *     pmem_mpbench -d /pmem/tmp -P 1,8,32 -m malloc,tmpfile,recycle -l shared,private > mpbench.json
+ *
+ * Modes:
+ *   malloc   pmem_malloc() / pmem_free(): create, size, map, unmap, unlink
+ *   tmpfile  open(O_TMPFILE), size, map / unmap, close: no directory entry at all
+ *   recycle  files created once per slot, then only resized and remapped
+ *
+ * Layouts:
+ *   shared   all processes allocate in the directory itself; the subdirectories per process of the library are
+ *            turned off with pmem_set_owner_dirs(0)
+ *   private  every process allocates in a directory of its own, mpbench.<pid>, with the subdirectory of the library
+ *            for the process in it in malloc and recycle
+ *
+ * Directory lock and journal contention show up as throughput that does not scale with processes, as a long latency
+ * tail, and as voluntary context switches per operation, i.e. sleeps on locks.
+ */
+
+#define _GNU_SOURCE
+#include <tmax_pmem.h>
+#include <tmax_pmem_dir.h>
+#include <tmax_pmem_release.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MPBENCH_MAX_LIST 32
+
+enum mpbench_mode
+{
+    MPBENCH_MALLOC,
+    MPBENCH_TMPFILE,
+    MPBENCH_RECYCLE
+};
+
+enum mpbench_layout
+{
+    MPBENCH_SHARED,
+    MPBENCH_PRIVATE
+};
+
+static const char *mpbench_mode_names[] = {"malloc", "tmpfile", "recycle"};
+static const char *mpbench_layout_names[] = {"shared", "private"};
+
+struct mpbench_block
+{
+    void *addr;
+    struct pmem_file *pfile; // malloc and recycle modes
+    int fd;                  // tmpfile mode
+};
+
+// Shared between the parent and the children of one run
+struct mpbench_shared
+{
+    unsigned ready; // children done with their setup
+    int go;         // set by the parent once all children are ready
+    uint64_t start_ns;
+    uint64_t end_ns[MPBENCH_MAX_LIST * 8]; // per process
+    int failed;
+};
+
+struct mpbench_run
+{
+    const char *dir;
+    enum mpbench_mode mode;
+    enum mpbench_layout layout;
+    size_t size;
+    size_t ops;    // allocations per process
+    size_t window; // blocks alive per process
+    unsigned nprocs;
+    struct mpbench_shared *shared;
+    uint64_t *alloc_ns; // ops per process, shared
+    uint64_t *free_ns;
+};
+
+static uint64_t mpbench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int mpbench_alloc(struct mpbench_run *run, const char *dir, struct mpbench_block *b)
+{
+    switch (run->mode)
+    {
+    case MPBENCH_MALLOC:
+        b->addr = pmem_malloc(dir, NULL, run->size, &b->pfile);
+        break;
+    case MPBENCH_TMPFILE:
+        b->addr = NULL;
+        b->fd = open(dir, O_TMPFILE | O_RDWR | O_EXCL, 0600);
+        if (b->fd < 0)
+            break;
+        if (ftruncate(b->fd, run->size) == 0)
+            b->addr = mmap(NULL, run->size, PROT_READ | PROT_WRITE, MAP_SHARED, b->fd, 0);
+        if (b->addr == NULL || b->addr == MAP_FAILED)
+        {
+            (void)close(b->fd);
+            b->addr = NULL;
+        }
+        break;
+    case MPBENCH_RECYCLE:
+        b->addr = NULL;
+        if (ftruncate(b->pfile->fd, run->size) == 0)
+            b->addr = mmap(NULL, run->size, PROT_READ | PROT_WRITE, MAP_SHARED, b->pfile->fd, 0);
+        if (b->addr == MAP_FAILED)
+            b->addr = NULL;
+        break;
+    }
+    if (b->addr == NULL)
+        return ERROR_MMAP;
+    // Touch the block so that the file system allocates space for it
+    *(volatile char *)b->addr = 1;
+
+    return SUCCESS;
+}
+
+static void mpbench_free(struct mpbench_run *run, struct mpbench_block *b)
+{
+    switch (run->mode)
+    {
+    case MPBENCH_MALLOC:
+        (void)pmem_free(b->addr, &b->pfile);
+        break;
+    case MPBENCH_TMPFILE:
+        (void)munmap(b->addr, run->size);
+        (void)close(b->fd);
+        break;
+    case MPBENCH_RECYCLE:
+        (void)munmap(b->addr, run->size);
+        (void)ftruncate(b->pfile->fd, 0);
+        break;
+    }
+    b->addr = NULL;
+}
+
+/**
+ * @brief Body of one child process: allocate ops blocks keeping window of them alive, oldest freed first.
+ */
+static int mpbench_child(struct mpbench_run *run, unsigned id)
+{
+    uint64_t *alloc_ns = run->alloc_ns + (size_t)id * run->ops;
+    uint64_t *free_ns = run->free_ns + (size_t)id * run->ops;
+    struct mpbench_block *blocks = (struct mpbench_block *)calloc(run->window, sizeof(struct mpbench_block));
+    char dir[PATH_MAX];
+    size_t i, nfree = 0;
+    int err = SUCCESS;
+
+    if (run->layout == MPBENCH_PRIVATE)
+    {
+        (void)snprintf(dir, sizeof(dir), "%s/mpbench.%d", run->dir, (int)getpid());
+        if (mkdir(dir, 0700) != 0)
+            err = ERROR_RUNTIME;
+    }
+    else
+    {
+        (void)snprintf(dir, sizeof(dir), "%s", run->dir);
+        pmem_set_owner_dirs(0);
+    }
+    if (blocks == NULL)
+        err = ERROR_MALLOC;
+    for (i = 0; err == SUCCESS && run->mode == MPBENCH_RECYCLE && i < run->window; i++)
+    {
+        blocks[i].pfile = (struct pmem_file *)malloc(sizeof(struct pmem_file));
+        if (blocks[i].pfile == NULL)
+        {
+            err = ERROR_MALLOC;
+            break;
+        }
+        blocks[i].pfile->fd = -1;
+        err = pmem_create_tmpfile(dir, &blocks[i].pfile);
+        if (err)
+        {
+            free(blocks[i].pfile);
+            blocks[i].pfile = NULL;
+        }
+    }
+    if (err)
+        __atomic_store_n(&run->shared->failed, 1, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&run->shared->ready, 1, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&run->shared->go, __ATOMIC_ACQUIRE))
+        sched_yield();
+    for (i = 0; i < run->ops && !__atomic_load_n(&run->shared->failed, __ATOMIC_RELAXED); i++)
+    {
+        struct mpbench_block *b = &blocks[i % run->window];
+        uint64_t start;
+
+        if (b->addr != NULL)
+        {
+            start = mpbench_now();
+            mpbench_free(run, b);
+            free_ns[nfree++] = mpbench_now() - start;
+        }
+        start = mpbench_now();
+        err = mpbench_alloc(run, dir, b);
+        alloc_ns[i] = mpbench_now() - start;
+        if (err)
+        {
+            __atomic_store_n(&run->shared->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    for (i = 0; blocks != NULL && i < run->window; i++)
+    {
+        if (blocks[i].addr != NULL)
+        {
+            uint64_t start = mpbench_now();
+            mpbench_free(run, &blocks[i]);
+            if (nfree < run->ops)
+                free_ns[nfree++] = mpbench_now() - start;
+        }
+    }
+    run->shared->end_ns[id] = mpbench_now();
+
+    // Untimed cleanup; files whose release pmem_free() deferred would be left behind by _exit()
+    (void)pmem_release_flush();
+    for (i = 0; blocks != NULL && run->mode == MPBENCH_RECYCLE && i < run->window; i++)
+    {
+        if (blocks[i].pfile == NULL)
+            continue;
+        (void)close(blocks[i].pfile->fd);
+        (void)unlink(blocks[i].pfile->fullpath);
+        free(blocks[i].pfile->fullpath);
+        free(blocks[i].pfile);
+    }
+    free(blocks);
+
+    return err;
+}
+
+/**
+ * @brief Delete the subdirectories the library gave the children, which exit without removing them, and the private
+ * directories of the children. In the shared layout the children create no subdirectories and remove their files.
+ */
+static void mpbench_reclaim(struct mpbench_run *run, pid_t *pids, unsigned n)
+{
+    char dir[PATH_MAX];
+    unsigned i;
+
+    if (run->layout == MPBENCH_SHARED)
+    {
+        (void)pmem_reclaim(run->dir, NULL);
+        (void)pmem_cleanup_wait();
+        return;
+    }
+    for (i = 0; i < n; i++)
+    {
+        (void)snprintf(dir, sizeof(dir), "%s/mpbench.%d", run->dir, (int)pids[i]);
+        (void)pmem_reclaim(dir, NULL);
+        (void)pmem_cleanup_wait();
+        (void)snprintf(dir, sizeof(dir), "%s/mpbench.%d/" PMEM_DIR_TRASH, run->dir, (int)pids[i]);
+        (void)rmdir(dir);
+        (void)snprintf(dir, sizeof(dir), "%s/mpbench.%d", run->dir, (int)pids[i]);
+        (void)rmdir(dir);
+    }
+}
+
+static int mpbench_cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Print the distribution of the non-zero samples; unused slots are zero
+static void mpbench_print_latency(const char *name, uint64_t *ns, size_t n)
+{
+    static const double percentiles[] = {50, 90, 99, 99.9};
+    static const char *labels[] = {"p50", "p90", "p99", "p999"};
+    long double sum = 0;
+    size_t i, first;
+
+    qsort(ns, n, sizeof(uint64_t), mpbench_cmp_u64);
+    for (first = 0; first < n && ns[first] == 0; first++)
+        ;
+    ns += first;
+    n -= first;
+    printf("\"%s\": {\"count\": %zu", name, n);
+    if (n == 0)
+    {
+        printf("}");
+        return;
+    }
+    for (i = 0; i < n; i++)
+        sum += ns[i];
+    printf(", \"mean\": %.1f, \"min\": %llu", (double)(sum / n), (unsigned long long)ns[0]);
+    for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+    {
+        size_t rank = (size_t)(percentiles[i] / 100.0 * (n - 1) + 0.5);
+        printf(", \"%s\": %llu", labels[i], (unsigned long long)ns[rank]);
+    }
+    printf(", \"max\": %llu}", (unsigned long long)ns[n - 1]);
+}
+
+static double mpbench_seconds(struct timeval tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/**
+ * @brief Fork the processes of one configuration, wait for them and print its JSON object.
+ */
+static int mpbench_one(struct mpbench_run *run, int first)
+{
+    size_t nsamples = (size_t)run->nprocs * run->ops;
+    size_t shared_size = sizeof(struct mpbench_shared) + 2 * nsamples * sizeof(uint64_t);
+    struct rusage before, after;
+    pid_t pids[MPBENCH_MAX_LIST * 8];
+    uint64_t end = 0, elapsed;
+    double min_rate = 0, max_rate = 0;
+    long csw;
+    unsigned i, started = 0;
+    int status, ok = 1;
+    char *mem;
+
+    mem = (char *)mmap(NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return ERROR_MMAP;
+    run->shared = (struct mpbench_shared *)mem;
+    run->alloc_ns = (uint64_t *)(mem + sizeof(struct mpbench_shared));
+    run->free_ns = run->alloc_ns + nsamples;
+
+    (void)getrusage(RUSAGE_CHILDREN, &before);
+    fflush(stdout);
+    for (i = 0; i < run->nprocs; i++)
+    {
+        pids[i] = fork();
+        if (pids[i] == 0)
+            _exit(mpbench_child(run, i) == SUCCESS ? 0 : 1);
+        if (pids[i] < 0)
+        {
+            // Let the started children run into the failure flag and give up on the run
+            fprintf(stderr, "[%s] fork failed: errno=%d\n", __func__, errno);
+            __atomic_store_n(&run->shared->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        started++;
+    }
+    while (__atomic_load_n(&run->shared->ready, __ATOMIC_ACQUIRE) < started)
+        (void)usleep(100);
+    run->shared->start_ns = mpbench_now();
+    __atomic_store_n(&run->shared->go, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < started; i++)
+    {
+        if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            ok = 0;
+    }
+    (void)getrusage(RUSAGE_CHILDREN, &after);
+    if (run->shared->failed)
+        ok = 0;
+    mpbench_reclaim(run, pids, started);
+
+    for (i = 0; i < started; i++)
+    {
+        uint64_t t = run->shared->end_ns[i];
+        double rate = t > run->shared->start_ns ? run->ops / ((t - run->shared->start_ns) / 1e9) : 0.0;
+        if (t > end)
+            end = t;
+        if (i == 0 || rate < min_rate)
+            min_rate = rate;
+        if (rate > max_rate)
+            max_rate = rate;
+    }
+    elapsed = end > run->shared->start_ns ? end - run->shared->start_ns : 0;
+    csw = (after.ru_nvcsw - before.ru_nvcsw);
+
+    printf("%s    {\"mode\": \"%s\", \"layout\": \"%s\", \"procs\": %u, \"size\": %zu, \"window\": %zu, ",
+           first ? "" : ",\n", mpbench_mode_names[run->mode], mpbench_layout_names[run->layout], run->nprocs,
+           run->size, run->window);
+    printf("\"ok\": %s, \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"proc_ops_per_sec_min\": %.1f, "
+           "\"proc_ops_per_sec_max\": %.1f,\n     ",
+           ok ? "true" : "false", elapsed / 1e9, elapsed ? nsamples / (elapsed / 1e9) : 0.0, min_rate, max_rate);
+    printf("\"user_seconds\": %.3f, \"sys_seconds\": %.3f, \"voluntary_csw_per_op\": %.3f,\n     ",
+           mpbench_seconds(after.ru_utime) - mpbench_seconds(before.ru_utime),
+           mpbench_seconds(after.ru_stime) - mpbench_seconds(before.ru_stime), (double)csw / nsamples);
+    mpbench_print_latency("alloc_ns", run->alloc_ns, nsamples);
+    printf(",\n     ");
+    mpbench_print_latency("free_ns", run->free_ns, nsamples);
+    printf("}");
+    fflush(stdout);
+
+    (void)munmap(mem, shared_size);
+    return SUCCESS;
+}
+
+static int mpbench_parse_size(const char *s, size_t *size)
+{
+    char *end;
+    unsigned long long v;
+
+    errno = 0;
+    v = strtoull(s, &end, 10);
+    if (errno || end == s)
+        return ERROR_INVALID;
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        v <<= 10;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        v <<= 20;
+        end++;
+        break;
+    case 'g':
+    case 'G':
+        v <<= 30;
+        end++;
+        break;
+    }
+    if (*end != '\0' || v == 0)
+        return ERROR_INVALID;
+    *size = v;
+
+    return SUCCESS;
+}
+
+// Parse a comma separated list of numbers
+static int mpbench_parse_numbers(char *s, size_t max, size_t *list, int *n)
+{
+    char *tok, *save;
+
+    for (*n = 0, tok = strtok_r(s, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save))
+        if (*n == MPBENCH_MAX_LIST || mpbench_parse_size(tok, &list[*n]) || list[(*n)++] > max)
+            return ERROR_INVALID;
+
+    return *n ? SUCCESS : ERROR_INVALID;
+}
+
+// Parse a comma separated list of names
+static int mpbench_parse_names(char *s, const char **names, int nnames, int *list, int *n)
+{
+    char *tok, *save;
+
+    for (*n = 0, tok = strtok_r(s, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save))
+    {
+        int i;
+        for (i = 0; i < nnames && strcmp(tok, names[i]); i++)
+            ;
+        if (i == nnames || *n == MPBENCH_MAX_LIST)
+            return ERROR_INVALID;
+        list[(*n)++] = i;
+    }
+
+    return *n ? SUCCESS : ERROR_INVALID;
+}
+
+int main(int argc, char **argv)
+{
+    char default_procs[] = "1,4,16";
+    char default_modes[] = "malloc,tmpfile,recycle";
+    char default_layouts[] = "shared,private";
+    char *procs_arg = default_procs, *modes_arg = default_modes, *layouts_arg = default_layouts;
+    size_t procs[MPBENCH_MAX_LIST];
+    int modes[MPBENCH_MAX_LIST], layouts[MPBENCH_MAX_LIST];
+    int nprocs, nmodes, nlayouts;
+    struct mpbench_run run;
+    char host[256] = "";
+    int m, l, p, opt, first = 1;
+
+    memset(&run, 0, sizeof(run));
+    run.dir = "/pmem/tmp";
+    run.size = 4096;
+    run.ops = 2000;
+    run.window = 16;
+
+    while ((opt = getopt(argc, argv, "d:P:m:l:s:n:w:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            run.dir = optarg;
+            break;
+        case 'P':
+            procs_arg = optarg;
+            break;
+        case 'm':
+            modes_arg = optarg;
+            break;
+        case 'l':
+            layouts_arg = optarg;
+            break;
+        case 's':
+            if (mpbench_parse_size(optarg, &run.size))
+                goto usage;
+            break;
+        case 'n':
+            if (mpbench_parse_size(optarg, &run.ops))
+                goto usage;
+            break;
+        case 'w':
+            if (mpbench_parse_size(optarg, &run.window))
+                goto usage;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (mpbench_parse_numbers(procs_arg, MPBENCH_MAX_LIST * 8, procs, &nprocs) ||
+        mpbench_parse_names(modes_arg, mpbench_mode_names, 3, modes, &nmodes) ||
+        mpbench_parse_names(layouts_arg, mpbench_layout_names, 2, layouts, &nlayouts))
+        goto usage;
+
+    (void)gethostname(host, sizeof(host) - 1);
+    printf("{\"benchmark\": \"pmem_mpbench\", \"host\": \"%s\", \"cpus\": %ld, \"dir\": \"%s\", \"timestamp\": %ld,\n",
+           host, sysconf(_SC_NPROCESSORS_ONLN), run.dir, (long)time(NULL));
+    printf(" \"ops_per_proc\": %zu, \"results\": [\n", run.ops);
+
+    for (m = 0; m < nmodes; m++)
+        for (l = 0; l < nlayouts; l++)
+            for (p = 0; p < nprocs; p++)
+            {
+                run.mode = (enum mpbench_mode)modes[m];
+                run.layout = (enum mpbench_layout)layouts[l];
+                run.nprocs = (unsigned)procs[p];
+                if (mpbench_one(&run, first) == SUCCESS)
+                    first = 0;
+            }
+    printf("\n]}\n");
+
+    return 0;
+
+usage:
+    fprintf(stderr,
+            "usage: %s [-d dir] [-P procs,...] [-m malloc,tmpfile,recycle] [-l shared,private] [-s size]\n"
+            "          [-n ops per process] [-w window]\n",
+            argv[0]);
+    return 1;
+}
@@ -0,0 +1,393 @@
+/**
+ * @brief Characterise the memory behind a pmem directory: read and write bandwidth for sequential and random access at
+ * several granularities, with temporal stores, temporal stores followed by a flush, and non-temporal stores; dependent
+ * load latency; and how bandwidth scales with threads. Ends with recommendations for the library's tuning knobs.
+ *
+ *     pmem_probe -d /pmem/tmp -s 4g -t 1,2,4,8,16
+ *
+ * Every line of output is "key=value ..." so that it can be both read and parsed.
+ */
+
+#define _GNU_SOURCE
+#include <tmax_pmem.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define PROBE_MAX_THREADS 32
+#define PROBE_MAX_GRAN 4096
+#define PROBE_CHASE_MAX_BYTES (256UL << 20) // working set of the latency test
+#define PROBE_CHASE_LOADS (4UL << 20)
+
+enum probe_op
+{
+    PROBE_READ,
+    PROBE_WRITE,         // temporal stores, left in the cache
+    PROBE_WRITE_PERSIST, // temporal stores written back with pmem_persist()
+    PROBE_WRITE_NT,      // non-temporal stores, fenced per chunk
+    PROBE_NOPS
+};
+
+static const char *probe_op_names[] = {"read", "write", "write_persist", "write_nt"};
+static const size_t probe_grans[] = {64, 256, 4096};
+#define PROBE_NGRANS (sizeof(probe_grans) / sizeof(probe_grans[0]))
+
+struct probe_job
+{
+    char *base;
+    size_t len;
+    size_t gran;
+    enum probe_op op;
+    int random;
+    uint64_t seed;
+    uint64_t bytes;
+    uint64_t sink;
+};
+
+static pthread_barrier_t probe_barrier;
+static int probe_stop;
+
+static uint64_t probe_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Store one chunk with non-temporal stores and fence it, like a persistent write of that size.
+ */
+static void probe_stream(char *dst, const char *src, size_t len)
+{
+#if defined(__SSE2__)
+    size_t i;
+
+    for (i = 0; i < len; i += 16)
+        _mm_stream_si128((__m128i *)(dst + i), _mm_load_si128((const __m128i *)(src + i)));
+    _mm_sfence();
+#else
+    memcpy(dst, src, len);
+    pmem_persist(dst, len);
+#endif
+}
+
+static void *probe_worker(void *arg)
+{
+    struct probe_job *job = (struct probe_job *)arg;
+    static __thread char src[PROBE_MAX_GRAN] __attribute__((aligned(64)));
+    size_t nchunks = job->len / job->gran;
+    size_t next = 0;
+    uint64_t x = job->seed;
+    uint64_t sink = 0;
+    int k;
+
+    memset(src, 0x5a, sizeof(src));
+    pthread_barrier_wait(&probe_barrier);
+    while (!__atomic_load_n(&probe_stop, __ATOMIC_RELAXED))
+    {
+        for (k = 0; k < 64; k++)
+        {
+            char *p;
+            size_t off;
+
+            if (job->random)
+            {
+                x ^= x << 13;
+                x ^= x >> 7;
+                x ^= x << 17;
+                p = job->base + (x % nchunks) * job->gran;
+            }
+            else
+            {
+                p = job->base + next * job->gran;
+                if (++next == nchunks)
+                    next = 0;
+            }
+            switch (job->op)
+            {
+            case PROBE_READ:
+                for (off = 0; off < job->gran; off += sizeof(uint64_t))
+                    sink += *(volatile uint64_t *)(p + off);
+                break;
+            case PROBE_WRITE:
+                memcpy(p, src, job->gran);
+                break;
+            case PROBE_WRITE_PERSIST:
+                memcpy(p, src, job->gran);
+                pmem_persist(p, job->gran);
+                break;
+            case PROBE_WRITE_NT:
+                probe_stream(p, src, job->gran);
+                break;
+            default:
+                break;
+            }
+        }
+        job->bytes += 64 * job->gran;
+    }
+    job->sink = sink;
+
+    return NULL;
+}
+
+/**
+ * @brief Run one kernel on nthreads threads, each on its own slice of the region, for duration_ms.
+ *
+ * @return double Bandwidth in MB/s.
+ */
+static double probe_bandwidth(char *base, size_t size, unsigned nthreads, enum probe_op op, int random, size_t gran,
+                              unsigned duration_ms)
+{
+    struct probe_job jobs[PROBE_MAX_THREADS];
+    pthread_t tids[PROBE_MAX_THREADS];
+    size_t slice = size / nthreads / PROBE_MAX_GRAN * PROBE_MAX_GRAN;
+    struct timespec ts = {duration_ms / 1000, (long)(duration_ms % 1000) * 1000000L};
+    uint64_t start, elapsed, bytes = 0;
+    unsigned i;
+
+    __atomic_store_n(&probe_stop, 0, __ATOMIC_RELAXED);
+    pthread_barrier_init(&probe_barrier, NULL, nthreads + 1);
+    for (i = 0; i < nthreads; i++)
+    {
+        memset(&jobs[i], 0, sizeof(jobs[i]));
+        jobs[i].base = base + i * slice;
+        jobs[i].len = slice;
+        jobs[i].gran = gran;
+        jobs[i].op = op;
+        jobs[i].random = random;
+        jobs[i].seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+        pthread_create(&tids[i], NULL, probe_worker, &jobs[i]);
+    }
+    pthread_barrier_wait(&probe_barrier);
+    start = probe_now();
+    nanosleep(&ts, NULL);
+    __atomic_store_n(&probe_stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < nthreads; i++)
+    {
+        pthread_join(tids[i], NULL);
+        bytes += jobs[i].bytes;
+    }
+    elapsed = probe_now() - start;
+    pthread_barrier_destroy(&probe_barrier);
+
+    return elapsed ? bytes / (elapsed / 1e9) / 1e6 : 0.0;
+}
+
+/**
+ * @brief Average latency of dependent loads over a random cycle through the cache lines of the working set.
+ *
+ * @return double Nanoseconds per load, or a negative value if the permutation could not be built.
+ */
+static double probe_latency(char *base, size_t size)
+{
+    size_t nlines = (size < PROBE_CHASE_MAX_BYTES ? size : PROBE_CHASE_MAX_BYTES) / 64;
+    size_t *order = (size_t *)malloc(nlines * sizeof(size_t));
+    uint64_t x = 0x2545F4914F6CDD1DULL;
+    uint64_t start, elapsed;
+    void **p;
+    size_t i;
+
+    if (order == NULL || nlines < 2)
+    {
+        free(order);
+        return -1.0;
+    }
+    // Sattolo's shuffle yields a single cycle through all lines
+    for (i = 0; i < nlines; i++)
+        order[i] = i;
+    for (i = nlines - 1; i > 0; i--)
+    {
+        size_t j, tmp;
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        j = x % i;
+        tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    for (i = 0; i < nlines; i++)
+        *(void **)(base + order[i] * 64) = base + order[(i + 1) % nlines] * 64;
+    free(order);
+
+    p = (void **)base;
+    for (i = 0; i < nlines; i++) // warm the TLB and the page tables
+        p = (void **)*p;
+    start = probe_now();
+    for (i = 0; i < PROBE_CHASE_LOADS; i++)
+        p = (void **)*p;
+    elapsed = probe_now() - start;
+    __asm__ __volatile__("" : : "r"(p));
+
+    return (double)elapsed / PROBE_CHASE_LOADS;
+}
+
+static int probe_parse_size(const char *s, size_t *size)
+{
+    char *end;
+    unsigned long long v;
+
+    errno = 0;
+    v = strtoull(s, &end, 10);
+    if (errno || end == s)
+        return ERROR_INVALID;
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        v <<= 10;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        v <<= 20;
+        end++;
+        break;
+    case 'g':
+    case 'G':
+        v <<= 30;
+        end++;
+        break;
+    }
+    if (*end != '\0' || v == 0)
+        return ERROR_INVALID;
+    *size = v;
+
+    return SUCCESS;
+}
+
+static int probe_parse_threads(char *s, unsigned *threads, int *n)
+{
+    char *tok, *save;
+
+    for (*n = 0, tok = strtok_r(s, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save))
+    {
+        long v = strtol(tok, NULL, 10);
+        if (v < 1 || v > PROBE_MAX_THREADS || *n == PROBE_MAX_THREADS)
+            return ERROR_INVALID;
+        threads[(*n)++] = (unsigned)v;
+    }
+
+    return *n ? SUCCESS : ERROR_INVALID;
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = "/pmem/tmp";
+    size_t size = 1UL << 30;
+    unsigned duration_ms = 200;
+    unsigned threads[PROBE_MAX_THREADS];
+    int nthreads = 0;
+    static double bw[PROBE_MAX_THREADS][PROBE_NOPS][2][PROBE_NGRANS];
+    struct pmem_file *pfile;
+    char *base;
+    double latency, best;
+    int t, op, rnd, g, opt;
+    int rec_threads, rec_gran, rec_nt;
+
+    while ((opt = getopt(argc, argv, "d:s:t:T:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            dir = optarg;
+            break;
+        case 's':
+            if (probe_parse_size(optarg, &size))
+                goto usage;
+            break;
+        case 't':
+            if (probe_parse_threads(optarg, threads, &nthreads))
+                goto usage;
+            break;
+        case 'T':
+            duration_ms = (unsigned)strtoul(optarg, NULL, 10);
+            if (duration_ms == 0)
+                goto usage;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (nthreads == 0)
+    {
+        // Powers of two up to the number of CPUs
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        unsigned n;
+        for (n = 1; n <= (unsigned)ncpus && n <= PROBE_MAX_THREADS; n *= 2)
+            threads[nthreads++] = n;
+    }
+    size = size / PROBE_MAX_GRAN * PROBE_MAX_GRAN;
+    for (t = 0; t < nthreads; t++)
+    {
+        if (size / threads[t] < PROBE_MAX_GRAN)
+        {
+            fprintf(stderr, "[%s] region too small for %u threads\n", __func__, threads[t]);
+            return 1;
+        }
+    }
+
+    base = (char *)pmem_malloc(dir, NULL, size, &pfile);
+    if (base == NULL)
+    {
+        fprintf(stderr, "[%s] pmem_malloc of %zu bytes in %s failed\n", __func__, size, dir);
+        return 1;
+    }
+    // Allocate all blocks up front, so that page faults are not measured
+    memset(base, 0, size);
+
+    printf("probe dir=%s size=%zu duration_ms=%u\n", dir, size, duration_ms);
+    latency = probe_latency(base, size);
+    printf("latency working_set=%zu ns_per_load=%.1f\n", size < PROBE_CHASE_MAX_BYTES ? size : PROBE_CHASE_MAX_BYTES,
+           latency);
+
+    for (t = 0; t < nthreads; t++)
+        for (op = 0; op < PROBE_NOPS; op++)
+            for (rnd = 0; rnd < 2; rnd++)
+                for (g = 0; g < (int)PROBE_NGRANS; g++)
+                {
+                    bw[t][op][rnd][g] = probe_bandwidth(base, size, threads[t], (enum probe_op)op, rnd,
+                                                        probe_grans[g], duration_ms);
+                    printf("bandwidth op=%s access=%s gran=%zu threads=%u mb_per_s=%.0f\n", probe_op_names[op],
+                           rnd ? "random" : "seq", probe_grans[g], threads[t], bw[t][op][rnd][g]);
+                    fflush(stdout);
+                }
+
+    // Writer threads: fewest threads within 5% of the best sequential non-temporal write bandwidth
+    best = 0;
+    for (t = 0; t < nthreads; t++)
+        if (bw[t][PROBE_WRITE_NT][0][PROBE_NGRANS - 1] > best)
+            best = bw[t][PROBE_WRITE_NT][0][PROBE_NGRANS - 1];
+    for (rec_threads = 0; rec_threads < nthreads - 1; rec_threads++)
+        if (bw[rec_threads][PROBE_WRITE_NT][0][PROBE_NGRANS - 1] >= 0.95 * best)
+            break;
+
+    // Granularity: smallest random write within 80% of sequential writes, with the recommended threads
+    for (rec_gran = 0; rec_gran < (int)PROBE_NGRANS - 1; rec_gran++)
+        if (bw[rec_threads][PROBE_WRITE_NT][1][rec_gran] >= 0.8 * bw[rec_threads][PROBE_WRITE_NT][0][PROBE_NGRANS - 1])
+            break;
+
+    // Non-temporal stores pay off from the smallest chunk where they beat a temporal write plus flush
+    for (rec_nt = 0; rec_nt < (int)PROBE_NGRANS - 1; rec_nt++)
+        if (bw[rec_threads][PROBE_WRITE_NT][0][rec_nt] >= bw[rec_threads][PROBE_WRITE_PERSIST][0][rec_nt])
+            break;
+
+    printf("recommend writer_threads=%u write_granularity=%zu nt_min_size=%zu\n", threads[rec_threads],
+           probe_grans[rec_gran], probe_grans[rec_nt]);
+
+    (void)pmem_free(base, &pfile);
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-d dir] [-s region size] [-t threads,...] [-T ms per measurement]\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,74 @@
+/**
+ * @brief Reclaim daemon for the regions of crashed processes. Polls PMEM directories and has the subdirectories of
+ * processes whose lease is no longer locked deleted in the background, so capacity leaked by a crash comes back within
+ * one interval, without touching the regions of live processes.
+ *
+ *     pmem_reclaimd /pmem/tmp              # every five seconds, until killed
+ *     pmem_reclaimd -i 1 /pmem/a /pmem/b   # every second, in two directories
+ *     pmem_reclaimd -n 1 /pmem/tmp         # one pass, waiting for the deletion to finish
+ *     pmem_reclaimd -l -n 1 /pmem/tmp      # also delete unused files of the older flat layout, see
+ *                                          # pmem_reclaim_legacy()
+ */
+
+#define _GNU_SOURCE
+#include <tmax_pmem_dir.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+int main(int argc, char **argv)
+{
+    double interval = 5;
+    long count = 0, iter;
+    unsigned long owners, files;
+    struct timespec ts;
+    int opt, i, err, legacy = 0;
+
+    while ((opt = getopt(argc, argv, "i:n:lh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            interval = atof(optarg);
+            if (interval <= 0)
+                goto usage;
+            break;
+        case 'n':
+            count = atol(optarg);
+            break;
+        case 'l':
+            legacy = 1;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind == argc)
+        goto usage;
+
+    for (iter = 0; count == 0 || iter < count; iter++)
+    {
+        for (i = optind; i < argc; i++)
+        {
+            err = pmem_reclaim(argv[i], &owners);
+            if (err == ERROR_INVALID)
+                fprintf(stderr, "cannot read %s\n", argv[i]);
+            else if (owners > 0)
+                fprintf(stderr, "reclaimed %lu dead processes in %s\n", owners, argv[i]);
+            if (legacy && pmem_reclaim_legacy(argv[i], &files) == SUCCESS && files > 0)
+                fprintf(stderr, "deleted %lu unused files of the flat layout in %s\n", files, argv[i]);
+        }
+        if (count != 0 && iter + 1 == count)
+            break;
+        ts.tv_sec = (time_t)interval;
+        ts.tv_nsec = (long)((interval - (double)ts.tv_sec) * 1e9);
+        (void)nanosleep(&ts, NULL);
+    }
+    (void)pmem_cleanup_wait();
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-i interval seconds] [-n count] [-l] dir...\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,229 @@
+#!/usr/bin/env python3
+"""
+Performance regression check for the pmem allocator benchmarks.
+
+Runs pmem_bench and pmem_mpbench a number of times, keeps the samples of every metric as a per-host baseline, and
+compares later builds against it. The baseline and the candidate are summarised by their median with a
+distribution-free confidence interval. A metric regresses when its median is worse by more than the threshold and the
+two intervals do not overlap.
+
+    ./pmem_regress.py record  --dir /pmem/tmp            # on the known good build
+    ./pmem_regress.py compare --dir /pmem/tmp            # on the new build; exits 1 on a regression
+    ./pmem_regress.py compare --input run1.json run2.json run3.json
+
+Baselines are stored as <store>/<hostname>.json.
+"""
+
+import argparse
+import json
+import math
+import os
+import shlex
+import socket
+import subprocess
+import sys
+import time
+
+BENCHMARKS = {
+    "pmem_bench": "-b malloc,heap -s 4k,1m -t 1,4 -p fifo,random -n 500",
+    "pmem_mpbench": "-P 1,8 -m malloc,tmpfile -l shared -n 500",
+}
+
+# Metric paths and whether higher values are better
+METRICS = {
+    "ops_per_sec": True,
+    "alloc_ns.p50": False,
+    "alloc_ns.p99": False,
+    "free_ns.p50": False,
+    "free_ns.p99": False,
+}
+
+# Result fields that are measurements, not part of the configuration
+NOT_CONFIG = {
+    "ok",
+    "seconds",
+    "ops_per_sec",
+    "proc_ops_per_sec_min",
+    "proc_ops_per_sec_max",
+    "user_seconds",
+    "sys_seconds",
+    "voluntary_csw_per_op",
+}
+
+
+def config_key(result):
+    """Identify a result by its configuration, e.g. backend=heap pattern=fifo size=4096 threads=4 window=64."""
+    fields = sorted(
+        (k, v) for k, v in result.items() if k not in NOT_CONFIG and isinstance(v, (str, int)) and not isinstance(v, bool)
+    )
+    return " ".join(f"{k}={v}" for k, v in fields)
+
+
+def metric_value(result, path):
+    value = result
+    for part in path.split("."):
+        if not isinstance(value, dict) or part not in value:
+            return None
+        value = value[part]
+    return float(value) if isinstance(value, (int, float)) else None
+
+
+def add_samples(samples, document):
+    """Add the metrics of one benchmark run to samples[benchmark][config][metric]."""
+    bench = samples.setdefault(document.get("benchmark", "unknown"), {})
+    for result in document.get("results", []):
+        if not result.get("ok", True):
+            continue
+        config = bench.setdefault(config_key(result), {})
+        for path in METRICS:
+            value = metric_value(result, path)
+            if value is not None:
+                config.setdefault(path, []).append(value)
+
+
+def run_benchmarks(names, runs, directory, bindir, extra):
+    samples = {}
+    for name in names:
+        args = shlex.split(extra.get(name, BENCHMARKS[name]))
+        command = [os.path.join(bindir, name), "-d", directory] + args
+        for i in range(runs):
+            print(f"[{name}] run {i + 1}/{runs}: {' '.join(command)}", file=sys.stderr)
+            output = subprocess.run(command, check=True, stdout=subprocess.PIPE, text=True).stdout
+            add_samples(samples, json.loads(output))
+    return samples
+
+
+def load_inputs(paths):
+    samples = {}
+    for path in paths:
+        with open(path) as f:
+            add_samples(samples, json.load(f))
+    return samples
+
+
+def median_ci(values, confidence=0.95):
+    """Median and an order statistic confidence interval for it, from the binomial distribution of ranks."""
+    xs = sorted(values)
+    n = len(xs)
+    median = xs[n // 2] if n % 2 else (xs[n // 2 - 1] + xs[n // 2]) / 2
+    alpha = (1 - confidence) / 2
+    # Largest k such that P(Binomial(n, 1/2) < k) <= alpha; the interval is [x(k), x(n - k + 1)], 1-based
+    k, cumulative = 0, 0.0
+    while k < n:
+        p = math.comb(n, k) / 2**n
+        if cumulative + p > alpha:
+            break
+        cumulative += p
+        k += 1
+    if k == 0:
+        return median, xs[0], xs[-1]
+    return median, xs[k - 1], xs[n - k]
+
+
+def baseline_path(store, host):
+    return os.path.join(store, f"{host}.json")
+
+
+def collect(args):
+    if args.input:
+        return load_inputs(args.input)
+    return run_benchmarks(args.bench, args.runs, args.dir, args.bindir, dict(args.args or []))
+
+
+def cmd_record(args):
+    samples = collect(args)
+    os.makedirs(args.store, exist_ok=True)
+    path = baseline_path(args.store, args.host)
+    with open(path, "w") as f:
+        json.dump({"host": args.host, "created": int(time.time()), "samples": samples}, f, indent=1, sort_keys=True)
+    print(f"baseline written to {path}")
+    return 0
+
+
+def cmd_compare(args):
+    path = baseline_path(args.store, args.host)
+    try:
+        with open(path) as f:
+            baseline = json.load(f)["samples"]
+    except FileNotFoundError:
+        print(f"no baseline for host {args.host} in {args.store}; run 'record' first", file=sys.stderr)
+        return 2
+    candidate = collect(args)
+
+    regressions = improvements = compared = 0
+    for bench, configs in sorted(candidate.items()):
+        for config, metrics in sorted(configs.items()):
+            base_metrics = baseline.get(bench, {}).get(config)
+            if base_metrics is None:
+                continue
+            for metric, values in sorted(metrics.items()):
+                base_values = base_metrics.get(metric)
+                if not base_values or not values:
+                    continue
+                compared += 1
+                b_med, b_lo, b_hi = median_ci(base_values, args.confidence)
+                c_med, c_lo, c_hi = median_ci(values, args.confidence)
+                higher_better = METRICS[metric]
+                change = (c_med - b_med) / b_med * 100 if b_med else 0.0
+                worse = -change if higher_better else change
+                separated = c_hi < b_lo if higher_better else c_lo > b_hi
+                better_separated = c_lo > b_hi if higher_better else c_hi < b_lo
+                if worse > args.threshold and separated:
+                    status = "REGRESSION"
+                    regressions += 1
+                elif -worse > args.threshold and better_separated:
+                    status = "improved"
+                    improvements += 1
+                else:
+                    status = "ok"
+                if status != "ok" or args.verbose:
+                    print(
+                        f"{status:10} {bench} {config} {metric}: {b_med:.1f} [{b_lo:.1f}, {b_hi:.1f}] -> "
+                        f"{c_med:.1f} [{c_lo:.1f}, {c_hi:.1f}] ({change:+.1f}%)"
+                    )
+    print(f"compared {compared} metrics: {regressions} regressions, {improvements} improvements")
+    if compared == 0:
+        print("nothing to compare: the candidate runs share no configuration with the baseline", file=sys.stderr)
+        return 2
+    return 1 if regressions else 0
+
+
+def cmd_show(args):
+    with open(baseline_path(args.store, args.host)) as f:
+        baseline = json.load(f)
+    print(f"host {baseline['host']}, recorded {time.ctime(baseline['created'])}")
+    for bench, configs in sorted(baseline["samples"].items()):
+        for config, metrics in sorted(configs.items()):
+            for metric, values in sorted(metrics.items()):
+                med, lo, hi = median_ci(values)
+                print(f"{bench} {config} {metric}: {med:.1f} [{lo:.1f}, {hi:.1f}] n={len(values)}")
+    return 0
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(description="Record and compare pmem allocator benchmark baselines.")
+    parser.add_argument("command", choices=["record", "compare", "show"])
+    parser.add_argument("--store", default=os.path.join(here, "baselines"), help="directory of the baselines")
+    parser.add_argument("--host", default=socket.gethostname(), help="baseline to use (default: this host)")
+    parser.add_argument("--dir", default="/pmem/tmp", help="pmem directory passed to the benchmarks")
+    parser.add_argument("--bindir", default=here, help="directory of the benchmark binaries")
+    parser.add_argument("--bench", type=lambda s: s.split(","), default=list(BENCHMARKS), help="benchmarks to run")
+    parser.add_argument(
+        "--args", nargs=2, action="append", metavar=("BENCH", "ARGS"), help="override the arguments of a benchmark"
+    )
+    parser.add_argument("--runs", type=int, default=5, help="repetitions of every benchmark")
+    parser.add_argument("--input", nargs="+", help="use these benchmark outputs instead of running the benchmarks")
+    parser.add_argument("--threshold", type=float, default=5.0, help="regression threshold in percent")
+    parser.add_argument("--confidence", type=float, default=0.95, help="confidence level of the median intervals")
+    parser.add_argument("-v", "--verbose", action="store_true", help="also print unchanged metrics")
+    args = parser.parse_args()
+
+    for name in args.bench:
+        if name not in BENCHMARKS:
+            parser.error(f"unknown benchmark {name}")
+    return {"record": cmd_record, "compare": cmd_compare, "show": cmd_show}[args.command](args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
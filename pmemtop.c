@@ -0,0 +1,337 @@
+/**
+ * @brief Live view of the pmem usage of all processes on the host. Reads the statistics segments that processes
+ * publish with pmem_stats_publish() or TMAX_PMEM_STATS_SHM=<ms>, without stopping or signalling them.
+ *
+ *     pmemtop              # refresh every second
+ *     pmemtop -i 5 -n 3 -b # three reports five seconds apart, without clearing the screen
+ *     pmemtop -r           # remove the segments left behind by processes that died
+ *
+ * Rates are computed between two refreshes; latencies are upper bounds of power-of-two buckets.
+ */
+
+#define _GNU_SOURCE
+#include <tmax_pmem_stats.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PMEMTOP_MAX_PROCS 256
+#define PMEMTOP_SHM_DIR "/dev/shm"
+
+struct pmemtop_proc
+{
+    struct pmem_stats_segment seg;
+    uint64_t allocs; // totals at the time of seg
+    uint64_t frees;
+    uint64_t failures;
+};
+
+static struct pmemtop_proc pmemtop_cur[PMEMTOP_MAX_PROCS];
+static struct pmemtop_proc pmemtop_prev[PMEMTOP_MAX_PROCS];
+static int pmemtop_ncur, pmemtop_nprev;
+
+static uint64_t pmemtop_sum(const uint64_t *counts, int n)
+{
+    uint64_t sum = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        sum += counts[i];
+    return sum;
+}
+
+static const char *pmemtop_bytes(int64_t bytes, char *buf, size_t len)
+{
+    static const char *units[] = {"B", "K", "M", "G", "T", "P"};
+    double v = (double)bytes;
+    int u = 0;
+
+    while ((v >= 1024 || v <= -1024) && u < 5)
+    {
+        v /= 1024;
+        u++;
+    }
+    snprintf(buf, len, u ? "%.1f%s" : "%.0f%s", v, units[u]);
+    return buf;
+}
+
+static const char *pmemtop_ns(uint64_t ns, char *buf, size_t len)
+{
+    if (ns == 0)
+        snprintf(buf, len, "-");
+    else if (ns < 10000)
+        snprintf(buf, len, "%luns", (unsigned long)ns);
+    else if (ns < 10000000)
+        snprintf(buf, len, "%luus", (unsigned long)(ns / 1000));
+    else
+        snprintf(buf, len, "%lums", (unsigned long)(ns / 1000000));
+    return buf;
+}
+
+/**
+ * @brief Upper bound of the bucket holding quantile q of a latency histogram, 0 if it is empty.
+ */
+static uint64_t pmemtop_quantile(const uint64_t *hist, double q)
+{
+    uint64_t total = pmemtop_sum(hist, PMEM_STATS_LATENCY_BUCKETS);
+    uint64_t rank, seen = 0;
+    int i;
+
+    if (total == 0)
+        return 0;
+    rank = (uint64_t)(q * (total - 1)) + 1;
+    for (i = 0; i < PMEM_STATS_LATENCY_BUCKETS; i++)
+    {
+        seen += hist[i];
+        if (seen >= rank)
+            break;
+    }
+    return (2ULL << i) - 1;
+}
+
+/**
+ * @brief Read the segments of all live processes into pmemtop_cur.
+ */
+static int pmemtop_scan(int remove_stale)
+{
+    const size_t prefix_len = strlen(PMEM_STATS_SEGMENT_PREFIX);
+    struct pmem_stats_segment *shared;
+    struct pmemtop_proc *p;
+    struct dirent *dp;
+    char name[300];
+    DIR *dirp;
+    pid_t pid;
+    int fd;
+
+    dirp = opendir(PMEMTOP_SHM_DIR);
+    if (dirp == NULL)
+        return ERROR_INVALID;
+    pmemtop_ncur = 0;
+    while ((dp = readdir(dirp)) != NULL && pmemtop_ncur < PMEMTOP_MAX_PROCS)
+    {
+        if (strncmp(dp->d_name, PMEM_STATS_SEGMENT_PREFIX, prefix_len) != 0)
+            continue;
+        snprintf(name, sizeof(name), "/%s", dp->d_name);
+        pid = (pid_t)strtol(dp->d_name + prefix_len, NULL, 10);
+        if (pid <= 0 || (kill(pid, 0) != 0 && errno == ESRCH))
+        {
+            if (remove_stale && shm_unlink(name) == 0)
+                fprintf(stderr, "removed %s of dead process %d\n", dp->d_name, (int)pid);
+            continue;
+        }
+        fd = shm_open(name, O_RDONLY, 0);
+        if (fd < 0)
+            continue;
+        shared = mmap(NULL, sizeof(*shared), PROT_READ, MAP_SHARED, fd, 0);
+        (void)close(fd);
+        if (shared == MAP_FAILED)
+            continue;
+        p = &pmemtop_cur[pmemtop_ncur];
+        if (pmem_stats_read_segment(shared, &p->seg) == SUCCESS)
+        {
+            p->allocs = pmemtop_sum(p->seg.stats.allocs, PMEM_STATS_SIZE_CLASSES);
+            p->frees = pmemtop_sum(p->seg.stats.frees, PMEM_STATS_SIZE_CLASSES);
+            p->failures = pmemtop_sum(p->seg.stats.failures, PMEM_STATS_ERRORS);
+            pmemtop_ncur++;
+        }
+        (void)munmap(shared, sizeof(*shared));
+    }
+    closedir(dirp);
+    return SUCCESS;
+}
+
+static const struct pmemtop_proc *pmemtop_previous(pid_t pid)
+{
+    int i;
+
+    for (i = 0; i < pmemtop_nprev; i++)
+        if (pmemtop_prev[i].seg.pid == pid)
+            return &pmemtop_prev[i];
+    return NULL;
+}
+
+static double pmemtop_rate(uint64_t cur, uint64_t prev, uint64_t cur_ns, uint64_t prev_ns)
+{
+    if (cur_ns <= prev_ns || cur < prev)
+        return 0;
+    return (double)(cur - prev) * 1e9 / (double)(cur_ns - prev_ns);
+}
+
+static void pmemtop_print_procs(void)
+{
+    const struct pmemtop_proc *p, *prev;
+    char b1[16], b2[16], b3[16], b4[16], b5[16], b6[16];
+    int64_t regions = 0, committed = 0, mapped = 0;
+    double arate, frate;
+    int i;
+
+    for (i = 0; i < pmemtop_ncur; i++)
+    {
+        regions += pmemtop_cur[i].seg.stats.live_regions;
+        committed += pmemtop_cur[i].seg.stats.bytes_committed;
+        mapped += pmemtop_cur[i].seg.stats.bytes_mapped;
+    }
+    printf("pmemtop - %d processes, %ld regions, %s committed, %s mapped\n\n", pmemtop_ncur, (long)regions,
+           pmemtop_bytes(committed, b1, sizeof(b1)), pmemtop_bytes(mapped, b2, sizeof(b2)));
+    printf("%8s %-16s %8s %9s %9s %9s %9s %7s %8s %8s %8s %8s\n", "PID", "COMMAND", "REGIONS", "COMMITTED", "MAPPED",
+           "ALLOC/s", "FREE/s", "FAIL", "ALLOC50", "ALLOC99", "FREE50", "FREE99");
+    for (i = 0; i < pmemtop_ncur; i++)
+    {
+        p = &pmemtop_cur[i];
+        prev = pmemtop_previous(p->seg.pid);
+        arate = prev ? pmemtop_rate(p->allocs, prev->allocs, p->seg.updated_ns, prev->seg.updated_ns) : 0;
+        frate = prev ? pmemtop_rate(p->frees, prev->frees, p->seg.updated_ns, prev->seg.updated_ns) : 0;
+        printf("%8d %-16.16s %8ld %9s %9s %9.0f %9.0f %7lu %8s %8s %8s %8s\n", (int)p->seg.pid, p->seg.comm,
+               (long)p->seg.stats.live_regions, pmemtop_bytes(p->seg.stats.bytes_committed, b1, sizeof(b1)),
+               pmemtop_bytes(p->seg.stats.bytes_mapped, b2, sizeof(b2)), arate, frate, (unsigned long)p->failures,
+               pmemtop_ns(pmemtop_quantile(p->seg.stats.latency[PMEM_STATS_ALLOC], 0.5), b3, sizeof(b3)),
+               pmemtop_ns(pmemtop_quantile(p->seg.stats.latency[PMEM_STATS_ALLOC], 0.99), b4, sizeof(b4)),
+               pmemtop_ns(pmemtop_quantile(p->seg.stats.latency[PMEM_STATS_FREE], 0.5), b5, sizeof(b5)),
+               pmemtop_ns(pmemtop_quantile(p->seg.stats.latency[PMEM_STATS_FREE], 0.99), b6, sizeof(b6)));
+    }
+}
+
+static void pmemtop_print_dirs(void)
+{
+    struct pmem_stats_dir dirs[PMEM_STATS_DIRS * 4];
+    int procs[PMEM_STATS_DIRS * 4];
+    const struct pmem_stats_dir *d;
+    char b1[16];
+    int i, j, k, n = 0;
+
+    // Merge the directories of all processes
+    for (i = 0; i < pmemtop_ncur; i++)
+    {
+        for (j = 0; j < PMEM_STATS_DIRS; j++)
+        {
+            d = &pmemtop_cur[i].seg.dirs[j];
+            if (d->path[0] == '\0' || d->regions == 0)
+                continue;
+            for (k = 0; k < n && strcmp(dirs[k].path, d->path) != 0; k++)
+                ;
+            if (k == n)
+            {
+                if (n == PMEM_STATS_DIRS * 4)
+                    continue;
+                memset(&dirs[n], 0, sizeof(dirs[n]));
+                memcpy(dirs[n].path, d->path, sizeof(d->path));
+                procs[n++] = 0;
+            }
+            dirs[k].regions += d->regions;
+            dirs[k].committed += d->committed;
+            procs[k]++;
+        }
+    }
+
+    printf("\n%-48s %6s %8s %9s\n", "DIRECTORY", "PROCS", "REGIONS", "COMMITTED");
+    for (k = 0; k < n; k++)
+        printf("%-48.48s %6d %8ld %9s\n", dirs[k].path, procs[k], (long)dirs[k].regions,
+               pmemtop_bytes(dirs[k].committed, b1, sizeof(b1)));
+}
+
+static void pmemtop_print_sites(int max)
+{
+    const struct pmemtop_proc *best_proc;
+    const struct pmem_stats_site *best, *s;
+    int taken[PMEMTOP_MAX_PROCS] = {0};
+    char b1[16];
+    int i, n;
+
+    // The sites of every process are sorted by bytes, so the top across processes is a merge of the heads
+    printf("\n%-56s %8s %-16s %10s %9s\n", "CALL SITE", "PID", "COMMAND", "ALLOCS", "BYTES");
+    for (n = 0; n < max; n++)
+    {
+        best = NULL;
+        best_proc = NULL;
+        for (i = 0; i < pmemtop_ncur; i++)
+        {
+            if (taken[i] >= PMEM_STATS_TOP_SITES)
+                continue;
+            s = &pmemtop_cur[i].seg.sites[taken[i]];
+            if (s->allocs != 0 && (best == NULL || s->bytes > best->bytes))
+            {
+                best = s;
+                best_proc = &pmemtop_cur[i];
+            }
+        }
+        if (best == NULL)
+            break;
+        taken[best_proc - pmemtop_cur]++;
+        printf("%-56.56s %8d %-16.16s %10lu %9s\n", best->name, (int)best_proc->seg.pid, best_proc->seg.comm,
+               (unsigned long)best->allocs, pmemtop_bytes((int64_t)best->bytes, b1, sizeof(b1)));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    double interval = 1;
+    long count = 0, iter;
+    int batch = 0, remove_stale = 0, sites = 10;
+    struct timespec ts;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:n:s:brh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            interval = atof(optarg);
+            if (interval <= 0)
+                goto usage;
+            break;
+        case 'n':
+            count = atol(optarg);
+            break;
+        case 's':
+            sites = atoi(optarg);
+            break;
+        case 'b':
+            batch = 1;
+            break;
+        case 'r':
+            remove_stale = 1;
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    for (iter = 0; count == 0 || iter < count; iter++)
+    {
+        if (pmemtop_scan(remove_stale) != SUCCESS)
+        {
+            fprintf(stderr, "cannot read %s\n", PMEMTOP_SHM_DIR);
+            return 1;
+        }
+        if (remove_stale && count == 0)
+            return 0;
+        if (!batch)
+            printf("\033[H\033[2J");
+        pmemtop_print_procs();
+        pmemtop_print_dirs();
+        pmemtop_print_sites(sites);
+        if (batch)
+            printf("\n");
+        fflush(stdout);
+
+        memcpy(pmemtop_prev, pmemtop_cur, sizeof(pmemtop_cur[0]) * pmemtop_ncur);
+        pmemtop_nprev = pmemtop_ncur;
+        if (count != 0 && iter + 1 == count)
+            break;
+        ts.tv_sec = (time_t)interval;
+        ts.tv_nsec = (long)((interval - (double)ts.tv_sec) * 1e9);
+        (void)nanosleep(&ts, NULL);
+    }
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-i interval seconds] [-n count] [-s call sites] [-b] [-r]\n", argv[0]);
+    return 1;
+}
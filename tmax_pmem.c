@@ -2,10 +2,18 @@
  * @brief APIs to use PMEM like a volatile memory. Whenever the function is called, a temporary file is created on the PMEM and mapped to the virtual memory.
  */
 
+#define _GNU_SOURCE
 #include <tmax_pmem.h>
+#include <tmax_pmem_stats.h>
+#include <tmax_pmem_hist.h>
+#include <tmax_pmem_probes.h>
+#include <tmax_pmem_prof.h>
+#include <tmax_pmem_dir.h>
+#include <tmax_pmem_release.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <limits.h>
 #include <signal.h>
 #include <sys/mman.h>
@@ -15,57 +23,447 @@
 #include <sys/types.h>
 #include <string.h>
 #include <dirent.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
-/**
- * @brief Request pmem allocation. The function creates a temporary file on the PMEM and maps it to the virtual memory.
+#define PMEM_CACHELINE_SIZE 64
+
+/*
+ * Emulation of PMEM on machines without it, configured from the environment on first use:
  *
- * @param dir Directory of the file.
- * @param size The size of the memory to be allocated.
- * @param addr Address of the memory to be mapped to the temporary file. If addr is NULL, the function allocates memory.
- * @param pfile Pointer to the pmem_file structure.
- * @return void * The pointer to the memory allocated.
+ *   TMAX_PMEM_EMULATE                      tmpfs: create regions in TMAX_PMEM_EMULATE_DIR instead of the given directory
+ *                                          anon: back regions by anonymous memory files (memfd) without a path
+ *   TMAX_PMEM_EMULATE_DIR                  tmpfs directory (default /dev/shm)
+ *   TMAX_PMEM_EMULATE_READ_LATENCY_NS      added to every pmem_memcpy_from()
+ *   TMAX_PMEM_EMULATE_WRITE_LATENCY_NS     added to every pmem_persist() and pmem_memcpy_nt()
+ *   TMAX_PMEM_EMULATE_READ_BANDWIDTH_MBPS  shared limit for pmem_memcpy_from()
+ *   TMAX_PMEM_EMULATE_WRITE_BANDWIDTH_MBPS shared limit for pmem_persist() and pmem_memcpy_nt()
+ *
+ * Delays are busy waits. Bandwidth limits are shared by all threads of the process, like the bandwidth of a device: each
+ * transfer books its duration after the previous one and waits until it has passed. With TMAX_PMEM_EMULATE set, unset
+ * latencies and bandwidths default to values in the range of first generation PMEM; 0 turns a setting off. The
+ * settings also work without TMAX_PMEM_EMULATE, to slow down a real directory.
  */
-void *pmem_malloc(const char *dir, void *addr, size_t size, struct pmem_file **pfile_ptr)
+#define PMEM_EMULATE_READ_LATENCY_NS 300
+#define PMEM_EMULATE_WRITE_LATENCY_NS 100
+#define PMEM_EMULATE_READ_BANDWIDTH_MBPS 6000
+#define PMEM_EMULATE_WRITE_BANDWIDTH_MBPS 2000
+
+enum
+{
+    PMEM_EMULATE_OFF,
+    PMEM_EMULATE_TMPFS,
+    PMEM_EMULATE_ANON
+};
+
+struct pmem_emulate_channel
+{
+    unsigned long latency_ns;
+    unsigned long bandwidth_mbps;
+    uint64_t busy_until; // end of the last booked transfer, in CLOCK_MONOTONIC ns
+};
+
+static struct
+{
+    int backend;
+    const char *dir;
+    struct pmem_emulate_channel read;
+    struct pmem_emulate_channel write;
+} pmem_emulate;
+
+static pthread_once_t pmem_emulate_once = PTHREAD_ONCE_INIT;
+
+static uint64_t pmem_emulate_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void pmem_emulate_getenv(const char *name, unsigned long *value)
 {
+    const char *env = getenv(name);
+    char *end;
+    unsigned long v;
+
+    if (env == NULL)
+        return;
+    errno = 0;
+    v = strtoul(env, &end, 10);
+    if (errno || end == env || *end != '\0')
+    {
+        printf("[%s] ignoring %s=%s: not a number\n", __func__, name, env);
+        return;
+    }
+    *value = v;
+}
+
+static void pmem_emulate_init(void)
+{
+    const char *env = getenv("TMAX_PMEM_EMULATE");
+
+    if (env != NULL && strcmp(env, "tmpfs") == 0)
+        pmem_emulate.backend = PMEM_EMULATE_TMPFS;
+    else if (env != NULL && strcmp(env, "anon") == 0)
+        pmem_emulate.backend = PMEM_EMULATE_ANON;
+    else if (env != NULL && *env != '\0' && strcmp(env, "off") != 0)
+        printf("[%s] ignoring TMAX_PMEM_EMULATE=%s: expected tmpfs, anon or off\n", __func__, env);
+
+    pmem_emulate.dir = getenv("TMAX_PMEM_EMULATE_DIR");
+    if (pmem_emulate.dir == NULL)
+        pmem_emulate.dir = "/dev/shm";
+
+    if (pmem_emulate.backend != PMEM_EMULATE_OFF)
+    {
+        pmem_emulate.read.latency_ns = PMEM_EMULATE_READ_LATENCY_NS;
+        pmem_emulate.write.latency_ns = PMEM_EMULATE_WRITE_LATENCY_NS;
+        pmem_emulate.read.bandwidth_mbps = PMEM_EMULATE_READ_BANDWIDTH_MBPS;
+        pmem_emulate.write.bandwidth_mbps = PMEM_EMULATE_WRITE_BANDWIDTH_MBPS;
+    }
+    pmem_emulate_getenv("TMAX_PMEM_EMULATE_READ_LATENCY_NS", &pmem_emulate.read.latency_ns);
+    pmem_emulate_getenv("TMAX_PMEM_EMULATE_WRITE_LATENCY_NS", &pmem_emulate.write.latency_ns);
+    pmem_emulate_getenv("TMAX_PMEM_EMULATE_READ_BANDWIDTH_MBPS", &pmem_emulate.read.bandwidth_mbps);
+    pmem_emulate_getenv("TMAX_PMEM_EMULATE_WRITE_BANDWIDTH_MBPS", &pmem_emulate.write.bandwidth_mbps);
+}
+
+/**
+ * @brief Wait as long as a transfer of len bytes takes on the emulated device.
+ */
+static void pmem_emulate_transfer(struct pmem_emulate_channel *ch, size_t len)
+{
+    uint64_t now = pmem_emulate_now();
+    uint64_t done = now + ch->latency_ns;
+
+    if (ch->bandwidth_mbps)
+    {
+        // bytes per microsecond equals MB/s, so the transfer takes len * 1000 / mbps ns
+        uint64_t duration = (uint64_t)len * 1000 / ch->bandwidth_mbps;
+        uint64_t start, busy = __atomic_load_n(&ch->busy_until, __ATOMIC_RELAXED);
+
+        do
+            start = busy > now ? busy : now;
+        while (!__atomic_compare_exchange_n(&ch->busy_until, &busy, start + duration, 0, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED));
+        if (start + duration + ch->latency_ns > done)
+            done = start + duration + ch->latency_ns;
+    }
+    while (pmem_emulate_now() < done)
+    {
+#if defined(__SSE2__)
+        _mm_pause();
+#endif
+    }
+}
+
+static inline void pmem_emulate_write(size_t len)
+{
+    (void)pthread_once(&pmem_emulate_once, pmem_emulate_init);
+    if (pmem_emulate.write.latency_ns || pmem_emulate.write.bandwidth_mbps)
+        pmem_emulate_transfer(&pmem_emulate.write, len);
+}
+
+static inline void pmem_emulate_read(size_t len)
+{
+    (void)pthread_once(&pmem_emulate_once, pmem_emulate_init);
+    if (pmem_emulate.read.latency_ns || pmem_emulate.read.bandwidth_mbps)
+        pmem_emulate_transfer(&pmem_emulate.read, len);
+}
+
+/**
+ * @brief Create the backing file of a region: a temporary file in dir, or the emulated backend.
+ */
+static int pmem_emulate_create(const char *dir, struct pmem_file **pfile_ptr)
+{
+    (void)pthread_once(&pmem_emulate_once, pmem_emulate_init);
+    switch (pmem_emulate.backend)
+    {
+    case PMEM_EMULATE_TMPFS:
+        return pmem_create_tmpfile(pmem_emulate.dir, pfile_ptr);
+    case PMEM_EMULATE_ANON:
+        (*pfile_ptr)->fd = memfd_create("pmem", MFD_CLOEXEC);
+        return (*pfile_ptr)->fd < 0 ? ERROR_RUNTIME : SUCCESS;
+    default:
+        return pmem_create_tmpfile(dir, pfile_ptr);
+    }
+}
+
+/**
+ * @brief Create a temporary file of the given size and map it at addr with the given extra mmap flags.
+ */
+static void *pmem_map_tmpfile(const char *dir, void *addr, size_t size, int flags, const void *caller,
+                              struct pmem_file **pfile_ptr)
+{
+    uint64_t begin = pmem_stats_clock();
+    uint64_t start, ns;
     int oerrno;
     int err;
 
+    PMEM_PROBE2(alloc_entry, dir, size);
     *pfile_ptr = (struct pmem_file *)malloc(sizeof(struct pmem_file));
     if (*pfile_ptr == NULL)
     {
-        err = ERROR_MALLOC;
-        goto exit;
+        (void)pmem_stats_failure(ERROR_MALLOC);
+        PMEM_PROBE4(alloc_return, dir, NULL, size, pmem_stats_clock() - begin);
+        return NULL;
     }
+    (*pfile_ptr)->fd = -1;
+    (*pfile_ptr)->fullpath = NULL;
+    (*pfile_ptr)->reserved_size = 0;
+    (*pfile_ptr)->sample = NULL;
+    (*pfile_ptr)->minor_faults = 0;
+    (*pfile_ptr)->major_faults = 0;
 
-    err = pmem_create_tmpfile(dir, pfile_ptr);
+    err = pmem_emulate_create(dir, pfile_ptr);
     if (err)
         goto exit;
 
+    start = pmem_stats_clock();
     if (ftruncate((*pfile_ptr)->fd, size)) // set the size of the file
+    {
+        err = ERROR_RUNTIME;
         goto exit;
+    }
+    pmem_stats_syscall(PMEM_STATS_FTRUNCATE, start);
 
     // Map the file to the virtual memory
-    addr = mmap(addr, size, PROT_READ | PROT_WRITE, MAP_SHARED, (*pfile_ptr)->fd, 0);
-    if (addr == MAP_FAILED)
+    if (size > 0)
     {
-        err = ERROR_MMAP;
-        goto exit;
+        start = pmem_stats_clock();
+        addr = mmap(addr, size, PROT_READ | PROT_WRITE, MAP_SHARED | flags, (*pfile_ptr)->fd, 0);
+        if (addr == MAP_FAILED)
+        {
+            err = ERROR_MMAP;
+            goto exit;
+        }
+        ns = pmem_stats_syscall(PMEM_STATS_MMAP, start);
+        PMEM_PROBE3(mmap, addr, size, ns);
     }
 
     (*pfile_ptr)->current_size = size;
+    pmem_stats_map(size, size, 1);
+    pmem_stats_dir((*pfile_ptr)->fullpath, 1, size);
+    pmem_stats_site(caller, size);
+    pmem_prof_alloc(*pfile_ptr, size);
+    ns = pmem_stats_latency(PMEM_STATS_ALLOC, begin);
+    PMEM_PROBE4(alloc_return, dir, addr, size, ns);
 
     return addr;
 
 exit:
     oerrno = errno;
+    (void)pmem_stats_failure(err);
+    PMEM_PROBE4(alloc_return, dir, NULL, size, pmem_stats_clock() - begin);
     if ((*pfile_ptr)->fd != -1)
         (void)close((*pfile_ptr)->fd);
+    if ((*pfile_ptr)->fullpath != NULL)
+    {
+        (void)unlink((*pfile_ptr)->fullpath);
+        free((*pfile_ptr)->fullpath);
+    }
+    free(*pfile_ptr);
+    *pfile_ptr = NULL;
     errno = oerrno;
     return NULL;
 }
 
 /**
- * @brief Create a temporary file on the PMEM and adjust size of the file.
+ * @brief Request pmem allocation. The function creates a temporary file on the PMEM and maps it to the virtual memory.
+ *
+ * @param dir Directory of the file.
+ * @param size The size of the memory to be allocated.
+ * @param addr Address of the memory to be mapped to the temporary file. If addr is NULL, the function allocates memory.
+ * @param pfile Pointer to the pmem_file structure.
+ * @return void * The pointer to the memory allocated.
+ */
+void *pmem_malloc(const char *dir, void *addr, size_t size, struct pmem_file **pfile_ptr)
+{
+    if (size == 0)
+    {
+        *pfile_ptr = NULL;
+        return NULL;
+    }
+    return pmem_map_tmpfile(dir, addr, size, 0, __builtin_return_address(0), pfile_ptr);
+}
+
+/**
+ * @brief Round a size up to whole pages.
+ */
+static size_t pmem_page_align(size_t size)
+{
+    size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+
+    return (size + pagesize - 1) & ~(pagesize - 1);
+}
+
+/**
+ * @brief Allocate a region that can later grow in place with pmem_extend(). The function reserves reserve bytes of
+ * address space without backing and maps a temporary file of size bytes at its start. The reservation costs no memory.
+ *
+ * @param dir Directory of the file.
+ * @param reserve Largest size the region can grow to. Rounded up to whole pages.
+ * @param size Initial size of the region, at most reserve. Rounded up to whole pages, may be 0.
+ * @param pfile_ptr Pointer to the pmem_file structure.
+ * @return void * Start of the reservation, which stays the address of the region for its lifetime.
+ */
+void *pmem_reserve(const char *dir, size_t reserve, size_t size, struct pmem_file **pfile_ptr)
+{
+    uint64_t start;
+    void *base;
+    void *addr;
+    int oerrno;
+
+    reserve = pmem_page_align(reserve);
+    size = pmem_page_align(size);
+    if (reserve == 0 || size > reserve)
+    {
+        *pfile_ptr = NULL;
+        return NULL;
+    }
+
+    start = pmem_stats_clock();
+    base = mmap(NULL, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        (void)pmem_stats_failure(ERROR_MMAP);
+        *pfile_ptr = NULL;
+        return NULL;
+    }
+    pmem_stats_syscall(PMEM_STATS_MMAP, start);
+
+    addr = pmem_map_tmpfile(dir, base, size, MAP_FIXED, __builtin_return_address(0), pfile_ptr);
+    if (addr == NULL)
+    {
+        oerrno = errno;
+        (void)munmap(base, reserve);
+        errno = oerrno;
+        return NULL;
+    }
+    (*pfile_ptr)->reserved_size = reserve;
+    pmem_stats_resize(0, reserve - size);
+
+    return base;
+}
+
+/**
+ * @brief Move a region mapped by pmem_malloc() or pmem_open() into a fresh reservation of reserve bytes, so that it can
+ * grow in place with pmem_extend() afterwards. The page tables move with the mapping, the data is not copied.
+ *
+ * @param addr Memory address mapped to the file.
+ * @param reserve Largest size the region can grow to, at least its current size. Rounded up to whole pages.
+ * @param pfile_ptr Pointer to the pmem_file struct.
+ * @return void * The new address of the region, or NULL on failure. The old mapping stays valid then.
+ */
+void *pmem_remap_reserved(void *addr, size_t reserve, struct pmem_file **pfile_ptr)
+{
+    size_t old_size = (*pfile_ptr)->current_size;
+    size_t size = pmem_page_align(old_size);
+    uint64_t start;
+    void *base;
+
+    reserve = pmem_page_align(reserve);
+    if ((*pfile_ptr)->reserved_size != 0 || size == 0 || size > reserve)
+    {
+        (void)pmem_stats_failure(ERROR_INVALID);
+        return NULL;
+    }
+    // Back the partial last page, which pmem_extend() treats as part of the region
+    start = pmem_stats_clock();
+    if (size != old_size && ftruncate((*pfile_ptr)->fd, size))
+    {
+        (void)pmem_stats_failure(ERROR_RUNTIME);
+        return NULL;
+    }
+    if (size != old_size)
+        pmem_stats_syscall(PMEM_STATS_FTRUNCATE, start);
+
+    start = pmem_stats_clock();
+    base = mmap(NULL, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        (void)pmem_stats_failure(ERROR_MMAP);
+        return NULL;
+    }
+    pmem_stats_syscall(PMEM_STATS_MMAP, start);
+    if (mremap(addr, size, size, MREMAP_MAYMOVE | MREMAP_FIXED, base) == MAP_FAILED)
+    {
+        (void)munmap(base, reserve);
+        (void)pmem_stats_failure(ERROR_MMAP);
+        return NULL;
+    }
+    (*pfile_ptr)->current_size = size;
+    (*pfile_ptr)->reserved_size = reserve;
+    pmem_stats_resize(size - old_size, reserve - old_size);
+    pmem_stats_dir((*pfile_ptr)->fullpath, 0, size - old_size);
+
+    return base;
+}
+
+/**
+ * @brief Grow or shrink a region allocated by pmem_reserve() within its reservation. The region never moves: new pages
+ * of the file are mapped right behind the old ones, and pages given back return to the reservation.
+ *
+ * @param addr Start of the region.
+ * @param size New size of the region. Rounded up to whole pages.
+ * @param pfile_ptr Pointer to the pmem_file struct.
+ * @return int ERROR_NOSPACE if size exceeds the reservation. The region is unchanged on failure.
+ */
+int pmem_extend(void *addr, size_t size, struct pmem_file **pfile_ptr)
+{
+    struct pmem_file *pfile = *pfile_ptr;
+    size_t old_size = pfile->current_size;
+    char *base = (char *)addr;
+    uint64_t start, ns;
+
+    if (pfile->reserved_size == 0)
+        return pmem_stats_failure(ERROR_INVALID);
+    size = pmem_page_align(size);
+    if (size > pfile->reserved_size)
+        return pmem_stats_failure(ERROR_NOSPACE);
+
+    if (size > old_size)
+    {
+        // Grow the file before mapping its new pages over the reservation
+        start = pmem_stats_clock();
+        if (ftruncate(pfile->fd, size))
+            return pmem_stats_failure(ERROR_RUNTIME);
+        pmem_stats_syscall(PMEM_STATS_FTRUNCATE, start);
+        start = pmem_stats_clock();
+        if (mmap(base + old_size, size - old_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, pfile->fd,
+                 old_size) == MAP_FAILED)
+        {
+            (void)ftruncate(pfile->fd, old_size);
+            return pmem_stats_failure(ERROR_MMAP);
+        }
+        ns = pmem_stats_syscall(PMEM_STATS_MMAP, start);
+        PMEM_PROBE3(mmap, base + old_size, size - old_size, ns);
+    }
+    else if (size < old_size)
+    {
+        // Hand the tail back to the reservation before dropping it from the file
+        start = pmem_stats_clock();
+        if (mmap(base + size, old_size - size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1,
+                 0) == MAP_FAILED)
+            return pmem_stats_failure(ERROR_MMAP);
+        pmem_stats_syscall(PMEM_STATS_MMAP, start);
+        start = pmem_stats_clock();
+        (void)ftruncate(pfile->fd, size);
+        pmem_stats_syscall(PMEM_STATS_FTRUNCATE, start);
+    }
+    pfile->current_size = size;
+    pmem_stats_resize((int64_t)size - (int64_t)old_size, 0);
+    pmem_stats_dir(pfile->fullpath, 0, (int64_t)size - (int64_t)old_size);
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Create a temporary file on the PMEM and adjust size of the file. The file is created in the subdirectory of
+ * the calling process, see pmem_dir_owner().
  *
  * @param dir Directory of the file.
  * @param size Size of the file.
@@ -75,31 +473,36 @@ exit:
 int pmem_create_tmpfile(const char *dir, struct pmem_file **pfile_ptr)
 {
     static char template[] = "/pmem.XXXXXX";
+    uint64_t begin = pmem_stats_clock();
+    uint64_t ns;
     int err = SUCCESS;
     int oerrno;
-    int dir_len = strlen(dir);
+    char owner[PATH_MAX];
 
     // Check if the directory exists
     if (access(dir, F_OK))
     {
         err = ERROR_INVALID;
+        PMEM_PROBE4(create, dir, NULL, pmem_stats_clock() - begin, err);
         return err;
     }
 
-    if (dir_len > PATH_MAX)
+    if (pmem_dir_owner(dir, owner, sizeof(owner)) != SUCCESS)
     {
-        printf("Could not create temporary file: too long path.");
+        printf("Could not create temporary file: no subdirectory in %s.", dir);
+        PMEM_PROBE4(create, dir, NULL, pmem_stats_clock() - begin, ERROR_INVALID);
         return ERROR_INVALID;
     }
 
-    char *fullname = (char *)malloc(dir_len + sizeof(template));
-    (void)strcpy(fullname, dir);
+    char *fullname = (char *)malloc(strlen(owner) + sizeof(template));
+    (void)strcpy(fullname, owner);
     (void)strcat(fullname, template);
 
     sigset_t set, oldset;
     sigfillset(&set);
     sigprocmask(SIG_BLOCK, &set, &oldset);
 
+    uint64_t start = pmem_stats_clock();
     if (((*pfile_ptr)->fd = mkstemp(fullname)) < 0) // Create a temporary file
     {
         printf("Could not create temporary file: errno=%d.", errno);
@@ -107,24 +510,30 @@ int pmem_create_tmpfile(const char *dir, struct pmem_file **pfile_ptr)
         goto exit;
     }
     (*pfile_ptr)->fullpath = fullname;
+    pmem_stats_syscall(PMEM_STATS_MKSTEMP, start);
 
     (void)sigprocmask(SIG_SETMASK, &oldset, NULL);
+    ns = pmem_stats_clock() - begin;
+    pmem_hist_record(PMEM_HIST_CREATE_TMPFILE, ns);
+    PMEM_PROBE4(create, dir, fullname, ns, err);
 
     return err;
 
 exit:
     oerrno = errno;
+    PMEM_PROBE4(create, dir, NULL, pmem_stats_clock() - begin, err);
     (void)sigprocmask(SIG_SETMASK, &oldset, NULL);
     if ((*pfile_ptr)->fd != -1)
         (void)close((*pfile_ptr)->fd);
-    (*pfile_ptr)->fd = (int *)-1;
+    (*pfile_ptr)->fd = -1;
     errno = oerrno;
     free(fullname);
     return err;
 }
 
 /**
- * @brief Close the file and free the memory.
+ * @brief Close the file and free the memory. With deferred release, see pmem_release_async(), the file is closed and
+ * removed by a background thread after the call returns.
  * @param addr Memory address mapped to the file.
  * @param pfile Pointer to the pmem_file struct.
  *
@@ -132,18 +541,48 @@ exit:
  */
 int pmem_free(void *addr, struct pmem_file **pfile_ptr)
 {
-    if (munmap(addr, (*pfile_ptr)->current_size) != 0)
+    size_t mapped = (*pfile_ptr)->reserved_size ? (*pfile_ptr)->reserved_size : (*pfile_ptr)->current_size;
+    uint64_t begin = pmem_stats_clock();
+    uint64_t start = begin;
+    uint64_t ns;
+
+    PMEM_PROBE2(free_entry, addr, (*pfile_ptr)->current_size);
+    if (munmap(addr, mapped) != 0)
     {
         printf("[%s] munmap failed\n", __func__);
-        return ERROR_MMAP;
+        PMEM_PROBE4(free_return, addr, (*pfile_ptr)->current_size, pmem_stats_clock() - begin, ERROR_MMAP);
+        return pmem_stats_failure(ERROR_MMAP);
+    }
+    ns = pmem_stats_syscall(PMEM_STATS_MUNMAP, start);
+    PMEM_PROBE3(munmap, addr, mapped, ns);
+    pmem_stats_unmap((*pfile_ptr)->current_size, mapped, 1);
+    pmem_prof_free(*pfile_ptr);
+    pmem_stats_dir((*pfile_ptr)->fullpath, -1, -(int64_t)(*pfile_ptr)->current_size);
+    // Freeing the extents can take milliseconds, leave it to the reaper thread if deferral is enabled
+    if (pmem_release_defer((*pfile_ptr)->fd, (*pfile_ptr)->fullpath) == SUCCESS)
+    {
+        ns = pmem_stats_latency(PMEM_STATS_FREE, begin);
+        PMEM_PROBE4(free_return, addr, (*pfile_ptr)->current_size, ns, SUCCESS);
+        free(*pfile_ptr);
+        return SUCCESS;
     }
     (void)close((*pfile_ptr)->fd);
-    // Remove the file
-    if (unlink((*pfile_ptr)->fullpath) != 0)
+    // Remove the file; anonymous emulated regions have none
+    start = pmem_stats_clock();
+    if ((*pfile_ptr)->fullpath != NULL && unlink((*pfile_ptr)->fullpath) != 0)
     {
         printf("[%s] unlink failed\n", __func__);
-        return ERROR_RUNTIME;
+        PMEM_PROBE3(unlink, (*pfile_ptr)->fullpath, pmem_stats_clock() - start, ERROR_RUNTIME);
+        PMEM_PROBE4(free_return, addr, (*pfile_ptr)->current_size, pmem_stats_clock() - begin, ERROR_RUNTIME);
+        return pmem_stats_failure(ERROR_RUNTIME);
     }
+    if ((*pfile_ptr)->fullpath != NULL)
+    {
+        ns = pmem_stats_syscall(PMEM_STATS_UNLINK, start);
+        PMEM_PROBE3(unlink, (*pfile_ptr)->fullpath, ns, SUCCESS);
+    }
+    ns = pmem_stats_latency(PMEM_STATS_FREE, begin);
+    PMEM_PROBE4(free_return, addr, (*pfile_ptr)->current_size, ns, SUCCESS);
     free((*pfile_ptr)->fullpath);
     free(*pfile_ptr);
 
@@ -151,41 +590,304 @@ int pmem_free(void *addr, struct pmem_file **pfile_ptr)
 }
 
 /**
- * @brief Delete all files in the directory.
+ * @brief Delete the regions left in a directory by processes that have exited, see pmem_reclaim(); the call does not
+ * block on deleting many files, see pmem_cleanup_wait(). Subdirectories of live processes are left alone, and so are
+ * files of the older flat layout, whose creator is unknown; see pmem_reclaim_legacy() to migrate those.
  *
  * @param dir
- * @return int
+ * @return int ERROR_RUNTIME if a subdirectory could not be deleted.
  */
 int pmem_cleanup_all(const char *dir)
 {
-    int err = SUCCESS;
-    DIR *dirp = opendir(dir);
-    if (dirp == NULL)
-    {
-        err = ERROR_INVALID;
+    uint64_t begin = pmem_stats_clock();
+    unsigned long owners = 0;
+    int err;
+    PMEM_PROBE1(cleanup_entry, dir);
+    err = pmem_reclaim(dir, &owners);
+    PMEM_PROBE4(cleanup_return, dir, owners, pmem_stats_clock() - begin, err);
+    return err;
+}
+
+/**
+ * @brief Map an existing file on the PMEM, e.g. a region kept by pmem_close() before a restart.
+ *
+ * @param path Full path of the file.
+ * @param addr Address of the memory to be mapped to the file. If addr is NULL, the function chooses the address.
+ * @param pfile_ptr Pointer to the pmem_file structure.
+ * @return void * The pointer to the mapped memory.
+ */
+void *pmem_open(const char *path, void *addr, struct pmem_file **pfile_ptr)
+{
+    uint64_t start, ns;
+    int oerrno;
+    struct stat st;
+
+    *pfile_ptr = (struct pmem_file *)malloc(sizeof(struct pmem_file));
+    if (*pfile_ptr == NULL)
+        return NULL;
+    (*pfile_ptr)->fd = -1;
+    (*pfile_ptr)->reserved_size = 0;
+    (*pfile_ptr)->sample = NULL;
+    (*pfile_ptr)->minor_faults = 0;
+    (*pfile_ptr)->major_faults = 0;
+    (*pfile_ptr)->fullpath = strdup(path);
+    if ((*pfile_ptr)->fullpath == NULL)
+        goto exit;
+
+    if (((*pfile_ptr)->fd = open(path, O_RDWR)) < 0)
+        goto exit;
+
+    if (fstat((*pfile_ptr)->fd, &st) || st.st_size == 0)
         goto exit;
+
+    start = pmem_stats_clock();
+    addr = mmap(addr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, (*pfile_ptr)->fd, 0);
+    if (addr == MAP_FAILED)
+        goto exit;
+    ns = pmem_stats_syscall(PMEM_STATS_MMAP, start);
+    PMEM_PROBE3(mmap, addr, st.st_size, ns);
+
+    (*pfile_ptr)->current_size = st.st_size;
+    pmem_stats_map(st.st_size, st.st_size, 0);
+    pmem_stats_dir(path, 1, st.st_size);
+
+    return addr;
+
+exit:
+    oerrno = errno;
+    (void)pmem_stats_failure(addr == MAP_FAILED ? ERROR_MMAP : ERROR_INVALID);
+    if ((*pfile_ptr)->fd != -1)
+        (void)close((*pfile_ptr)->fd);
+    free((*pfile_ptr)->fullpath);
+    free(*pfile_ptr);
+    *pfile_ptr = NULL;
+    errno = oerrno;
+    return NULL;
+}
+
+/**
+ * @brief Unmap the memory and close the file, but keep the file so that it can be mapped again with pmem_open(). The
+ * file is recorded as kept in the subdirectory of its creator, so pmem_reclaim() leaves it in place after the creator
+ * exits, until it is reopened and freed with pmem_free().
+ * @param addr Memory address mapped to the file.
+ * @param pfile_ptr Pointer to the pmem_file struct.
+ *
+ * @return int ERROR_RUNTIME if the file cannot be recorded as kept; the region stays mapped then.
+ */
+int pmem_close(void *addr, struct pmem_file **pfile_ptr)
+{
+    size_t mapped = (*pfile_ptr)->reserved_size ? (*pfile_ptr)->reserved_size : (*pfile_ptr)->current_size;
+    uint64_t start;
+    uint64_t ns;
+
+    if (pmem_dir_keep((*pfile_ptr)->fullpath) != SUCCESS)
+        return pmem_stats_failure(ERROR_RUNTIME);
+    start = pmem_stats_clock();
+    if (munmap(addr, mapped) != 0)
+    {
+        printf("[%s] munmap failed\n", __func__);
+        return pmem_stats_failure(ERROR_MMAP);
     }
-    struct dirent *dp;
-    while ((dp = readdir(dirp)) != NULL)
+    ns = pmem_stats_syscall(PMEM_STATS_MUNMAP, start);
+    PMEM_PROBE3(munmap, addr, mapped, ns);
+    pmem_stats_unmap((*pfile_ptr)->current_size, mapped, 0);
+    pmem_prof_free(*pfile_ptr);
+    pmem_stats_dir((*pfile_ptr)->fullpath, -1, -(int64_t)(*pfile_ptr)->current_size);
+    (void)close((*pfile_ptr)->fd);
+    free((*pfile_ptr)->fullpath);
+    free(*pfile_ptr);
+    *pfile_ptr = NULL;
+
+    return SUCCESS;
+}
+
+static void pmem_flush(const void *addr, size_t len)
+{
+    uintptr_t p = (uintptr_t)addr & ~(uintptr_t)(PMEM_CACHELINE_SIZE - 1);
+    uintptr_t end = (uintptr_t)addr + len;
+
+    if (len == 0)
+        return;
+
+#if defined(__CLWB__)
+    for (; p < end; p += PMEM_CACHELINE_SIZE)
+        _mm_clwb((void *)p);
+    _mm_sfence();
+#elif defined(__CLFLUSHOPT__)
+    for (; p < end; p += PMEM_CACHELINE_SIZE)
+        _mm_clflushopt((void *)p);
+    _mm_sfence();
+#elif defined(__SSE2__)
+    for (; p < end; p += PMEM_CACHELINE_SIZE)
+        _mm_clflush((const void *)p);
+    _mm_sfence();
+#else
+    // No cache flush instruction available, fall back to msync on the covering pages
+    long pagesize = sysconf(_SC_PAGESIZE);
+    p = (uintptr_t)addr & ~(uintptr_t)(pagesize - 1);
+    (void)msync((void *)p, end - p, MS_SYNC);
+#endif
+}
+
+/**
+ * @brief Write back the cache lines covering [addr, addr + len) and wait until they reach the PMEM.
+ *
+ * @param addr Start of the range.
+ * @param len Length of the range in bytes.
+ */
+void pmem_persist(const void *addr, size_t len)
+{
+    pmem_flush(addr, len);
+    if (len)
+        pmem_emulate_write(len);
+}
+
+/**
+ * @brief Copy to the PMEM with non-temporal stores, so that the destination does not pollute the cache and the data
+ * goes to the PMEM without a separate flush. The copy is fenced before returning.
+ *
+ * @param dst Destination.
+ * @param src Source.
+ * @param len Number of bytes to copy.
+ * @return void * dst.
+ */
+void *pmem_memcpy_nt(void *dst, const void *src, size_t len)
+{
+#if defined(__SSE2__)
+    char *d = (char *)dst;
+    const char *s = (const char *)src;
+    size_t head = (16 - ((uintptr_t)d & 15)) & 15;
+
+    pmem_emulate_write(len);
+    if (len < 2 * PMEM_CACHELINE_SIZE)
     {
-        if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
-            continue;
-        char *fullpath = (char *)malloc(strlen(dir) + strlen(dp->d_name) + 2);
-        (void)strcpy(fullpath, dir);
-        (void)strcat(fullpath, "/");
-        (void)strcat(fullpath, dp->d_name);
-        if (unlink(fullpath) != 0)
-        {
-            printf("[%s] unlink failed\n", __func__);
-            err = ERROR_RUNTIME;
-            goto exit;
-        }
-        free(fullpath);
+        memcpy(dst, src, len);
+        pmem_flush(dst, len);
+        return dst;
     }
-    closedir(dirp);
 
-    return err;
+    // Bring the destination to a 16 byte boundary, then stream whole vectors
+    if (head)
+    {
+        memcpy(d, s, head);
+        pmem_flush(d, head);
+        d += head;
+        s += head;
+        len -= head;
+    }
+    for (; len >= 64; len -= 64, d += 64, s += 64)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)s);
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+        __m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+        _mm_stream_si128((__m128i *)d, a);
+        _mm_stream_si128((__m128i *)(d + 16), b);
+        _mm_stream_si128((__m128i *)(d + 32), c);
+        _mm_stream_si128((__m128i *)(d + 48), e);
+    }
+    for (; len >= 16; len -= 16, d += 16, s += 16)
+        _mm_stream_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+    if (len)
+    {
+        memcpy(d, s, len);
+        pmem_flush(d, len);
+    }
+    _mm_sfence();
+#else
+    pmem_emulate_write(len);
+    memcpy(dst, src, len);
+    pmem_flush(dst, len);
+#endif
 
-exit:
-    return err;
+    return dst;
+}
+
+/**
+ * @brief Copy from the PMEM. This is a plain copy, except that emulated read latency and bandwidth apply to it.
+ *
+ * @param dst Destination.
+ * @param src Source on the PMEM.
+ * @param len Number of bytes to copy.
+ * @return void * dst.
+ */
+void *pmem_memcpy_from(void *dst, const void *src, size_t len)
+{
+    pmem_emulate_read(len);
+    return memcpy(dst, src, len);
+}
+
+/**
+ * @brief Change the size of a region allocated by pmem_malloc() or mapped by pmem_open(). The mapping may move, except
+ * for regions from pmem_reserve(), which are resized in place with pmem_extend().
+ *
+ * @param addr Memory address mapped to the file.
+ * @param size New size of the region.
+ * @param pfile_ptr Pointer to the pmem_file struct.
+ * @return void * The new address of the region, or NULL if it could not be resized. The old mapping stays valid then.
+ */
+void *pmem_resize(void *addr, size_t size, struct pmem_file **pfile_ptr)
+{
+    size_t old_size = (*pfile_ptr)->current_size;
+    uint64_t start;
+    void *new_addr;
+
+    if (size == 0)
+        return NULL;
+    if ((*pfile_ptr)->reserved_size != 0)
+        return pmem_extend(addr, size, pfile_ptr) == SUCCESS ? addr : NULL;
+
+    // Grow the file before the mapping, and shrink the mapping before the file
+    start = pmem_stats_clock();
+    if (size > old_size && ftruncate((*pfile_ptr)->fd, size))
+    {
+        (void)pmem_stats_failure(ERROR_RUNTIME);
+        return NULL;
+    }
+    if (size > old_size)
+        pmem_stats_syscall(PMEM_STATS_FTRUNCATE, start);
+    new_addr = mremap(addr, old_size, size, MREMAP_MAYMOVE);
+    if (new_addr == MAP_FAILED)
+    {
+        if (size > old_size)
+            (void)ftruncate((*pfile_ptr)->fd, old_size);
+        (void)pmem_stats_failure(ERROR_MMAP);
+        return NULL;
+    }
+    if (size < old_size)
+    {
+        start = pmem_stats_clock();
+        (void)ftruncate((*pfile_ptr)->fd, size);
+        pmem_stats_syscall(PMEM_STATS_FTRUNCATE, start);
+    }
+
+    (*pfile_ptr)->current_size = size;
+    pmem_stats_resize((int64_t)size - (int64_t)old_size, (int64_t)size - (int64_t)old_size);
+    pmem_stats_dir((*pfile_ptr)->fullpath, 0, (int64_t)size - (int64_t)old_size);
+
+    return new_addr;
+}
+
+/**
+ * @brief Populate the page tables of a range for writing, so that the first accesses do not take page faults.
+ *
+ * @param addr Start of the range.
+ * @param len Length of the range.
+ * @return int
+ */
+int pmem_prefault(void *addr, size_t len)
+{
+    long pagesize = sysconf(_SC_PAGESIZE);
+    char *p = (char *)((uintptr_t)addr & ~(uintptr_t)(pagesize - 1));
+    char *end = (char *)addr + len;
+
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(p, end - p, MADV_POPULATE_WRITE) == 0)
+        return SUCCESS;
+#endif
+    // Older kernels: take a write fault on every page; the atomic add keeps concurrent stores intact
+    for (; p < end; p += pagesize)
+        __atomic_fetch_add(p, 0, __ATOMIC_RELAXED);
+
+    return SUCCESS;
 }
\ No newline at end of file
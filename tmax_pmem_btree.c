@@ -0,0 +1,837 @@
+/**
+ * @brief Hybrid B+-tree: leaves live in a pmem_malloc region, inner nodes live in DRAM.
+ *
+ * Leaves keep their entries in unsorted slots guarded by a validity bitmap, plus a one byte fingerprint per slot, so an
+ * insert writes one slot and one bitmap word instead of shifting entries. Leaves are chained in key order through
+ * their next index; inner nodes are rebuilt from that chain when the tree is reopened.
+ */
+
+#include <tmax_pmem_btree.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define PMEM_BTREE_MAGIC 0x45455254424d5054ULL // "TPMBTREE"
+#define PMEM_BTREE_LEAF_SLOTS 32
+#define PMEM_BTREE_FANOUT 64
+#define PMEM_BTREE_MAX_HEIGHT 16
+#define PMEM_BTREE_CACHELINE_SIZE 64
+
+struct pmem_btree_header
+{
+    uint64_t magic;
+    uint64_t nleaves;   // number of leaves the region can hold
+    uint64_t used;      // number of leaves handed out so far
+    uint64_t log_old;   // split log: leaf being split
+    uint64_t log_new;   // split log: its new right sibling
+    uint64_t log_valid; // split log is valid
+    uint64_t reserved[2];
+};
+
+struct pmem_btree_kv
+{
+    uint64_t key;
+    uint64_t value;
+};
+
+struct pmem_btree_leaf
+{
+    uint64_t bitmap;                    // valid slots
+    uint64_t next;                      // index of the next leaf, 0 if this is the last one
+    uint8_t fp[PMEM_BTREE_LEAF_SLOTS];  // fingerprints of the keys
+    uint8_t reserved[16];
+    struct pmem_btree_kv kv[PMEM_BTREE_LEAF_SLOTS];
+};
+
+struct pmem_btree_inner
+{
+    int nkeys;
+    uint64_t keys[PMEM_BTREE_FANOUT - 1];
+    void *children[PMEM_BTREE_FANOUT]; // inner nodes, or leaves at the lowest inner level
+};
+
+struct pmem_btree
+{
+    struct pmem_file *pfile;           // backing file
+    struct pmem_btree_header *header;  // start of the mapping
+    struct pmem_btree_leaf *leaves;    // leaf array, leaf 0 is always the leftmost one
+    void *root;                        // root node
+    int height;                        // number of inner levels, 0 if the root is a leaf
+    int flags;                         // PMEM_BTREE_* flags
+    size_t count;                      // number of entries
+    pthread_rwlock_t lock;             // readers share, writers are exclusive
+};
+
+struct pmem_btree_path
+{
+    struct pmem_btree_inner *node;
+    int pos;
+};
+
+static inline uint8_t pmem_btree_fingerprint(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (uint8_t)key;
+}
+
+static inline void pmem_btree_persist(struct pmem_btree *tree, const void *addr, size_t len)
+{
+    if (tree->flags & PMEM_BTREE_PERSIST)
+        pmem_persist(addr, len);
+}
+
+static inline uint64_t pmem_btree_leaf_index(struct pmem_btree *tree, struct pmem_btree_leaf *leaf)
+{
+    return (uint64_t)(leaf - tree->leaves);
+}
+
+/**
+ * @brief Bitmask of the valid slots whose fingerprint equals fp.
+ */
+static inline uint32_t pmem_btree_leaf_match(const struct pmem_btree_leaf *leaf, uint8_t fp)
+{
+#if defined(__SSE2__)
+    __m128i needle = _mm_set1_epi8((char)fp);
+    uint32_t lo = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *)leaf->fp), needle));
+    uint32_t hi = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *)(leaf->fp + 16)), needle));
+    return (lo | hi << 16) & (uint32_t)leaf->bitmap;
+#else
+    uint32_t mask = 0;
+    int i;
+    for (i = 0; i < PMEM_BTREE_LEAF_SLOTS; i++)
+        if (leaf->fp[i] == fp)
+            mask |= 1u << i;
+    return mask & (uint32_t)leaf->bitmap;
+#endif
+}
+
+static int pmem_btree_leaf_find(const struct pmem_btree_leaf *leaf, uint64_t key)
+{
+    uint32_t match = pmem_btree_leaf_match(leaf, pmem_btree_fingerprint(key));
+
+    while (match)
+    {
+        int i = __builtin_ctz(match);
+        if (leaf->kv[i].key == key)
+            return i;
+        match &= match - 1;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Descend to the leaf which covers key, optionally recording the path.
+ */
+static struct pmem_btree_leaf *pmem_btree_find_leaf(struct pmem_btree *tree, uint64_t key, struct pmem_btree_path *path)
+{
+    void *node = tree->root;
+    int level;
+
+    for (level = 0; level < tree->height; level++)
+    {
+        struct pmem_btree_inner *inner = (struct pmem_btree_inner *)node;
+        int lo = 0, hi = inner->nkeys;
+
+        // First separator greater than key
+        while (lo < hi)
+        {
+            int mid = (lo + hi) / 2;
+            if (inner->keys[mid] <= key)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (path)
+        {
+            path[level].node = inner;
+            path[level].pos = lo;
+        }
+        node = inner->children[lo];
+    }
+
+    return (struct pmem_btree_leaf *)node;
+}
+
+static void pmem_btree_free_inner(void *node, int height)
+{
+    struct pmem_btree_inner *inner = (struct pmem_btree_inner *)node;
+    int i;
+
+    if (height == 0)
+        return;
+    for (i = 0; i <= inner->nkeys; i++)
+        pmem_btree_free_inner(inner->children[i], height - 1);
+    free(inner);
+}
+
+/**
+ * @brief Allocate the inner nodes a split below path will need: one per full node above the leaf, and a new root if
+ * they are all full. Allocating them up front keeps a failed allocation from leaving a split leaf out of the index.
+ *
+ * @return int ERROR_MALLOC, or ERROR_NOSPACE if the tree would grow beyond PMEM_BTREE_MAX_HEIGHT; nothing is allocated
+ * then.
+ */
+static int pmem_btree_reserve_inner(struct pmem_btree *tree, struct pmem_btree_path *path,
+                                    struct pmem_btree_inner **spare, int *nspare)
+{
+    int level, need = 0;
+
+    for (level = tree->height - 1; level >= 0 && path[level].node->nkeys == PMEM_BTREE_FANOUT - 1; level--)
+        need++;
+    if (level < 0)
+    {
+        if (tree->height == PMEM_BTREE_MAX_HEIGHT)
+            return ERROR_NOSPACE;
+        need++;
+    }
+    for (*nspare = 0; *nspare < need; (*nspare)++)
+    {
+        spare[*nspare] = (struct pmem_btree_inner *)malloc(sizeof(struct pmem_btree_inner));
+        if (spare[*nspare] == NULL)
+        {
+            while (*nspare > 0)
+                free(spare[--(*nspare)]);
+            return ERROR_MALLOC;
+        }
+    }
+    return SUCCESS;
+}
+
+/**
+ * @brief Insert a separator and the right child created by a split into the inner levels above it, taking new inner
+ * nodes from those reserved by pmem_btree_reserve_inner().
+ */
+static void pmem_btree_insert_parent(struct pmem_btree *tree, struct pmem_btree_path *path, uint64_t sep, void *right,
+                                     struct pmem_btree_inner **spare)
+{
+    struct pmem_btree_inner *root;
+    int level;
+
+    for (level = tree->height - 1; level >= 0; level--)
+    {
+        struct pmem_btree_inner *node = path[level].node;
+        struct pmem_btree_inner *sibling;
+        uint64_t keys[PMEM_BTREE_FANOUT];
+        void *children[PMEM_BTREE_FANOUT + 1];
+        int pos = path[level].pos;
+        int mid = PMEM_BTREE_FANOUT / 2;
+
+        if (node->nkeys < PMEM_BTREE_FANOUT - 1)
+        {
+            memmove(&node->keys[pos + 1], &node->keys[pos], (node->nkeys - pos) * sizeof(uint64_t));
+            memmove(&node->children[pos + 2], &node->children[pos + 1], (node->nkeys - pos) * sizeof(void *));
+            node->keys[pos] = sep;
+            node->children[pos + 1] = right;
+            node->nkeys++;
+            return;
+        }
+
+        // Split the full node around its middle key, which moves up a level
+        sibling = *spare++;
+        memcpy(keys, node->keys, pos * sizeof(uint64_t));
+        keys[pos] = sep;
+        memcpy(&keys[pos + 1], &node->keys[pos], (node->nkeys - pos) * sizeof(uint64_t));
+        memcpy(children, node->children, (pos + 1) * sizeof(void *));
+        children[pos + 1] = right;
+        memcpy(&children[pos + 2], &node->children[pos + 1], (node->nkeys - pos) * sizeof(void *));
+
+        node->nkeys = mid;
+        memcpy(node->keys, keys, mid * sizeof(uint64_t));
+        memcpy(node->children, children, (mid + 1) * sizeof(void *));
+        sibling->nkeys = PMEM_BTREE_FANOUT - 1 - mid;
+        memcpy(sibling->keys, &keys[mid + 1], sibling->nkeys * sizeof(uint64_t));
+        memcpy(sibling->children, &children[mid + 1], (sibling->nkeys + 1) * sizeof(void *));
+
+        sep = keys[mid];
+        right = sibling;
+    }
+
+    root = *spare;
+    root->nkeys = 1;
+    root->keys[0] = sep;
+    root->children[0] = tree->root;
+    root->children[1] = right;
+    tree->root = root;
+    tree->height++;
+}
+
+static int pmem_btree_kv_cmp(const void *a, const void *b)
+{
+    uint64_t x = ((const struct pmem_btree_kv *)a)->key;
+    uint64_t y = ((const struct pmem_btree_kv *)b)->key;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Move the upper half of a full leaf into a new right sibling.
+ *
+ * The new leaf is made durable before the split is logged, and the log is kept until the old leaf has dropped the
+ * moved entries, so a crash in between is repaired by pmem_btree_recover().
+ */
+static int pmem_btree_split_leaf(struct pmem_btree *tree, struct pmem_btree_leaf *leaf, struct pmem_btree_leaf **right_ptr,
+                                 uint64_t *sep_ptr)
+{
+    struct pmem_btree_header *header = tree->header;
+    struct pmem_btree_kv sorted[PMEM_BTREE_LEAF_SLOTS];
+    struct pmem_btree_leaf *right;
+    uint64_t moved = 0;
+    uint64_t sep;
+    int i, n;
+
+    if (header->used == header->nleaves)
+        return ERROR_NOSPACE;
+    right = &tree->leaves[header->used];
+    header->used++;
+    pmem_btree_persist(tree, &header->used, sizeof(header->used));
+
+    memcpy(sorted, leaf->kv, sizeof(sorted));
+    qsort(sorted, PMEM_BTREE_LEAF_SLOTS, sizeof(struct pmem_btree_kv), pmem_btree_kv_cmp);
+    sep = sorted[PMEM_BTREE_LEAF_SLOTS / 2].key;
+
+    for (i = 0, n = 0; i < PMEM_BTREE_LEAF_SLOTS; i++)
+    {
+        if (leaf->kv[i].key < sep)
+            continue;
+        right->kv[n] = leaf->kv[i];
+        right->fp[n] = leaf->fp[i];
+        moved |= 1ULL << i;
+        n++;
+    }
+    right->bitmap = (1ULL << n) - 1;
+    right->next = leaf->next;
+    pmem_btree_persist(tree, right, sizeof(*right));
+
+    header->log_old = pmem_btree_leaf_index(tree, leaf);
+    header->log_new = pmem_btree_leaf_index(tree, right);
+    pmem_btree_persist(tree, &header->log_old, 2 * sizeof(uint64_t));
+    header->log_valid = 1;
+    pmem_btree_persist(tree, &header->log_valid, sizeof(uint64_t));
+
+    leaf->next = header->log_new;
+    pmem_btree_persist(tree, &leaf->next, sizeof(leaf->next));
+    leaf->bitmap &= ~moved;
+    pmem_btree_persist(tree, &leaf->bitmap, sizeof(leaf->bitmap));
+
+    header->log_valid = 0;
+    pmem_btree_persist(tree, &header->log_valid, sizeof(uint64_t));
+
+    *right_ptr = right;
+    *sep_ptr = sep;
+    return SUCCESS;
+}
+
+/**
+ * @brief Finish a leaf split interrupted by a crash.
+ */
+static void pmem_btree_recover(struct pmem_btree *tree)
+{
+    struct pmem_btree_header *header = tree->header;
+    struct pmem_btree_leaf *leaf, *right;
+    int i;
+
+    if (!header->log_valid)
+        return;
+
+    leaf = &tree->leaves[header->log_old];
+    right = &tree->leaves[header->log_new];
+    leaf->next = header->log_new;
+    for (i = 0; i < PMEM_BTREE_LEAF_SLOTS; i++)
+        if ((leaf->bitmap & (1ULL << i)) && pmem_btree_leaf_find(right, leaf->kv[i].key) >= 0)
+            leaf->bitmap &= ~(1ULL << i);
+    pmem_persist(leaf, PMEM_BTREE_CACHELINE_SIZE);
+
+    header->log_valid = 0;
+    pmem_persist(&header->log_valid, sizeof(uint64_t));
+}
+
+/**
+ * @brief Rebuild the DRAM inner levels bottom-up from the leaf chain.
+ *
+ * Empty leaves other than the leftmost one stay in the chain but are left out of the index; their key range is
+ * covered by the preceding leaf.
+ */
+static int pmem_btree_rebuild(struct pmem_btree *tree)
+{
+    struct pmem_btree_header *header = tree->header;
+    size_t n = 0, visited = 0, i;
+    uint64_t *keys;
+    void **nodes;
+    uint64_t idx = 0;
+    int err = SUCCESS;
+
+    keys = (uint64_t *)malloc(header->used * sizeof(uint64_t));
+    nodes = (void **)malloc(header->used * sizeof(void *));
+    if (keys == NULL || nodes == NULL)
+    {
+        err = ERROR_MALLOC;
+        goto exit;
+    }
+
+    tree->count = 0;
+    do
+    {
+        struct pmem_btree_leaf *leaf = &tree->leaves[idx];
+        uint64_t min = UINT64_MAX;
+        int slot;
+
+        for (slot = 0; slot < PMEM_BTREE_LEAF_SLOTS; slot++)
+        {
+            if (!(leaf->bitmap & (1ULL << slot)))
+                continue;
+            if (leaf->kv[slot].key < min)
+                min = leaf->kv[slot].key;
+            tree->count++;
+        }
+        if (idx == 0 || leaf->bitmap)
+        {
+            keys[n] = min;
+            nodes[n] = leaf;
+            n++;
+        }
+        idx = leaf->next;
+    } while (idx != 0 && ++visited < header->used);
+
+    tree->root = nodes[0];
+    tree->height = 0;
+
+    // Pack each level into nodes filled to 3/4 so that the next inserts do not split immediately
+    while (n > 1)
+    {
+        size_t fill = PMEM_BTREE_FANOUT * 3 / 4;
+        size_t m = 0;
+
+        for (i = 0; i < n; i += fill)
+        {
+            struct pmem_btree_inner *inner = (struct pmem_btree_inner *)malloc(sizeof(struct pmem_btree_inner));
+            size_t j, end = i + fill < n ? i + fill : n;
+
+            if (inner == NULL)
+            {
+                err = ERROR_MALLOC;
+                goto exit;
+            }
+            inner->nkeys = (int)(end - i - 1);
+            for (j = i; j < end; j++)
+            {
+                inner->children[j - i] = nodes[j];
+                if (j > i)
+                    inner->keys[j - i - 1] = keys[j];
+            }
+            keys[m] = keys[i];
+            nodes[m] = inner;
+            m++;
+        }
+        n = m;
+        tree->root = nodes[0];
+        tree->height++;
+    }
+
+exit:
+    free(keys);
+    free(nodes);
+    return err;
+}
+
+static int pmem_btree_init(struct pmem_btree *tree)
+{
+    tree->leaves = (struct pmem_btree_leaf *)((char *)tree->header + sizeof(struct pmem_btree_header));
+    if (pthread_rwlock_init(&tree->lock, NULL))
+        return ERROR_RUNTIME;
+    return SUCCESS;
+}
+
+static size_t pmem_btree_region_size(uint64_t nleaves)
+{
+    return sizeof(struct pmem_btree_header) + nleaves * sizeof(struct pmem_btree_leaf);
+}
+
+/**
+ * @brief Create an empty tree in a new pmem region.
+ *
+ * @param dir Directory of the backing file.
+ * @param capacity Number of entries the tree has to hold. The file is sparse, so unused leaves take no space.
+ * @param flags PMEM_BTREE_* flags.
+ * @param tree_ptr Pointer to the created tree.
+ * @return int
+ */
+int pmem_btree_create(const char *dir, size_t capacity, int flags, struct pmem_btree **tree_ptr)
+{
+    struct pmem_btree *tree;
+    uint64_t nleaves;
+
+    if (capacity == 0)
+        return ERROR_INVALID;
+
+    // Leaves are at least half full after a split
+    nleaves = capacity / (PMEM_BTREE_LEAF_SLOTS / 2) + 2;
+
+    tree = (struct pmem_btree *)calloc(1, sizeof(struct pmem_btree));
+    if (tree == NULL)
+        return ERROR_MALLOC;
+    tree->flags = flags;
+
+    tree->header = (struct pmem_btree_header *)pmem_malloc(dir, NULL, pmem_btree_region_size(nleaves), &tree->pfile);
+    if (tree->header == NULL)
+    {
+        free(tree);
+        return ERROR_MMAP;
+    }
+    if (pmem_btree_init(tree))
+    {
+        (void)pmem_free(tree->header, &tree->pfile);
+        free(tree);
+        return ERROR_RUNTIME;
+    }
+
+    // Leaf 0 is the empty leftmost leaf
+    tree->header->nleaves = nleaves;
+    tree->header->used = 1;
+    pmem_btree_persist(tree, tree->header, sizeof(struct pmem_btree_header));
+    tree->header->magic = PMEM_BTREE_MAGIC;
+    pmem_btree_persist(tree, &tree->header->magic, sizeof(uint64_t));
+
+    tree->root = &tree->leaves[0];
+    tree->height = 0;
+
+    *tree_ptr = tree;
+    return SUCCESS;
+}
+
+/**
+ * @brief Reattach to a tree kept with pmem_btree_close() or left behind by a crash, and rebuild its inner nodes.
+ *
+ * @param path Path of the backing file, as returned by pmem_btree_path().
+ * @param flags PMEM_BTREE_* flags.
+ * @param tree_ptr Pointer to the opened tree.
+ * @return int
+ */
+int pmem_btree_open(const char *path, int flags, struct pmem_btree **tree_ptr)
+{
+    struct pmem_btree *tree;
+    struct pmem_btree_header *header;
+    int err;
+
+    tree = (struct pmem_btree *)calloc(1, sizeof(struct pmem_btree));
+    if (tree == NULL)
+        return ERROR_MALLOC;
+    tree->flags = flags;
+
+    tree->header = (struct pmem_btree_header *)pmem_open(path, NULL, &tree->pfile);
+    if (tree->header == NULL)
+    {
+        free(tree);
+        return ERROR_MMAP;
+    }
+
+    header = tree->header;
+    if (tree->pfile->current_size < sizeof(*header) || header->magic != PMEM_BTREE_MAGIC || header->used == 0 ||
+        header->used > header->nleaves || tree->pfile->current_size < pmem_btree_region_size(header->nleaves))
+    {
+        printf("[%s] %s is not a pmem B+-tree\n", __func__, path);
+        err = ERROR_INVALID;
+        goto exit;
+    }
+
+    err = pmem_btree_init(tree);
+    if (err)
+        goto exit;
+    pmem_btree_recover(tree);
+    err = pmem_btree_rebuild(tree);
+    if (err)
+    {
+        pmem_btree_free_inner(tree->root, tree->height);
+        pthread_rwlock_destroy(&tree->lock);
+        goto exit;
+    }
+
+    *tree_ptr = tree;
+    return SUCCESS;
+
+exit:
+    (void)pmem_close(tree->header, &tree->pfile);
+    free(tree);
+    return err;
+}
+
+/**
+ * @brief Look up a key.
+ *
+ * @param tree The tree.
+ * @param key The key.
+ * @param value Value stored for the key.
+ * @return int SUCCESS or ERROR_NOT_FOUND.
+ */
+int pmem_btree_get(struct pmem_btree *tree, uint64_t key, uint64_t *value)
+{
+    struct pmem_btree_leaf *leaf;
+    int slot;
+    int err = ERROR_NOT_FOUND;
+
+    pthread_rwlock_rdlock(&tree->lock);
+    leaf = pmem_btree_find_leaf(tree, key, NULL);
+    slot = pmem_btree_leaf_find(leaf, key);
+    if (slot >= 0)
+    {
+        *value = leaf->kv[slot].value;
+        err = SUCCESS;
+    }
+    pthread_rwlock_unlock(&tree->lock);
+
+    return err;
+}
+
+/**
+ * @brief Insert a key or update its value.
+ *
+ * @param tree The tree.
+ * @param key The key.
+ * @param value The value.
+ * @return int SUCCESS, ERROR_NOSPACE if the region has no leaf left for a split or ERROR_MALLOC; the tree is unchanged
+ * on failure.
+ */
+int pmem_btree_put(struct pmem_btree *tree, uint64_t key, uint64_t value)
+{
+    struct pmem_btree_path path[PMEM_BTREE_MAX_HEIGHT];
+    struct pmem_btree_leaf *leaf;
+    uint32_t free_mask;
+    int slot;
+    int err = SUCCESS;
+
+    pthread_rwlock_wrlock(&tree->lock);
+
+    leaf = pmem_btree_find_leaf(tree, key, path);
+    slot = pmem_btree_leaf_find(leaf, key);
+    if (slot >= 0)
+    {
+        leaf->kv[slot].value = value;
+        pmem_btree_persist(tree, &leaf->kv[slot].value, sizeof(uint64_t));
+        goto exit;
+    }
+
+    if ((uint32_t)leaf->bitmap == UINT32_MAX)
+    {
+        struct pmem_btree_inner *spare[PMEM_BTREE_MAX_HEIGHT + 1];
+        struct pmem_btree_leaf *right;
+        uint64_t sep;
+        int nspare;
+
+        // Everything that can fail happens before the leaf is split
+        err = pmem_btree_reserve_inner(tree, path, spare, &nspare);
+        if (err)
+            goto exit;
+        err = pmem_btree_split_leaf(tree, leaf, &right, &sep);
+        if (err)
+        {
+            while (nspare > 0)
+                free(spare[--nspare]);
+            goto exit;
+        }
+        pmem_btree_insert_parent(tree, path, sep, right, spare);
+        if (key >= sep)
+            leaf = right;
+    }
+
+    // Write the slot first; setting its bitmap bit publishes it
+    free_mask = ~(uint32_t)leaf->bitmap;
+    slot = __builtin_ctz(free_mask);
+    leaf->kv[slot].key = key;
+    leaf->kv[slot].value = value;
+    leaf->fp[slot] = pmem_btree_fingerprint(key);
+    pmem_btree_persist(tree, &leaf->kv[slot], sizeof(struct pmem_btree_kv));
+    pmem_btree_persist(tree, &leaf->fp[slot], 1);
+    leaf->bitmap |= 1ULL << slot;
+    pmem_btree_persist(tree, &leaf->bitmap, sizeof(leaf->bitmap));
+    tree->count++;
+
+exit:
+    pthread_rwlock_unlock(&tree->lock);
+    return err;
+}
+
+/**
+ * @brief Remove a key. Leaves are not merged; an emptied leaf is reused by later inserts into its key range.
+ *
+ * @param tree The tree.
+ * @param key The key.
+ * @return int SUCCESS or ERROR_NOT_FOUND.
+ */
+int pmem_btree_remove(struct pmem_btree *tree, uint64_t key)
+{
+    struct pmem_btree_leaf *leaf;
+    int slot;
+    int err = ERROR_NOT_FOUND;
+
+    pthread_rwlock_wrlock(&tree->lock);
+    leaf = pmem_btree_find_leaf(tree, key, NULL);
+    slot = pmem_btree_leaf_find(leaf, key);
+    if (slot >= 0)
+    {
+        leaf->bitmap &= ~(1ULL << slot);
+        pmem_btree_persist(tree, &leaf->bitmap, sizeof(leaf->bitmap));
+        tree->count--;
+        err = SUCCESS;
+    }
+    pthread_rwlock_unlock(&tree->lock);
+
+    return err;
+}
+
+static inline void pmem_btree_prefetch_leaf(const struct pmem_btree_leaf *leaf)
+{
+    const char *p = (const char *)leaf;
+    size_t off;
+
+    for (off = 0; off < sizeof(struct pmem_btree_leaf); off += PMEM_BTREE_CACHELINE_SIZE)
+        __builtin_prefetch(p + off, 0, 0);
+}
+
+/**
+ * @brief Call cb for every entry with lo <= key <= hi in key order.
+ *
+ * The next leaf of the chain is prefetched while the current one is sorted and handed to cb. cb must not modify the
+ * tree.
+ *
+ * @param tree The tree.
+ * @param lo Smallest key to visit.
+ * @param hi Largest key to visit.
+ * @param cb Callback.
+ * @param arg Argument passed to cb.
+ * @return int SUCCESS, or the non-zero value returned by cb.
+ */
+int pmem_btree_scan(struct pmem_btree *tree, uint64_t lo, uint64_t hi, pmem_btree_scan_cb cb, void *arg)
+{
+    struct pmem_btree_kv entries[PMEM_BTREE_LEAF_SLOTS];
+    struct pmem_btree_leaf *leaf;
+    int err = SUCCESS;
+
+    if (lo > hi)
+        return SUCCESS;
+
+    pthread_rwlock_rdlock(&tree->lock);
+    leaf = pmem_btree_find_leaf(tree, lo, NULL);
+    for (;;)
+    {
+        uint64_t bitmap = leaf->bitmap;
+        int n = 0, i, past_end = 0;
+
+        if (leaf->next != 0)
+            pmem_btree_prefetch_leaf(&tree->leaves[leaf->next]);
+
+        while (bitmap)
+        {
+            int slot = __builtin_ctz(bitmap);
+            uint64_t key = leaf->kv[slot].key;
+            bitmap &= bitmap - 1;
+            if (key > hi)
+                past_end = 1;
+            else if (key >= lo)
+                entries[n++] = leaf->kv[slot];
+        }
+
+        // Insertion sort: the slots of a leaf are unsorted
+        for (i = 1; i < n; i++)
+        {
+            struct pmem_btree_kv kv = entries[i];
+            int j = i - 1;
+            while (j >= 0 && entries[j].key > kv.key)
+            {
+                entries[j + 1] = entries[j];
+                j--;
+            }
+            entries[j + 1] = kv;
+        }
+        for (i = 0; i < n; i++)
+        {
+            err = cb(entries[i].key, entries[i].value, arg);
+            if (err)
+                goto exit;
+        }
+
+        if (past_end || leaf->next == 0)
+            break;
+        leaf = &tree->leaves[leaf->next];
+    }
+
+exit:
+    pthread_rwlock_unlock(&tree->lock);
+    return err;
+}
+
+/**
+ * @brief Number of entries in the tree.
+ */
+size_t pmem_btree_count(struct pmem_btree *tree)
+{
+    size_t count;
+
+    pthread_rwlock_rdlock(&tree->lock);
+    count = tree->count;
+    pthread_rwlock_unlock(&tree->lock);
+
+    return count;
+}
+
+/**
+ * @brief Path of the backing file, to be passed to pmem_btree_open() after a restart.
+ */
+const char *pmem_btree_path(struct pmem_btree *tree)
+{
+    return tree->pfile->fullpath;
+}
+
+static void pmem_btree_detach(struct pmem_btree *tree)
+{
+    pmem_btree_free_inner(tree->root, tree->height);
+    pthread_rwlock_destroy(&tree->lock);
+    free(tree);
+}
+
+/**
+ * @brief Write back the leaves and unmap them, keeping the backing file for pmem_btree_open().
+ *
+ * @param tree The tree. Must not be used concurrently.
+ * @return int
+ */
+int pmem_btree_close(struct pmem_btree *tree)
+{
+    void *addr = tree->header;
+    int err;
+
+    if (msync(addr, tree->pfile->current_size, MS_SYNC) != 0)
+    {
+        printf("[%s] msync failed: errno=%d\n", __func__, errno);
+        return ERROR_RUNTIME;
+    }
+    err = pmem_close(addr, &tree->pfile);
+    if (err)
+        return err;
+    pmem_btree_detach(tree);
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Unmap the tree and remove its backing file.
+ *
+ * @param tree The tree. Must not be used concurrently.
+ * @return int
+ */
+int pmem_btree_destroy(struct pmem_btree *tree)
+{
+    int err = pmem_free(tree->header, &tree->pfile);
+    if (err)
+        return err;
+    pmem_btree_detach(tree);
+
+    return SUCCESS;
+}
@@ -0,0 +1,568 @@
+/**
+ * @brief Second-level page cache whose frames live in a pmem_malloc region.
+ *
+ * Pages evicted from a DRAM buffer pool are put into the cache, and read back at PMEM latency instead of going to the
+ * disk. Frames are replaced with CLOCK (second chance). Dirty pages are written back to the disk file by a background
+ * thread, so eviction normally only has to pick a clean frame.
+ */
+
+#include <tmax_pmem_cache.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define PMEM_CACHE_STRIPES 64
+#define PMEM_CACHE_CLAIM_ROUNDS 4 // rounds of two sweeps before pmem_cache_claim() gives up
+#define PMEM_CACHE_NONE UINT32_MAX
+
+enum
+{
+    PMEM_CACHE_FRAME_FREE = 0,  // not in the page table
+    PMEM_CACHE_FRAME_VALID = 1, // holds a page and is in the page table
+    PMEM_CACHE_FRAME_BUSY = 2   // claimed by a thread for eviction or refill
+};
+
+struct pmem_cache_frame
+{
+    uint64_t pageno;          // page held by the frame
+    uint32_t next;            // next frame in the page table chain
+    int state;                // PMEM_CACHE_FRAME_*
+    int ref;                  // CLOCK reference bit
+    int dirty;                // page differs from the disk
+    int queued;               // frame is in the write-back queue
+    pthread_mutex_t io_lock;  // serialises write-backs of the frame
+};
+
+struct pmem_cache
+{
+    struct pmem_file *pfile;         // backing file of the frames
+    char *frames;                    // frame data
+    struct pmem_cache_frame *meta;   // frame metadata (DRAM)
+    size_t page_size;
+    size_t nframes;
+    int fd;                          // disk file the pages belong to
+
+    uint32_t *buckets;               // page table heads
+    uint64_t bucket_mask;
+    pthread_mutex_t stripes[PMEM_CACHE_STRIPES];
+
+    uint64_t hand;                   // CLOCK hand
+
+    uint32_t *queue;                 // write-back ring, one entry per frame at most
+    size_t queue_head;
+    size_t queue_len;
+    pthread_mutex_t queue_lock;
+    pthread_cond_t queue_cond;
+    pthread_t writer;
+    int stop;
+
+    char *bounce;                    // page buffer used by the writer thread
+};
+
+static inline uint64_t pmem_cache_bucket(struct pmem_cache *cache, uint64_t pageno)
+{
+    pageno ^= pageno >> 33;
+    pageno *= 0xff51afd7ed558ccdULL;
+    pageno ^= pageno >> 33;
+    return pageno & cache->bucket_mask;
+}
+
+static inline pthread_mutex_t *pmem_cache_stripe(struct pmem_cache *cache, uint64_t pageno)
+{
+    return &cache->stripes[pmem_cache_bucket(cache, pageno) % PMEM_CACHE_STRIPES];
+}
+
+static inline char *pmem_cache_frame_data(struct pmem_cache *cache, uint32_t f)
+{
+    return cache->frames + (size_t)f * cache->page_size;
+}
+
+/**
+ * @brief Find the frame holding pageno. The caller must hold the stripe lock of pageno.
+ */
+static uint32_t pmem_cache_lookup(struct pmem_cache *cache, uint64_t pageno)
+{
+    uint32_t f = cache->buckets[pmem_cache_bucket(cache, pageno)];
+
+    while (f != PMEM_CACHE_NONE && cache->meta[f].pageno != pageno)
+        f = cache->meta[f].next;
+
+    return f;
+}
+
+static void pmem_cache_unlink(struct pmem_cache *cache, uint32_t f)
+{
+    uint32_t *p = &cache->buckets[pmem_cache_bucket(cache, cache->meta[f].pageno)];
+
+    while (*p != f)
+        p = &cache->meta[*p].next;
+    *p = cache->meta[f].next;
+}
+
+static void pmem_cache_enqueue(struct pmem_cache *cache, uint32_t f)
+{
+    pthread_mutex_lock(&cache->queue_lock);
+    if (!cache->meta[f].queued)
+    {
+        cache->meta[f].queued = 1;
+        cache->queue[(cache->queue_head + cache->queue_len) % cache->nframes] = f;
+        cache->queue_len++;
+        pthread_cond_signal(&cache->queue_cond);
+    }
+    pthread_mutex_unlock(&cache->queue_lock);
+}
+
+static int pmem_cache_pwrite(struct pmem_cache *cache, const char *buf, uint64_t pageno)
+{
+    size_t done = 0;
+
+    while (done < cache->page_size)
+    {
+        ssize_t n = pwrite(cache->fd, buf + done, cache->page_size - done, (off_t)(pageno * cache->page_size + done));
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return ERROR_RUNTIME;
+        }
+        done += n;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Write a dirty frame back to the disk file.
+ *
+ * The page is copied out under the stripe lock and written without it, so readers are not blocked by the disk.
+ */
+static int pmem_cache_write_back(struct pmem_cache *cache, uint32_t f, char *buf)
+{
+    struct pmem_cache_frame *frame = &cache->meta[f];
+    pthread_mutex_t *stripe;
+    uint64_t pageno;
+    int err = SUCCESS;
+
+    pthread_mutex_lock(&frame->io_lock);
+    // The frame may be refilled with another page until we hold the stripe lock of its current page
+    for (;;)
+    {
+        pageno = __atomic_load_n(&frame->pageno, __ATOMIC_RELAXED);
+        stripe = pmem_cache_stripe(cache, pageno);
+        pthread_mutex_lock(stripe);
+        if (frame->pageno == pageno)
+            break;
+        pthread_mutex_unlock(stripe);
+    }
+    if (frame->state == PMEM_CACHE_FRAME_FREE || !frame->dirty)
+    {
+        pthread_mutex_unlock(stripe);
+        goto exit;
+    }
+    memcpy(buf, pmem_cache_frame_data(cache, f), cache->page_size);
+    frame->dirty = 0;
+    pthread_mutex_unlock(stripe);
+
+    err = pmem_cache_pwrite(cache, buf, pageno);
+    if (err)
+    {
+        printf("[%s] pwrite of page %lu failed: errno=%d\n", __func__, (unsigned long)pageno, errno);
+        pthread_mutex_lock(stripe);
+        if (frame->pageno == pageno && frame->state != PMEM_CACHE_FRAME_FREE)
+            frame->dirty = 1;
+        pthread_mutex_unlock(stripe);
+    }
+
+exit:
+    pthread_mutex_unlock(&frame->io_lock);
+    return err;
+}
+
+static void *pmem_cache_writer(void *arg)
+{
+    struct pmem_cache *cache = (struct pmem_cache *)arg;
+
+    pthread_mutex_lock(&cache->queue_lock);
+    for (;;)
+    {
+        uint32_t f;
+
+        while (cache->queue_len == 0 && !cache->stop)
+            pthread_cond_wait(&cache->queue_cond, &cache->queue_lock);
+        if (cache->queue_len == 0)
+            break;
+        f = cache->queue[cache->queue_head];
+        cache->queue_head = (cache->queue_head + 1) % cache->nframes;
+        cache->queue_len--;
+        cache->meta[f].queued = 0;
+        pthread_mutex_unlock(&cache->queue_lock);
+
+        (void)pmem_cache_write_back(cache, f, cache->bounce);
+
+        pthread_mutex_lock(&cache->queue_lock);
+    }
+    pthread_mutex_unlock(&cache->queue_lock);
+
+    return NULL;
+}
+
+/**
+ * @brief Try to take a VALID frame out of the page table. Fails if the frame got dirty meanwhile or a write-back of
+ * it is in flight: write_back() clears dirty before its pwrite, and evicting then would let a read of the page miss
+ * the write, or a later write of the page reach the disk before it.
+ */
+static int pmem_cache_try_evict(struct pmem_cache *cache, uint32_t f)
+{
+    struct pmem_cache_frame *frame = &cache->meta[f];
+    pthread_mutex_t *stripe;
+    int state = PMEM_CACHE_FRAME_VALID;
+
+    if (!__atomic_compare_exchange_n(&frame->state, &state, PMEM_CACHE_FRAME_BUSY, 0, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED))
+        return 0;
+    if (pthread_mutex_trylock(&frame->io_lock))
+    {
+        __atomic_store_n(&frame->state, PMEM_CACHE_FRAME_VALID, __ATOMIC_RELEASE);
+        return 0;
+    }
+
+    // Only the thread which claimed the frame changes its page, so pageno is stable here
+    stripe = pmem_cache_stripe(cache, frame->pageno);
+    pthread_mutex_lock(stripe);
+    if (frame->dirty)
+    {
+        __atomic_store_n(&frame->state, PMEM_CACHE_FRAME_VALID, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(stripe);
+        pthread_mutex_unlock(&frame->io_lock);
+        return 0;
+    }
+    pmem_cache_unlink(cache, f);
+    pthread_mutex_unlock(stripe);
+    pthread_mutex_unlock(&frame->io_lock);
+
+    return 1;
+}
+
+/**
+ * @brief Claim a frame for a new page with CLOCK. The returned frame is BUSY and not in the page table.
+ *
+ * Dirty frames are skipped and handed to the writer. If two sweeps find no clean frame, a dirty one is written back
+ * synchronously. Gives up after PMEM_CACHE_CLAIM_ROUNDS such rounds, e.g. when other threads hold every frame or the
+ * write-backs fail.
+ *
+ * @return uint32_t The frame, or PMEM_CACHE_NONE if no frame could be claimed.
+ */
+static uint32_t pmem_cache_claim(struct pmem_cache *cache)
+{
+    uint32_t dirty_victim = PMEM_CACHE_NONE;
+    size_t i;
+    int round;
+
+    for (round = 0; round < PMEM_CACHE_CLAIM_ROUNDS; round++)
+    {
+        for (i = 0; i < 2 * cache->nframes; i++)
+        {
+            uint32_t f = (uint32_t)(__atomic_fetch_add(&cache->hand, 1, __ATOMIC_RELAXED) % cache->nframes);
+            struct pmem_cache_frame *frame = &cache->meta[f];
+            int state = __atomic_load_n(&frame->state, __ATOMIC_RELAXED);
+
+            if (state == PMEM_CACHE_FRAME_FREE)
+            {
+                if (__atomic_compare_exchange_n(&frame->state, &state, PMEM_CACHE_FRAME_BUSY, 0, __ATOMIC_ACQUIRE,
+                                                __ATOMIC_RELAXED))
+                    return f;
+                continue;
+            }
+            if (state != PMEM_CACHE_FRAME_VALID)
+                continue;
+            if (__atomic_exchange_n(&frame->ref, 0, __ATOMIC_RELAXED))
+                continue;
+            if (__atomic_load_n(&frame->dirty, __ATOMIC_RELAXED))
+            {
+                dirty_victim = f;
+                pmem_cache_enqueue(cache, f);
+                continue;
+            }
+            if (pmem_cache_try_evict(cache, f))
+                return f;
+        }
+
+        if (dirty_victim != PMEM_CACHE_NONE)
+        {
+            char *buf = (char *)malloc(cache->page_size);
+            int evicted = 0;
+
+            // Without a buffer, leave the write-back to the writer thread and sweep again
+            if (buf != NULL)
+            {
+                (void)pmem_cache_write_back(cache, dirty_victim, buf);
+                free(buf);
+                evicted = pmem_cache_try_evict(cache, dirty_victim);
+            }
+            if (evicted)
+                return dirty_victim;
+        }
+    }
+
+    return PMEM_CACHE_NONE;
+}
+
+/**
+ * @brief Create a page cache for the pages of a disk file.
+ *
+ * @param dir Directory of the PMEM file holding the frames.
+ * @param fd Disk file the pages belong to. Dirty pages are written to offset pageno * page_size.
+ * @param page_size Size of a page.
+ * @param nframes Number of page frames.
+ * @param cache_ptr Pointer to the created cache.
+ * @return int
+ */
+int pmem_cache_create(const char *dir, int fd, size_t page_size, size_t nframes, struct pmem_cache **cache_ptr)
+{
+    struct pmem_cache *cache;
+    uint64_t nbuckets = 1;
+    size_t i;
+    int err = ERROR_MALLOC;
+
+    if (page_size == 0 || nframes == 0 || nframes >= PMEM_CACHE_NONE)
+        return ERROR_INVALID;
+
+    cache = (struct pmem_cache *)calloc(1, sizeof(struct pmem_cache));
+    if (cache == NULL)
+        return ERROR_MALLOC;
+    cache->fd = fd;
+    cache->page_size = page_size;
+    cache->nframes = nframes;
+
+    while (nbuckets < nframes)
+        nbuckets <<= 1;
+    cache->bucket_mask = nbuckets - 1;
+
+    cache->meta = (struct pmem_cache_frame *)calloc(nframes, sizeof(struct pmem_cache_frame));
+    cache->buckets = (uint32_t *)malloc(nbuckets * sizeof(uint32_t));
+    cache->queue = (uint32_t *)malloc(nframes * sizeof(uint32_t));
+    cache->bounce = (char *)malloc(page_size);
+    if (cache->meta == NULL || cache->buckets == NULL || cache->queue == NULL || cache->bounce == NULL)
+        goto exit;
+
+    for (i = 0; i < nbuckets; i++)
+        cache->buckets[i] = PMEM_CACHE_NONE;
+    for (i = 0; i < nframes; i++)
+        pthread_mutex_init(&cache->meta[i].io_lock, NULL);
+    for (i = 0; i < PMEM_CACHE_STRIPES; i++)
+        pthread_mutex_init(&cache->stripes[i], NULL);
+    pthread_mutex_init(&cache->queue_lock, NULL);
+    pthread_cond_init(&cache->queue_cond, NULL);
+
+    cache->frames = (char *)pmem_malloc(dir, NULL, page_size * nframes, &cache->pfile);
+    if (cache->frames == NULL)
+    {
+        err = ERROR_MMAP;
+        goto exit;
+    }
+
+    if (pthread_create(&cache->writer, NULL, pmem_cache_writer, cache))
+    {
+        (void)pmem_free(cache->frames, &cache->pfile);
+        err = ERROR_RUNTIME;
+        goto exit;
+    }
+
+    *cache_ptr = cache;
+    return SUCCESS;
+
+exit:
+    free(cache->meta);
+    free(cache->buckets);
+    free(cache->queue);
+    free(cache->bounce);
+    free(cache);
+    return err;
+}
+
+/**
+ * @brief Put a page evicted from the DRAM buffer pool into the cache.
+ *
+ * @param cache The cache.
+ * @param pageno Page number in the disk file.
+ * @param page Page contents, page_size bytes.
+ * @param dirty Non-zero if the page still has to be written to the disk file.
+ * @return int ERROR_NOSPACE if no frame could be freed for the page; a dirty page then has to be written by the caller.
+ */
+int pmem_cache_put(struct pmem_cache *cache, uint64_t pageno, const void *page, int dirty)
+{
+    pthread_mutex_t *stripe = pmem_cache_stripe(cache, pageno);
+    struct pmem_cache_frame *frame;
+    uint32_t f, claimed;
+
+    pthread_mutex_lock(stripe);
+    f = pmem_cache_lookup(cache, pageno);
+    if (f != PMEM_CACHE_NONE)
+        goto update;
+    pthread_mutex_unlock(stripe);
+
+    claimed = pmem_cache_claim(cache);
+    if (claimed == PMEM_CACHE_NONE)
+    {
+        printf("[%s] no frame could be freed for page %lu\n", __func__, (unsigned long)pageno);
+        return ERROR_NOSPACE;
+    }
+
+    pthread_mutex_lock(stripe);
+    // Another thread may have put the same page while we were evicting
+    f = pmem_cache_lookup(cache, pageno);
+    if (f != PMEM_CACHE_NONE)
+    {
+        cache->meta[claimed].dirty = 0;
+        __atomic_store_n(&cache->meta[claimed].state, PMEM_CACHE_FRAME_FREE, __ATOMIC_RELEASE);
+        goto update;
+    }
+
+    f = claimed;
+    frame = &cache->meta[f];
+    __atomic_store_n(&frame->pageno, pageno, __ATOMIC_RELAXED);
+    frame->dirty = 0;
+    frame->next = cache->buckets[pmem_cache_bucket(cache, pageno)];
+    cache->buckets[pmem_cache_bucket(cache, pageno)] = f;
+    __atomic_store_n(&frame->state, PMEM_CACHE_FRAME_VALID, __ATOMIC_RELEASE);
+
+update:
+    frame = &cache->meta[f];
+    memcpy(pmem_cache_frame_data(cache, f), page, cache->page_size);
+    __atomic_store_n(&frame->ref, 1, __ATOMIC_RELAXED);
+    if (dirty && !frame->dirty)
+    {
+        frame->dirty = 1;
+        pthread_mutex_unlock(stripe);
+        pmem_cache_enqueue(cache, f);
+        return SUCCESS;
+    }
+    pthread_mutex_unlock(stripe);
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Copy a cached page out of the cache.
+ *
+ * @param cache The cache.
+ * @param pageno Page number in the disk file.
+ * @param page Buffer of page_size bytes receiving the page.
+ * @return int SUCCESS, or ERROR_NOT_FOUND if the page is not cached.
+ */
+int pmem_cache_get(struct pmem_cache *cache, uint64_t pageno, void *page)
+{
+    pthread_mutex_t *stripe = pmem_cache_stripe(cache, pageno);
+    uint32_t f;
+
+    pthread_mutex_lock(stripe);
+    f = pmem_cache_lookup(cache, pageno);
+    if (f == PMEM_CACHE_NONE)
+    {
+        pthread_mutex_unlock(stripe);
+        return ERROR_NOT_FOUND;
+    }
+    pmem_memcpy_from(page, pmem_cache_frame_data(cache, f), cache->page_size);
+    __atomic_store_n(&cache->meta[f].ref, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(stripe);
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Drop a page from the cache without writing it back, e.g. because the buffer pool holds a newer version.
+ *
+ * @param cache The cache.
+ * @param pageno Page number in the disk file.
+ * @return int SUCCESS, or ERROR_NOT_FOUND if the page is not cached.
+ */
+int pmem_cache_invalidate(struct pmem_cache *cache, uint64_t pageno)
+{
+    pthread_mutex_t *stripe = pmem_cache_stripe(cache, pageno);
+    struct pmem_cache_frame *frame;
+    uint32_t f;
+
+    pthread_mutex_lock(stripe);
+    f = pmem_cache_lookup(cache, pageno);
+    if (f == PMEM_CACHE_NONE)
+    {
+        pthread_mutex_unlock(stripe);
+        return ERROR_NOT_FOUND;
+    }
+    frame = &cache->meta[f];
+    // A frame claimed by an evictor is left to it; clearing dirty is enough for the eviction to go ahead
+    frame->dirty = 0;
+    if (frame->state == PMEM_CACHE_FRAME_VALID)
+    {
+        pmem_cache_unlink(cache, f);
+        __atomic_store_n(&frame->state, PMEM_CACHE_FRAME_FREE, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(stripe);
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Write back every dirty page and sync the disk file.
+ *
+ * @param cache The cache.
+ * @return int
+ */
+int pmem_cache_flush(struct pmem_cache *cache)
+{
+    char *buf;
+    size_t f;
+    int err = SUCCESS;
+
+    buf = (char *)malloc(cache->page_size);
+    if (buf == NULL)
+        return ERROR_MALLOC;
+    for (f = 0; f < cache->nframes; f++)
+        if (__atomic_load_n(&cache->meta[f].dirty, __ATOMIC_RELAXED) && pmem_cache_write_back(cache, (uint32_t)f, buf))
+            err = ERROR_RUNTIME;
+    free(buf);
+
+    if (fsync(cache->fd) != 0)
+        err = ERROR_RUNTIME;
+
+    return err;
+}
+
+/**
+ * @brief Write back every dirty page, stop the writer and free the cache.
+ *
+ * @param cache The cache. Must not be used concurrently.
+ * @return int
+ */
+int pmem_cache_destroy(struct pmem_cache *cache)
+{
+    size_t i;
+    int err;
+
+    pthread_mutex_lock(&cache->queue_lock);
+    cache->stop = 1;
+    pthread_cond_signal(&cache->queue_cond);
+    pthread_mutex_unlock(&cache->queue_lock);
+    pthread_join(cache->writer, NULL);
+
+    err = pmem_cache_flush(cache);
+
+    (void)pmem_free(cache->frames, &cache->pfile);
+    for (i = 0; i < cache->nframes; i++)
+        pthread_mutex_destroy(&cache->meta[i].io_lock);
+    for (i = 0; i < PMEM_CACHE_STRIPES; i++)
+        pthread_mutex_destroy(&cache->stripes[i]);
+    pthread_mutex_destroy(&cache->queue_lock);
+    pthread_cond_destroy(&cache->queue_cond);
+    free(cache->meta);
+    free(cache->buckets);
+    free(cache->queue);
+    free(cache->bounce);
+    free(cache);
+
+    return err;
+}
@@ -0,0 +1,888 @@
+/**
+ * @brief Ownership of PMEM directories. Every process creates its regions in a subdirectory of its own, named after
+ * its pid and start time so that a recycled pid is not mistaken for the owner, and holds an exclusive flock() on a
+ * lease file in it for as long as it lives. The kernel drops the lock when the process dies, however it dies, which
+ * also tells dead owners apart across pid namespaces. Subdirectories of dead processes are renamed into a trash
+ * directory, which is a single atomic step however many files they hold, and deleted by a background thread.
+ *
+ * Regions kept with pmem_close() outlive their creator: they are listed in a file of the subdirectory, and reclaiming
+ * a dead owner only moves the files not on the list. The subdirectory itself goes once none of its kept files is left.
+ */
+
+#define _GNU_SOURCE
+#include <tmax_pmem_dir.h>
+#include <tmax_pmem_stats.h>
+#include <tmax_pmem_release.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Directories cached by pmem_dir_owner(), further ones are resolved on every call
+#define PMEM_DIR_OWNERS 16
+
+// Buffer of one getdents64() call
+#define PMEM_DIR_DENTS (64 << 10)
+
+// Nesting below the trash directory: owner, shard, files
+#define PMEM_DIR_DEPTH 4
+
+struct pmem_dir_owner_entry
+{
+    int state; // 0 free, 1 being filled, 2 ready
+    int lease; // descriptor holding the lease, -1 if another spelling of dir took it
+    unsigned long long shards_made;
+    char *dir;
+    char *path;
+};
+
+static struct pmem_dir_owner_entry pmem_dir_owners[PMEM_DIR_OWNERS];
+static pthread_once_t pmem_dir_once = PTHREAD_ONCE_INIT;
+static unsigned int pmem_dir_shards = 1;
+static int pmem_dir_owner_dirs = 1;
+
+struct pmem_dir_job
+{
+    struct pmem_dir_job *next;
+    char path[];
+};
+
+// Background deletion of trash directories
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_cond_t idle;
+    struct pmem_dir_job *head;
+    struct pmem_dir_job *tail;
+    int running;
+    int busy;
+} pmem_dir_reaper = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/**
+ * @brief Read the start time of a process, field 22 of /proc/<pid>/stat, in clock ticks since boot.
+ *
+ * @return int ERROR_NOT_FOUND if the process does not exist, ERROR_UNAVAILABLE if /proc cannot be read.
+ */
+static int pmem_dir_starttime(pid_t pid, unsigned long long *start)
+{
+    char path[64], buf[1024], *p;
+    ssize_t got;
+    int fd, field;
+
+    (void)snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno == ENOENT ? ERROR_NOT_FOUND : ERROR_UNAVAILABLE;
+    got = read(fd, buf, sizeof(buf) - 1);
+    (void)close(fd);
+    if (got <= 0)
+        return ERROR_UNAVAILABLE;
+    buf[got] = '\0';
+
+    // The command name in field 2 may contain spaces and parentheses, the fields after it do not
+    p = strrchr(buf, ')');
+    if (p == NULL)
+        return ERROR_UNAVAILABLE;
+    for (field = 2; field < 22 && p != NULL; field++)
+        p = strchr(p + 1, ' ');
+    if (p == NULL || sscanf(p + 1, "%llu", start) != 1)
+        return ERROR_UNAVAILABLE;
+    return SUCCESS;
+}
+
+// The cached directories belong to the parent, the child gets subdirectories of its own. The inherited lease
+// descriptors stay open: they keep the regions of the parent, which the child still maps, from being reclaimed.
+static void pmem_dir_atfork_child(void)
+{
+    struct pmem_dir_job *job;
+    int i;
+
+    for (i = 0; i < PMEM_DIR_OWNERS; i++)
+    {
+        if (pmem_dir_owners[i].state == 2)
+        {
+            free(pmem_dir_owners[i].dir);
+            free(pmem_dir_owners[i].path);
+        }
+        pmem_dir_owners[i].state = 0;
+    }
+
+    // The reaper thread does not survive fork(), its queue is left to the parent
+    pthread_mutex_init(&pmem_dir_reaper.lock, NULL);
+    pthread_cond_init(&pmem_dir_reaper.cond, NULL);
+    pthread_cond_init(&pmem_dir_reaper.idle, NULL);
+    while ((job = pmem_dir_reaper.head) != NULL)
+    {
+        pmem_dir_reaper.head = job->next;
+        free(job);
+    }
+    pmem_dir_reaper.tail = NULL;
+    pmem_dir_reaper.running = 0;
+    pmem_dir_reaper.busy = 0;
+}
+
+// Subdirectories left empty are removed at exit, the others by the next cleanup or reclaim, which find them
+// without a lease and go by the pid. Deferred releases are finished first, whatever order the handlers run in.
+static void pmem_dir_atexit(void)
+{
+    struct pmem_dir_owner_entry *entry;
+    char lease[PATH_MAX];
+    unsigned long long made;
+    int i, shard;
+
+    (void)pmem_release_flush();
+    for (i = 0; i < PMEM_DIR_OWNERS; i++)
+    {
+        entry = &pmem_dir_owners[i];
+        if (__atomic_load_n(&entry->state, __ATOMIC_ACQUIRE) != 2)
+            continue;
+        made = __atomic_load_n(&entry->shards_made, __ATOMIC_ACQUIRE);
+        for (shard = 0; made != 0; shard++, made >>= 1)
+            if ((made & 1) && snprintf(lease, sizeof(lease), "%s/%d", entry->path, shard) < (int)sizeof(lease))
+                (void)rmdir(lease);
+        if (entry->lease >= 0 && snprintf(lease, sizeof(lease), "%s/" PMEM_DIR_LEASE, entry->path) < (int)sizeof(lease))
+            (void)unlink(lease);
+        (void)rmdir(entry->path);
+    }
+}
+
+static void pmem_dir_init(void)
+{
+    const char *env = getenv("TMAX_PMEM_SHARDS");
+    long shards;
+
+    if (env != NULL)
+    {
+        shards = atol(env);
+        if (shards >= 1 && shards <= PMEM_DIR_MAX_SHARDS)
+            pmem_dir_shards = (unsigned int)shards;
+        else
+            printf("[%s] ignoring TMAX_PMEM_SHARDS=%s, not in 1..%d\n", __func__, env, PMEM_DIR_MAX_SHARDS);
+    }
+    env = getenv("TMAX_PMEM_OWNER_DIRS");
+    if (env != NULL)
+        pmem_dir_owner_dirs = atoi(env) != 0;
+    (void)pthread_atfork(NULL, NULL, pmem_dir_atfork_child);
+    (void)atexit(pmem_dir_atexit);
+}
+
+/**
+ * @brief Create the subdirectory of the calling process and take its lease. The lease is only taken by the call that
+ * created the subdirectory: flock() locks belong to the open file, so a second open in the same process would conflict
+ * with the first.
+ */
+static int pmem_dir_owner_path(const char *dir, char *path, size_t len, int *lease)
+{
+    unsigned long long start = 0;
+    char name[PATH_MAX];
+    pid_t pid = getpid();
+    int n;
+
+    *lease = -1;
+    // Without /proc the pid alone names the subdirectory
+    (void)pmem_dir_starttime(pid, &start);
+    n = snprintf(path, len, "%s/" PMEM_DIR_OWNER_PREFIX "%d.%llu", dir, (int)pid, start);
+    if (n < 0 || (size_t)n >= len)
+        return ERROR_INVALID;
+    if (mkdir(path, 0700))
+        return errno == EEXIST ? SUCCESS : ERROR_INVALID;
+
+    // Without a lease the subdirectory is still reclaimed by the pid once the process is gone
+    n = snprintf(name, sizeof(name), "%s/" PMEM_DIR_LEASE, path);
+    if (n < 0 || (size_t)n >= sizeof(name))
+        return SUCCESS;
+    *lease = open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (*lease >= 0 && flock(*lease, LOCK_EX | LOCK_NB))
+    {
+        // An unlocked lease would mark the process dead
+        (void)unlink(name);
+        (void)close(*lease);
+        *lease = -1;
+    }
+    return SUCCESS;
+}
+
+/**
+ * @brief Append the shard of the calling thread to the subdirectory of the process, creating it on first use. Shards
+ * are picked by thread id, so threads created one after another use consecutive shards and a thread keeps its shard,
+ * also when there are more threads than CPUs and a thread is preempted holding a directory lock.
+ */
+static int pmem_dir_shard(struct pmem_dir_owner_entry *entry, char *path, size_t len)
+{
+    unsigned int shards = __atomic_load_n(&pmem_dir_shards, __ATOMIC_RELAXED);
+    unsigned int shard;
+    size_t used;
+    int n;
+
+    if (shards <= 1)
+        return SUCCESS;
+    shard = (unsigned int)syscall(SYS_gettid) % shards;
+    used = strlen(path);
+    n = snprintf(path + used, len - used, "/%u", shard);
+    if (n < 0 || (size_t)n >= len - used)
+        return ERROR_INVALID;
+    if (entry != NULL && (__atomic_load_n(&entry->shards_made, __ATOMIC_ACQUIRE) >> shard & 1))
+        return SUCCESS;
+    if (mkdir(path, 0700) && errno != EEXIST)
+        return ERROR_INVALID;
+    if (entry != NULL)
+        (void)__atomic_fetch_or(&entry->shards_made, 1ULL << shard, __ATOMIC_RELEASE);
+    return SUCCESS;
+}
+
+/**
+ * @brief Get the directory in a PMEM directory where the calling thread creates its regions: the subdirectory of the
+ * process, or with TMAX_PMEM_SHARDS > 1 the shard of the thread in it, created on first use. Without subdirectories
+ * per process, see pmem_set_owner_dirs(), the PMEM directory itself.
+ *
+ * @param dir PMEM directory.
+ * @param path Filled with the path of the subdirectory.
+ * @param len Size of path.
+ * @return int ERROR_INVALID if the subdirectory cannot be created.
+ */
+int pmem_dir_owner(const char *dir, char *path, size_t len)
+{
+    struct pmem_dir_owner_entry *entry;
+    int i, state, err, lease;
+
+    (void)pthread_once(&pmem_dir_once, pmem_dir_init);
+    if (!__atomic_load_n(&pmem_dir_owner_dirs, __ATOMIC_RELAXED))
+    {
+        if (strlen(dir) >= len)
+            return ERROR_INVALID;
+        (void)strcpy(path, dir);
+        return SUCCESS;
+    }
+    for (i = 0; i < PMEM_DIR_OWNERS; i++)
+    {
+        entry = &pmem_dir_owners[i];
+        state = __atomic_load_n(&entry->state, __ATOMIC_ACQUIRE);
+        if (state == 2 && strcmp(entry->dir, dir) == 0)
+        {
+            if (strlen(entry->path) >= len)
+                return ERROR_INVALID;
+            (void)strcpy(path, entry->path);
+            return pmem_dir_shard(entry, path, len);
+        }
+        if (state == 0)
+            break;
+    }
+
+    err = pmem_dir_owner_path(dir, path, len, &lease);
+    if (err != SUCCESS)
+        return err;
+
+    // Cache the subdirectory in the first free entry; a racing thread caching the same one only costs an entry.
+    // The lease stays open for the life of the process, cached or not.
+    for (; i < PMEM_DIR_OWNERS; i++)
+    {
+        entry = &pmem_dir_owners[i];
+        state = 0;
+        if (!__atomic_compare_exchange_n(&entry->state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            continue;
+        entry->lease = lease;
+        entry->shards_made = 0;
+        entry->dir = strdup(dir);
+        entry->path = strdup(path);
+        if (entry->dir != NULL && entry->path != NULL)
+        {
+            __atomic_store_n(&entry->state, 2, __ATOMIC_RELEASE);
+            return pmem_dir_shard(entry, path, len);
+        }
+        free(entry->dir);
+        free(entry->path);
+        __atomic_store_n(&entry->state, 0, __ATOMIC_RELEASE);
+        break;
+    }
+    return pmem_dir_shard(NULL, path, len);
+}
+
+/**
+ * @brief Set the number of shards, subdirectories of the subdirectory of the process, that regions are spread over to
+ * avoid contention on the lock of a single directory when many threads create and delete files. The default is
+ * TMAX_PMEM_SHARDS or 1, i.e. no shards. Regions created before the call stay where they are.
+ *
+ * @param shards Number of shards, 1 to PMEM_DIR_MAX_SHARDS.
+ * @return int ERROR_INVALID if shards is out of range.
+ */
+int pmem_set_shards(unsigned int shards)
+{
+    if (shards == 0 || shards > PMEM_DIR_MAX_SHARDS)
+        return ERROR_INVALID;
+    (void)pthread_once(&pmem_dir_once, pmem_dir_init);
+    __atomic_store_n(&pmem_dir_shards, shards, __ATOMIC_RELAXED);
+    return SUCCESS;
+}
+
+/**
+ * @brief Choose whether regions are created in a subdirectory per process, the default, or directly in the PMEM
+ * directory, the older flat layout, e.g. to measure many processes sharing one directory. The default is
+ * TMAX_PMEM_OWNER_DIRS or 1. Regions in the flat layout are not reclaimed once their process is gone; see
+ * pmem_reclaim_legacy(). Shards need subdirectories per process and are not used without them. Regions created
+ * before the call stay where they are.
+ *
+ * @param enable Non-zero for subdirectories per process.
+ */
+void pmem_set_owner_dirs(int enable)
+{
+    (void)pthread_once(&pmem_dir_once, pmem_dir_init);
+    __atomic_store_n(&pmem_dir_owner_dirs, enable != 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Check whether the process owning a subdirectory has exited: its lease can be locked and no process with its
+ * pid and start time runs. The lease is created before it is locked, so a lease that can be locked alone may belong
+ * to a process still setting up its subdirectory. Subdirectories without a lease go by the pid alone, where a pid
+ * reused by a later process is told apart by its start time.
+ *
+ * @param dir PMEM directory.
+ * @param name Name of the subdirectory.
+ * @return int 1 if the owner is dead, 0 if it is alive, unknown or name is not a subdirectory of a process.
+ */
+int pmem_dir_owner_dead(const char *dir, const char *name)
+{
+    unsigned long long start, now;
+    char lease[PATH_MAX];
+    int pid, end = 0, fd, n, dead;
+
+    if (sscanf(name, PMEM_DIR_OWNER_PREFIX "%d.%llu%n", &pid, &start, &end) != 2 || name[end] != '\0' || pid <= 0)
+        return 0;
+
+    n = snprintf(lease, sizeof(lease), "%s/%s/" PMEM_DIR_LEASE, dir, name);
+    if (n < 0 || (size_t)n >= sizeof(lease))
+        return 0;
+    fd = open(lease, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        // The lock is dropped again right away; nobody takes the lease of a dead process
+        dead = flock(fd, LOCK_EX | LOCK_NB) == 0;
+        (void)close(fd);
+        // A name without a start time was made without /proc; the pid cannot confirm the lease then
+        if (!dead || start == 0)
+            return dead;
+    }
+    else if (errno != ENOENT)
+        return 0;
+    switch (pmem_dir_starttime((pid_t)pid, &now))
+    {
+    case ERROR_NOT_FOUND:
+        return 1;
+    case SUCCESS:
+        return now != start;
+    default:
+        // Without /proc only a lease tells
+        return fd >= 0;
+    }
+}
+
+/**
+ * @brief Move a subdirectory of a dead process into the trash directory. The rename is atomic, so the files are gone
+ * from the PMEM directory at once, and a concurrent cleanup of the same subdirectory finds nothing to move.
+ *
+ * @param dir PMEM directory.
+ * @param name Name of the subdirectory.
+ * @return int ERROR_RUNTIME if the subdirectory cannot be moved.
+ */
+int pmem_dir_trash(const char *dir, const char *name)
+{
+    char from[PATH_MAX], to[PATH_MAX];
+    int n;
+
+    n = snprintf(to, sizeof(to), "%s/" PMEM_DIR_TRASH, dir);
+    if (n < 0 || (size_t)n >= sizeof(to) || (mkdir(to, 0700) && errno != EEXIST))
+        return ERROR_RUNTIME;
+    n = snprintf(from, sizeof(from), "%s/%s", dir, name);
+    if (n < 0 || (size_t)n >= sizeof(from))
+        return ERROR_INVALID;
+
+    // A leftover of the same name from an interrupted deletion gets a unique suffix
+    n = snprintf(to, sizeof(to), "%s/" PMEM_DIR_TRASH "/%s", dir, name);
+    if (n < 0 || (size_t)n >= sizeof(to))
+        return ERROR_INVALID;
+    if (rename(from, to) == 0)
+        return SUCCESS;
+    if (errno == ENOENT)
+        return ERROR_NOT_FOUND;
+    if (errno != EEXIST && errno != ENOTEMPTY)
+        return ERROR_RUNTIME;
+    n = snprintf(to, sizeof(to), "%s/" PMEM_DIR_TRASH "/%s.%llu", dir, name,
+                 (unsigned long long)pmem_stats_clock());
+    if (n < 0 || (size_t)n >= sizeof(to))
+        return ERROR_INVALID;
+    if (rename(from, to) == 0)
+        return SUCCESS;
+    return errno == ENOENT ? ERROR_NOT_FOUND : ERROR_RUNTIME;
+}
+
+// Whether rel is a line of the list, which starts with a newline
+static int pmem_dir_listed(const char *list, const char *rel)
+{
+    size_t len = strlen(rel);
+    const char *p;
+
+    for (p = strstr(list, rel); p != NULL; p = strstr(p + 1, rel))
+        if (p[-1] == '\n' && p[len] == '\n')
+            return 1;
+    return 0;
+}
+
+/**
+ * @brief Record that a region in the subdirectory of a process is kept, so that it survives reclaiming the
+ * subdirectory once the process is gone. The list is synced before the call returns. Files outside the subdirectories
+ * of processes are never reclaimed and need no record, nor do anonymous regions.
+ *
+ * @param path Path of the file of the region, NULL for an anonymous region.
+ * @return int ERROR_RUNTIME if the list cannot be written.
+ */
+int pmem_dir_keep(const char *path)
+{
+    const char *owner = NULL, *p, *rel;
+    char name[PATH_MAX], *list;
+    size_t len;
+    ssize_t got;
+    struct stat st;
+    int fd, n, listed, err = SUCCESS;
+
+    if (path == NULL)
+        return SUCCESS;
+    for (p = strstr(path, "/" PMEM_DIR_OWNER_PREFIX); p != NULL; p = strstr(p + 1, "/" PMEM_DIR_OWNER_PREFIX))
+        owner = p;
+    if (owner == NULL || (rel = strchr(owner + 1, '/')) == NULL)
+        return SUCCESS;
+    rel++;
+    n = snprintf(name, sizeof(name), "%.*s/" PMEM_DIR_KEPT, (int)(rel - 1 - path), path);
+    if (n < 0 || (size_t)n >= sizeof(name))
+        return ERROR_INVALID;
+
+    fd = open(name, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        printf("[%s] cannot open %s\n", __func__, name);
+        return ERROR_RUNTIME;
+    }
+    // A region reopened and closed again is already on the list
+    len = strlen(rel);
+    if (fstat(fd, &st) == 0 && st.st_size > 0 && (list = (char *)malloc((size_t)st.st_size + 2)) != NULL)
+    {
+        list[0] = '\n';
+        got = pread(fd, list + 1, (size_t)st.st_size, 0);
+        list[got > 0 ? got + 1 : 1] = '\0';
+        listed = pmem_dir_listed(list, rel);
+        free(list);
+        if (listed)
+            goto exit;
+    }
+    // One write with O_APPEND, so lines of concurrent callers do not interleave
+    if (snprintf(name, sizeof(name), "%s\n", rel) != (int)len + 1 || write(fd, name, len + 1) != (ssize_t)len + 1 ||
+        fdatasync(fd))
+    {
+        printf("[%s] cannot record %s\n", __func__, path);
+        err = ERROR_RUNTIME;
+    }
+
+exit:
+    (void)close(fd);
+    return err;
+}
+
+/**
+ * @brief Move the files of one directory of a dead owner that are not on its kept list to the trash.
+ *
+ * @param fd The directory, the subdirectory of the owner or one of its shards.
+ * @param prefix Path of the directory relative to the subdirectory of the owner, "" for the subdirectory itself.
+ * @param trash Path of the trash directory receiving the files, created on the first move.
+ * @param moved Incremented per file moved.
+ */
+static int pmem_dir_trash_unkept(int fd, const char *prefix, const char *list, const char *trash, unsigned long *moved)
+{
+    char rel[PATH_MAX], to[PATH_MAX];
+    struct dirent *dp;
+    struct stat st;
+    int sub, err = SUCCESS;
+    DIR *dirp;
+
+    dirp = fdopendir(fd);
+    if (dirp == NULL)
+    {
+        (void)close(fd);
+        return ERROR_RUNTIME;
+    }
+    while ((dp = readdir(dirp)) != NULL)
+    {
+        if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0 || strcmp(dp->d_name, PMEM_DIR_KEPT) == 0 ||
+            strcmp(dp->d_name, PMEM_DIR_LEASE) == 0)
+            continue;
+        if (snprintf(rel, sizeof(rel), "%s%s", prefix, dp->d_name) >= (int)sizeof(rel))
+            continue;
+        if (fstatat(dirfd(dirp), dp->d_name, &st, AT_SYMLINK_NOFOLLOW))
+            continue;
+        if (S_ISDIR(st.st_mode))
+        {
+            // Shards hold files only
+            if (*prefix != '\0' || strlen(rel) + 2 > sizeof(rel))
+                continue;
+            strcat(rel, "/");
+            sub = openat(dirfd(dirp), dp->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (sub >= 0 && pmem_dir_trash_unkept(sub, rel, list, trash, moved) != SUCCESS)
+                err = ERROR_RUNTIME;
+            (void)unlinkat(dirfd(dirp), dp->d_name, AT_REMOVEDIR);
+            continue;
+        }
+        if (pmem_dir_listed(list, rel))
+            continue;
+        // Shards reuse file names, the shard becomes part of the name in the trash
+        for (sub = 0; rel[sub] != '\0'; sub++)
+            if (rel[sub] == '/')
+                rel[sub] = '.';
+        if (snprintf(to, sizeof(to), "%s/%s", trash, rel) >= (int)sizeof(to) ||
+            ((*moved == 0 && mkdir(trash, 0700) && errno != EEXIST)))
+        {
+            err = ERROR_RUNTIME;
+            continue;
+        }
+        if (renameat(dirfd(dirp), dp->d_name, AT_FDCWD, to) == 0)
+            (*moved)++;
+        else if (errno != ENOENT)
+            err = ERROR_RUNTIME;
+    }
+    closedir(dirp);
+    return err;
+}
+
+/**
+ * @brief Reclaim the subdirectory of a dead process. Without kept regions it moves to the trash whole. Otherwise only
+ * the files not on the kept list go, and the subdirectory stays for as long as one of its kept files is left.
+ *
+ * @param dir PMEM directory.
+ * @param name Name of the subdirectory.
+ * @return int ERROR_NOT_FOUND if there was nothing to reclaim, ERROR_RUNTIME if something could not be moved.
+ */
+static int pmem_dir_reclaim_owner(const char *dir, const char *name)
+{
+    char path[PATH_MAX], trash[PATH_MAX], *list, *line, *end;
+    unsigned long moved = 0;
+    struct stat st;
+    ssize_t got;
+    int fd, owner, err, left = 0;
+
+    if (snprintf(path, sizeof(path), "%s/%s/" PMEM_DIR_KEPT, dir, name) >= (int)sizeof(path))
+        return ERROR_INVALID;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno == ENOENT ? pmem_dir_trash(dir, name) : ERROR_RUNTIME;
+    if (fstat(fd, &st) || (list = (char *)malloc((size_t)st.st_size + 2)) == NULL)
+    {
+        (void)close(fd);
+        return ERROR_RUNTIME;
+    }
+    list[0] = '\n';
+    got = pread(fd, list + 1, (size_t)st.st_size, 0);
+    (void)close(fd);
+    list[got > 0 ? got + 1 : 1] = '\0';
+
+    // The subdirectory goes whole once every kept region was freed after a reopen
+    (void)snprintf(path, sizeof(path), "%s/%s", dir, name);
+    owner = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (owner < 0)
+    {
+        free(list);
+        return errno == ENOENT ? ERROR_NOT_FOUND : ERROR_RUNTIME;
+    }
+    for (line = list + 1; !left && (end = strchr(line, '\n')) != NULL; line = end + 1)
+    {
+        *end = '\0';
+        left = *line != '\0' && fstatat(owner, line, &st, 0) == 0;
+        *end = '\n';
+    }
+    if (!left)
+    {
+        (void)close(owner);
+        free(list);
+        return pmem_dir_trash(dir, name);
+    }
+
+    // The files go to a directory of their own in the trash, which the background thread deletes like any other
+    if (snprintf(trash, sizeof(trash), "%s/" PMEM_DIR_TRASH, dir) >= (int)sizeof(trash) ||
+        (mkdir(trash, 0700) && errno != EEXIST) ||
+        snprintf(trash, sizeof(trash), "%s/" PMEM_DIR_TRASH "/%s.%llu", dir, name,
+                 (unsigned long long)pmem_stats_clock()) >= (int)sizeof(trash))
+    {
+        (void)close(owner);
+        free(list);
+        return ERROR_RUNTIME;
+    }
+    err = pmem_dir_trash_unkept(owner, "", list, trash, &moved);
+    free(list);
+    if (err == SUCCESS && moved == 0)
+        return ERROR_NOT_FOUND;
+    return err;
+}
+
+/**
+ * @brief Delete everything below a directory, reading it with large getdents64() batches instead of one readdir()
+ * per entry. Deleting entries while reading may make the kernel skip others, so the directory is read again until a
+ * pass deletes nothing.
+ */
+static unsigned long pmem_dir_remove_tree(int fd, char *buf, int depth)
+{
+    struct linux_dirent64 *d;
+    unsigned long removed = 0, pass;
+    struct stat st;
+    long got, off;
+    int sub, isdir;
+
+    do
+    {
+        pass = 0;
+        if (lseek(fd, 0, SEEK_SET) < 0)
+            break;
+        while ((got = syscall(SYS_getdents64, fd, buf + depth * PMEM_DIR_DENTS, PMEM_DIR_DENTS)) > 0)
+        {
+            for (off = 0; off < got; off += d->d_reclen)
+            {
+                d = (struct linux_dirent64 *)(buf + depth * PMEM_DIR_DENTS + off);
+                if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+                    continue;
+                isdir = d->d_type == DT_DIR;
+                if (d->d_type == DT_UNKNOWN)
+                    isdir = fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+                if (isdir && depth + 1 < PMEM_DIR_DEPTH)
+                {
+                    sub = openat(fd, d->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                    if (sub >= 0)
+                    {
+                        removed += pmem_dir_remove_tree(sub, buf, depth + 1);
+                        (void)close(sub);
+                    }
+                }
+                if (unlinkat(fd, d->d_name, isdir ? AT_REMOVEDIR : 0) == 0)
+                    pass++;
+            }
+        }
+        removed += pass;
+    } while (pass > 0 && got == 0);
+    return removed;
+}
+
+static void *pmem_dir_reaper_main(void *arg)
+{
+    struct pmem_dir_job *job;
+    char *buf = (char *)arg;
+    int fd;
+
+    pthread_mutex_lock(&pmem_dir_reaper.lock);
+    for (;;)
+    {
+        while (pmem_dir_reaper.head == NULL)
+        {
+            pmem_dir_reaper.busy = 0;
+            pthread_cond_broadcast(&pmem_dir_reaper.idle);
+            pthread_cond_wait(&pmem_dir_reaper.cond, &pmem_dir_reaper.lock);
+        }
+        job = pmem_dir_reaper.head;
+        pmem_dir_reaper.head = job->next;
+        if (pmem_dir_reaper.head == NULL)
+            pmem_dir_reaper.tail = NULL;
+        pmem_dir_reaper.busy = 1;
+        pthread_mutex_unlock(&pmem_dir_reaper.lock);
+
+        // The trash directory itself stays, a cleanup may be moving the next subdirectory into it
+        fd = open(job->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0)
+        {
+            (void)pmem_dir_remove_tree(fd, buf, 0);
+            (void)close(fd);
+        }
+        free(job);
+
+        pthread_mutex_lock(&pmem_dir_reaper.lock);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Queue the deletion of the trash directory of a PMEM directory, if there is one, to the background thread,
+ * starting it on first use.
+ *
+ * @param dir PMEM directory.
+ * @return int ERROR_RUNTIME if the thread cannot be started.
+ */
+int pmem_dir_purge(const char *dir)
+{
+    size_t len = strlen(dir) + sizeof("/" PMEM_DIR_TRASH);
+    struct pmem_dir_job *job;
+    pthread_t thread;
+    char *buf;
+
+    job = (struct pmem_dir_job *)malloc(sizeof(*job) + len);
+    if (job == NULL)
+        return ERROR_MALLOC;
+    (void)snprintf(job->path, len, "%s/" PMEM_DIR_TRASH, dir);
+    job->next = NULL;
+    if (access(job->path, F_OK) && errno == ENOENT)
+    {
+        free(job);
+        return SUCCESS;
+    }
+
+    pthread_mutex_lock(&pmem_dir_reaper.lock);
+    if (!pmem_dir_reaper.running)
+    {
+        buf = (char *)malloc(PMEM_DIR_DEPTH * PMEM_DIR_DENTS);
+        if (buf == NULL || pthread_create(&thread, NULL, pmem_dir_reaper_main, buf))
+        {
+            pthread_mutex_unlock(&pmem_dir_reaper.lock);
+            printf("[%s] could not start the reaper thread\n", __func__);
+            free(buf);
+            free(job);
+            return ERROR_RUNTIME;
+        }
+        (void)pthread_detach(thread);
+        pmem_dir_reaper.running = 1;
+    }
+    if (pmem_dir_reaper.tail != NULL)
+        pmem_dir_reaper.tail->next = job;
+    else
+        pmem_dir_reaper.head = job;
+    pmem_dir_reaper.tail = job;
+    pmem_dir_reaper.busy = 1;
+    pthread_cond_signal(&pmem_dir_reaper.cond);
+    pthread_mutex_unlock(&pmem_dir_reaper.lock);
+    return SUCCESS;
+}
+
+/**
+ * @brief Reclaim the regions of processes that died without freeing them, however they died: move the subdirectories
+ * of dead owners into the trash and have the background thread delete them. Regions of live processes are never
+ * touched, nor are regions kept with pmem_close(), so this is safe to call at any time, e.g. periodically from
+ * pmem_reclaimd.
+ *
+ * @param dir PMEM directory.
+ * @param owners If not NULL, set to the number of subdirectories reclaimed, whole or apart from their kept regions.
+ * @return int ERROR_INVALID if dir cannot be read, ERROR_RUNTIME if a subdirectory could not be moved.
+ */
+int pmem_reclaim(const char *dir, unsigned long *owners)
+{
+    struct dirent *dp;
+    unsigned long n = 0;
+    int err = SUCCESS;
+    DIR *dirp;
+
+    if (owners != NULL)
+        *owners = 0;
+    dirp = opendir(dir);
+    if (dirp == NULL)
+        return ERROR_INVALID;
+    while ((dp = readdir(dirp)) != NULL)
+    {
+        if (strncmp(dp->d_name, PMEM_DIR_OWNER_PREFIX, sizeof(PMEM_DIR_OWNER_PREFIX) - 1) != 0 ||
+            !pmem_dir_owner_dead(dir, dp->d_name))
+            continue;
+        switch (pmem_dir_reclaim_owner(dir, dp->d_name))
+        {
+        case SUCCESS:
+            n++;
+            break;
+        case ERROR_NOT_FOUND: // moved by a concurrent reclaim
+            break;
+        default:
+            printf("[%s] could not move %s to the trash\n", __func__, dp->d_name);
+            err = ERROR_RUNTIME;
+        }
+    }
+    closedir(dirp);
+
+    // Also picks up what an earlier process left in the trash when it exited before deleting it
+    if (pmem_dir_purge(dir) != SUCCESS)
+        err = ERROR_RUNTIME;
+    if (owners != NULL)
+        *owners = n;
+    return err;
+}
+
+/**
+ * @brief Migrate a directory from the older flat layout: delete the files pmem.XXXXXX directly in dir that no process
+ * has open or mapped. Their creator is not recorded, so nothing else tells a region of a live process apart from a
+ * leaked one; this is why pmem_cleanup_all() and pmem_reclaim() leave them alone. A file counts as unused when a write
+ * lease can be taken on it, which the kernel refuses while any other open file or mapping refers to it. Leases need
+ * the caller to own the file, so files of other users are left alone too. Files kept with pmem_close() by an older
+ * version of the library are not open either; only call this once nothing in dir is meant to be reopened.
+ *
+ * @param dir The directory.
+ * @param files Set to the number of files deleted, may be NULL.
+ * @return int ERROR_INVALID if dir cannot be read, ERROR_RUNTIME if a file could not be deleted.
+ */
+int pmem_reclaim_legacy(const char *dir, unsigned long *files)
+{
+    struct dirent *dp;
+    unsigned long n = 0;
+    int err = SUCCESS;
+    DIR *dirp;
+    int fd;
+
+    if (files != NULL)
+        *files = 0;
+    dirp = opendir(dir);
+    if (dirp == NULL)
+        return ERROR_INVALID;
+    while ((dp = readdir(dirp)) != NULL)
+    {
+        if (strncmp(dp->d_name, "pmem.", 5) != 0 || strlen(dp->d_name) != sizeof("pmem.XXXXXX") - 1)
+            continue;
+        // O_NONBLOCK: fail instead of waiting if someone else holds a lease
+        fd = openat(dirfd(dirp), dp->d_name, O_RDWR | O_NONBLOCK | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        if (fcntl(fd, F_SETLEASE, F_WRLCK) == 0)
+        {
+            if (unlinkat(dirfd(dirp), dp->d_name, 0) == 0)
+                n++;
+            else if (errno != ENOENT)
+            {
+                printf("[%s] unlink failed\n", __func__);
+                err = ERROR_RUNTIME;
+            }
+            (void)fcntl(fd, F_SETLEASE, F_UNLCK);
+        }
+        (void)close(fd);
+    }
+    closedir(dirp);
+
+    if (files != NULL)
+        *files = n;
+    return err;
+}
+
+/**
+ * @brief Wait until the background thread has deleted everything queued by pmem_cleanup_all() and pmem_reclaim(), e.g. before measuring
+ * the free space of the PMEM or at shutdown.
+ *
+ * @return int
+ */
+int pmem_cleanup_wait(void)
+{
+    pthread_mutex_lock(&pmem_dir_reaper.lock);
+    while (pmem_dir_reaper.running && pmem_dir_reaper.busy)
+        pthread_cond_wait(&pmem_dir_reaper.idle, &pmem_dir_reaper.lock);
+    pthread_mutex_unlock(&pmem_dir_reaper.lock);
+    return SUCCESS;
+}
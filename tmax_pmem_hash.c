@@ -0,0 +1,558 @@
+/**
+ * @brief Concurrent hash table whose buckets live in a pmem_malloc region.
+ *
+ * The table uses open addressing over groups of 16 slots. Every group has 16 control bytes which are probed at once
+ * with SIMD compares (Swiss table style). Reads are lock-free and validated with a per-group sequence counter, writes
+ * take a per-group lock. Sequence counters and locks live in DRAM, so they are simply reset on a warm restart.
+ */
+
+#include <tmax_pmem_hash.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define PMEM_HASH_MAGIC 0x485341484d504d54ULL // "TMPMHASH"
+#define PMEM_HASH_GROUP_WIDTH 16
+
+// Control byte values. EMPTY is zero so that a freshly truncated (sparse) file is an empty table.
+#define PMEM_HASH_CTRL_EMPTY ((uint8_t)0x00)
+#define PMEM_HASH_CTRL_DELETED ((uint8_t)0x01)
+#define PMEM_HASH_CTRL_FULL ((uint8_t)0x80) // FULL | 7 bits of the hash
+
+struct pmem_hash_header
+{
+    uint64_t magic;
+    uint64_t ngroups;  // number of groups, power of two
+    uint64_t capacity; // maximum number of entries
+    uint64_t reserved[5];
+};
+
+struct pmem_hash_slot
+{
+    uint64_t key;
+    uint64_t value;
+};
+
+struct pmem_hash
+{
+    struct pmem_file *pfile;      // backing file
+    void *base;                   // start of the mapping
+    uint8_t *ctrl;                // control bytes, ngroups * 16
+    struct pmem_hash_slot *slots; // slots, ngroups * 16
+    uint64_t mask;                // ngroups - 1
+    size_t capacity;              // maximum number of entries
+    size_t count;                 // current number of entries
+    int flags;                    // PMEM_HASH_* flags
+    uint32_t *seq;                // per-group sequence counters (DRAM)
+    uint8_t *locks;               // per-group key locks (DRAM)
+};
+
+static inline void pmem_hash_cpu_relax(void)
+{
+#if defined(__SSE2__)
+    _mm_pause();
+#endif
+}
+
+static inline uint64_t pmem_hash_mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/**
+ * @brief Bitmask of the slots in the group whose control byte equals tag.
+ */
+static inline uint32_t pmem_hash_match(const uint8_t *ctrl, uint8_t tag)
+{
+#if defined(__SSE2__)
+    __m128i group = _mm_load_si128((const __m128i *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+#else
+    uint32_t mask = 0;
+    int i;
+    for (i = 0; i < PMEM_HASH_GROUP_WIDTH; i++)
+        if (ctrl[i] == tag)
+            mask |= 1u << i;
+    return mask;
+#endif
+}
+
+/**
+ * @brief Bitmask of the slots in the group which are EMPTY or DELETED.
+ */
+static inline uint32_t pmem_hash_match_free(const uint8_t *ctrl)
+{
+#if defined(__SSE2__)
+    __m128i group = _mm_load_si128((const __m128i *)ctrl);
+    return ~(uint32_t)_mm_movemask_epi8(group) & 0xffff;
+#else
+    uint32_t mask = 0;
+    int i;
+    for (i = 0; i < PMEM_HASH_GROUP_WIDTH; i++)
+        if (!(ctrl[i] & PMEM_HASH_CTRL_FULL))
+            mask |= 1u << i;
+    return mask;
+#endif
+}
+
+static inline uint32_t pmem_hash_read_begin(struct pmem_hash *hash, uint64_t g)
+{
+    uint32_t v;
+    while ((v = __atomic_load_n(&hash->seq[g], __ATOMIC_ACQUIRE)) & 1)
+        pmem_hash_cpu_relax();
+    return v;
+}
+
+static inline int pmem_hash_read_retry(struct pmem_hash *hash, uint64_t g, uint32_t v)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&hash->seq[g], __ATOMIC_RELAXED) != v;
+}
+
+static inline void pmem_hash_write_lock(struct pmem_hash *hash, uint64_t g)
+{
+    uint32_t v;
+    for (;;)
+    {
+        v = __atomic_load_n(&hash->seq[g], __ATOMIC_RELAXED);
+        if (!(v & 1) && __atomic_compare_exchange_n(&hash->seq[g], &v, v + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return;
+        pmem_hash_cpu_relax();
+    }
+}
+
+static inline void pmem_hash_write_unlock(struct pmem_hash *hash, uint64_t g)
+{
+    __atomic_fetch_add(&hash->seq[g], 1, __ATOMIC_RELEASE);
+}
+
+// The key lock of the home group serialises all writers of keys hashing to that group.
+static inline void pmem_hash_key_lock(struct pmem_hash *hash, uint64_t g)
+{
+    while (__atomic_exchange_n(&hash->locks[g], 1, __ATOMIC_ACQUIRE))
+        pmem_hash_cpu_relax();
+}
+
+static inline void pmem_hash_key_unlock(struct pmem_hash *hash, uint64_t g)
+{
+    __atomic_store_n(&hash->locks[g], 0, __ATOMIC_RELEASE);
+}
+
+static size_t pmem_hash_region_size(uint64_t ngroups)
+{
+    return sizeof(struct pmem_hash_header) + ngroups * PMEM_HASH_GROUP_WIDTH +
+           ngroups * PMEM_HASH_GROUP_WIDTH * sizeof(struct pmem_hash_slot);
+}
+
+/**
+ * @brief Set up the DRAM side of the table for a mapped region.
+ */
+static int pmem_hash_attach(struct pmem_hash *hash)
+{
+    struct pmem_hash_header *header = (struct pmem_hash_header *)hash->base;
+
+    hash->mask = header->ngroups - 1;
+    hash->capacity = header->capacity;
+    hash->ctrl = (uint8_t *)hash->base + sizeof(struct pmem_hash_header);
+    hash->slots = (struct pmem_hash_slot *)(hash->ctrl + header->ngroups * PMEM_HASH_GROUP_WIDTH);
+    hash->seq = (uint32_t *)calloc(header->ngroups, sizeof(uint32_t));
+    hash->locks = (uint8_t *)calloc(header->ngroups, sizeof(uint8_t));
+    if (hash->seq == NULL || hash->locks == NULL)
+    {
+        free(hash->seq);
+        free(hash->locks);
+        return ERROR_MALLOC;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Create an empty hash table in a new pmem region.
+ *
+ * @param dir Directory of the backing file.
+ * @param capacity Maximum number of entries the table has to hold.
+ * @param flags PMEM_HASH_* flags.
+ * @param hash_ptr Pointer to the created table.
+ * @return int
+ */
+int pmem_hash_create(const char *dir, size_t capacity, int flags, struct pmem_hash **hash_ptr)
+{
+    struct pmem_hash *hash;
+    struct pmem_hash_header *header;
+    uint64_t ngroups = 1;
+    int err;
+
+    if (capacity == 0)
+        return ERROR_INVALID;
+
+    // Keep the load factor at or below 7/8
+    while (ngroups * PMEM_HASH_GROUP_WIDTH / 8 * 7 < capacity)
+        ngroups <<= 1;
+
+    hash = (struct pmem_hash *)calloc(1, sizeof(struct pmem_hash));
+    if (hash == NULL)
+        return ERROR_MALLOC;
+    hash->flags = flags;
+
+    hash->base = pmem_malloc(dir, NULL, pmem_hash_region_size(ngroups), &hash->pfile);
+    if (hash->base == NULL)
+    {
+        free(hash);
+        return ERROR_MMAP;
+    }
+
+    // The file is freshly truncated, so every control byte is already EMPTY
+    header = (struct pmem_hash_header *)hash->base;
+    header->ngroups = ngroups;
+    header->capacity = capacity;
+    if (flags & PMEM_HASH_PERSIST)
+        pmem_persist(header, sizeof(*header));
+    header->magic = PMEM_HASH_MAGIC;
+    if (flags & PMEM_HASH_PERSIST)
+        pmem_persist(&header->magic, sizeof(header->magic));
+
+    err = pmem_hash_attach(hash);
+    if (err)
+    {
+        (void)pmem_free(hash->base, &hash->pfile);
+        free(hash);
+        return err;
+    }
+
+    *hash_ptr = hash;
+    return SUCCESS;
+}
+
+/**
+ * @brief Reattach to a table kept with pmem_hash_close(), e.g. after a restart.
+ *
+ * @param path Path of the backing file, as returned by pmem_hash_path().
+ * @param flags PMEM_HASH_* flags.
+ * @param hash_ptr Pointer to the opened table.
+ * @return int
+ */
+int pmem_hash_open(const char *path, int flags, struct pmem_hash **hash_ptr)
+{
+    struct pmem_hash *hash;
+    struct pmem_hash_header *header;
+    uint64_t i;
+    int err;
+
+    hash = (struct pmem_hash *)calloc(1, sizeof(struct pmem_hash));
+    if (hash == NULL)
+        return ERROR_MALLOC;
+    hash->flags = flags;
+
+    hash->base = pmem_open(path, NULL, &hash->pfile);
+    if (hash->base == NULL)
+    {
+        free(hash);
+        return ERROR_MMAP;
+    }
+
+    header = (struct pmem_hash_header *)hash->base;
+    if (hash->pfile->current_size < sizeof(*header) || header->magic != PMEM_HASH_MAGIC ||
+        header->ngroups == 0 || (header->ngroups & (header->ngroups - 1)) ||
+        hash->pfile->current_size < pmem_hash_region_size(header->ngroups))
+    {
+        printf("[%s] %s is not a pmem hash table\n", __func__, path);
+        err = ERROR_INVALID;
+        goto exit;
+    }
+
+    err = pmem_hash_attach(hash);
+    if (err)
+        goto exit;
+
+    for (i = 0; i < header->ngroups * PMEM_HASH_GROUP_WIDTH; i++)
+        if (hash->ctrl[i] & PMEM_HASH_CTRL_FULL)
+            hash->count++;
+
+    *hash_ptr = hash;
+    return SUCCESS;
+
+exit:
+    (void)pmem_close(hash->base, &hash->pfile);
+    free(hash);
+    return err;
+}
+
+/**
+ * @brief Look up a key. Does not take any lock.
+ *
+ * @param hash The table.
+ * @param key The key.
+ * @param value Value stored for the key.
+ * @return int SUCCESS or ERROR_NOT_FOUND.
+ */
+int pmem_hash_get(struct pmem_hash *hash, uint64_t key, uint64_t *value)
+{
+    uint64_t hv = pmem_hash_mix(key);
+    uint8_t tag = PMEM_HASH_CTRL_FULL | (hv & 0x7f);
+    uint64_t g = (hv >> 7) & hash->mask;
+    uint64_t i;
+
+    for (i = 0; i <= hash->mask; i++)
+    {
+        const uint8_t *ctrl = hash->ctrl + g * PMEM_HASH_GROUP_WIDTH;
+        uint64_t found_value = 0;
+        uint32_t v, match;
+        int found, stop;
+
+        do
+        {
+            v = pmem_hash_read_begin(hash, g);
+            found = 0;
+            match = pmem_hash_match(ctrl, tag);
+            while (match)
+            {
+                struct pmem_hash_slot *slot = &hash->slots[g * PMEM_HASH_GROUP_WIDTH + __builtin_ctz(match)];
+                match &= match - 1;
+                if (__atomic_load_n(&slot->key, __ATOMIC_RELAXED) == key)
+                {
+                    found_value = __atomic_load_n(&slot->value, __ATOMIC_RELAXED);
+                    found = 1;
+                    break;
+                }
+            }
+            stop = pmem_hash_match(ctrl, PMEM_HASH_CTRL_EMPTY) != 0;
+        } while (pmem_hash_read_retry(hash, g, v));
+
+        if (found)
+        {
+            *value = found_value;
+            return SUCCESS;
+        }
+        if (stop)
+            break;
+        g = (g + i + 1) & hash->mask;
+    }
+
+    return ERROR_NOT_FOUND;
+}
+
+/**
+ * @brief Find the slot holding key. The caller must hold the key lock of the home group.
+ *
+ * @return The slot index, or -1 if the key is not present. first_free receives the probe step of the first group with a
+ * free slot, or hash->mask + 1 if there is none.
+ */
+static int64_t pmem_hash_find_locked(struct pmem_hash *hash, uint64_t key, uint8_t tag, uint64_t g, uint64_t *first_free,
+                                     uint64_t *first_free_group)
+{
+    uint64_t i;
+
+    *first_free = hash->mask + 1;
+    for (i = 0; i <= hash->mask; i++)
+    {
+        const uint8_t *ctrl = hash->ctrl + g * PMEM_HASH_GROUP_WIDTH;
+        uint32_t match = pmem_hash_match(ctrl, tag);
+
+        // Only writers holding this key lock store this key, so the slot cannot change under us
+        while (match)
+        {
+            uint64_t s = g * PMEM_HASH_GROUP_WIDTH + __builtin_ctz(match);
+            match &= match - 1;
+            if (__atomic_load_n(&hash->slots[s].key, __ATOMIC_RELAXED) == key)
+                return (int64_t)s;
+        }
+        if (*first_free > hash->mask && pmem_hash_match_free(ctrl))
+        {
+            *first_free = i;
+            *first_free_group = g;
+        }
+        if (pmem_hash_match(ctrl, PMEM_HASH_CTRL_EMPTY))
+            break;
+        g = (g + i + 1) & hash->mask;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Insert a key or update its value.
+ *
+ * @param hash The table.
+ * @param key The key.
+ * @param value The value.
+ * @return int SUCCESS or ERROR_NOSPACE if the table is full.
+ */
+int pmem_hash_put(struct pmem_hash *hash, uint64_t key, uint64_t value)
+{
+    uint64_t hv = pmem_hash_mix(key);
+    uint8_t tag = PMEM_HASH_CTRL_FULL | (hv & 0x7f);
+    uint64_t home = (hv >> 7) & hash->mask;
+    uint64_t i, g = 0;
+    int64_t s;
+    int err = ERROR_NOSPACE;
+
+    pmem_hash_key_lock(hash, home);
+
+    s = pmem_hash_find_locked(hash, key, tag, home, &i, &g);
+    if (s >= 0)
+    {
+        g = (uint64_t)s / PMEM_HASH_GROUP_WIDTH;
+        pmem_hash_write_lock(hash, g);
+        __atomic_store_n(&hash->slots[s].value, value, __ATOMIC_RELAXED);
+        if (hash->flags & PMEM_HASH_PERSIST)
+            pmem_persist(&hash->slots[s].value, sizeof(uint64_t));
+        pmem_hash_write_unlock(hash, g);
+        err = SUCCESS;
+        goto exit;
+    }
+
+    if (__atomic_add_fetch(&hash->count, 1, __ATOMIC_RELAXED) > hash->capacity)
+    {
+        __atomic_fetch_sub(&hash->count, 1, __ATOMIC_RELAXED);
+        goto exit;
+    }
+
+    // Other writers may fill the first free slot before we lock its group, so keep probing
+    for (; i <= hash->mask; i++)
+    {
+        uint8_t *ctrl = hash->ctrl + g * PMEM_HASH_GROUP_WIDTH;
+        uint32_t free_mask;
+
+        pmem_hash_write_lock(hash, g);
+        free_mask = pmem_hash_match_free(ctrl);
+        if (free_mask)
+        {
+            int slot = __builtin_ctz(free_mask);
+            struct pmem_hash_slot *p = &hash->slots[g * PMEM_HASH_GROUP_WIDTH + slot];
+
+            // The slot must be durable before the control byte publishes it
+            __atomic_store_n(&p->key, key, __ATOMIC_RELAXED);
+            __atomic_store_n(&p->value, value, __ATOMIC_RELAXED);
+            if (hash->flags & PMEM_HASH_PERSIST)
+                pmem_persist(p, sizeof(*p));
+            __atomic_store_n(&ctrl[slot], tag, __ATOMIC_RELAXED);
+            if (hash->flags & PMEM_HASH_PERSIST)
+                pmem_persist(&ctrl[slot], 1);
+            pmem_hash_write_unlock(hash, g);
+            err = SUCCESS;
+            goto exit;
+        }
+        pmem_hash_write_unlock(hash, g);
+        g = (g + i + 1) & hash->mask;
+    }
+    __atomic_fetch_sub(&hash->count, 1, __ATOMIC_RELAXED);
+
+exit:
+    pmem_hash_key_unlock(hash, home);
+    return err;
+}
+
+/**
+ * @brief Remove a key.
+ *
+ * @param hash The table.
+ * @param key The key.
+ * @return int SUCCESS or ERROR_NOT_FOUND.
+ */
+int pmem_hash_remove(struct pmem_hash *hash, uint64_t key)
+{
+    uint64_t hv = pmem_hash_mix(key);
+    uint8_t tag = PMEM_HASH_CTRL_FULL | (hv & 0x7f);
+    uint64_t home = (hv >> 7) & hash->mask;
+    uint64_t first_free, first_free_group, g;
+    uint8_t *ctrl;
+    int64_t s;
+
+    pmem_hash_key_lock(hash, home);
+
+    s = pmem_hash_find_locked(hash, key, tag, home, &first_free, &first_free_group);
+    if (s < 0)
+    {
+        pmem_hash_key_unlock(hash, home);
+        return ERROR_NOT_FOUND;
+    }
+
+    g = (uint64_t)s / PMEM_HASH_GROUP_WIDTH;
+    ctrl = hash->ctrl + g * PMEM_HASH_GROUP_WIDTH;
+    pmem_hash_write_lock(hash, g);
+    // A group that still has an EMPTY slot never overflowed, so no probe sequence continues past it
+    __atomic_store_n(&ctrl[s % PMEM_HASH_GROUP_WIDTH],
+                     pmem_hash_match(ctrl, PMEM_HASH_CTRL_EMPTY) ? PMEM_HASH_CTRL_EMPTY : PMEM_HASH_CTRL_DELETED,
+                     __ATOMIC_RELAXED);
+    if (hash->flags & PMEM_HASH_PERSIST)
+        pmem_persist(&ctrl[s % PMEM_HASH_GROUP_WIDTH], 1);
+    pmem_hash_write_unlock(hash, g);
+    __atomic_fetch_sub(&hash->count, 1, __ATOMIC_RELAXED);
+
+    pmem_hash_key_unlock(hash, home);
+    return SUCCESS;
+}
+
+/**
+ * @brief Number of entries in the table.
+ */
+size_t pmem_hash_count(struct pmem_hash *hash)
+{
+    return __atomic_load_n(&hash->count, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Path of the backing file, to be passed to pmem_hash_open() after a restart.
+ */
+const char *pmem_hash_path(struct pmem_hash *hash)
+{
+    return hash->pfile->fullpath;
+}
+
+static void pmem_hash_detach(struct pmem_hash *hash)
+{
+    free(hash->seq);
+    free(hash->locks);
+    free(hash);
+}
+
+/**
+ * @brief Write back the table and unmap it, keeping the backing file for pmem_hash_open().
+ *
+ * @param hash The table. Must not be used concurrently.
+ * @return int
+ */
+int pmem_hash_close(struct pmem_hash *hash)
+{
+    int err;
+
+    if (msync(hash->base, hash->pfile->current_size, MS_SYNC) != 0)
+    {
+        printf("[%s] msync failed: errno=%d\n", __func__, errno);
+        return ERROR_RUNTIME;
+    }
+    err = pmem_close(hash->base, &hash->pfile);
+    if (err)
+        return err;
+    pmem_hash_detach(hash);
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Unmap the table and remove its backing file.
+ *
+ * @param hash The table. Must not be used concurrently.
+ * @return int
+ */
+int pmem_hash_destroy(struct pmem_hash *hash)
+{
+    int err = pmem_free(hash->base, &hash->pfile);
+    if (err)
+        return err;
+    pmem_hash_detach(hash);
+
+    return SUCCESS;
+}
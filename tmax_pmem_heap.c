@@ -0,0 +1,423 @@
+/**
+ * @brief General purpose heap carved out of a single pmem_malloc region.
+ *
+ * pmem_malloc() creates one file per call, which is too heavy for containers that allocate and grow often. The heap
+ * reserves one sparse region up front and sub-allocates from it: small blocks come from size-class spans with free
+ * lists, large blocks are runs of pages taken first-fit from an address-ordered free list. Like
+ * std::pmr::memory_resource, the caller passes the size and alignment back on free, so no per-block header is needed.
+ */
+
+#define _GNU_SOURCE
+#include <tmax_pmem_heap.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define PMEM_HEAP_PAGE_SIZE 4096UL
+#define PMEM_HEAP_SPAN_PAGES 16UL
+#define PMEM_HEAP_MIN_ALIGN 16UL
+#define PMEM_HEAP_PUNCH_PAGES 16UL // large frees of at least this many pages give the space back to the file system
+#define PMEM_HEAP_NCLASSES (sizeof(pmem_heap_classes) / sizeof(pmem_heap_classes[0]))
+
+static const size_t pmem_heap_classes[] = {16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048};
+
+struct pmem_heap_run
+{
+    size_t start;  // first page
+    size_t npages; // number of pages
+    struct pmem_heap_run *next;
+};
+
+struct pmem_heap_class
+{
+    void *free_list; // freed blocks, linked through their first word
+    char *bump;      // next never used block of the current span
+    char *end;       // end of the current span
+};
+
+struct pmem_heap
+{
+    struct pmem_file *pfile;
+    char *base;
+    size_t npages;              // pages in the region
+    size_t top;                 // pages below top have been handed out at least once
+    struct pmem_heap_run *runs; // free page runs below top, in address order
+    struct pmem_heap_class classes[PMEM_HEAP_NCLASSES];
+    pthread_mutex_t lock;
+};
+
+/**
+ * @brief Size class for a block, or -1 if the block is served from page runs.
+ *
+ * Aligned blocks use the power of two class covering both size and alignment; spans are page aligned, so its blocks
+ * are naturally aligned.
+ */
+static int pmem_heap_class_index(size_t size, size_t alignment)
+{
+    size_t i;
+
+    if (alignment > PMEM_HEAP_MIN_ALIGN)
+    {
+        size_t s = size > alignment ? size : alignment;
+        size_t pow2 = PMEM_HEAP_MIN_ALIGN;
+        while (pow2 < s)
+            pow2 <<= 1;
+        size = pow2;
+    }
+    for (i = 0; i < PMEM_HEAP_NCLASSES; i++)
+        if (size <= pmem_heap_classes[i])
+            return (int)i;
+
+    return -1;
+}
+
+/**
+ * @brief Take npages pages aligned to align pages. The caller holds the heap lock.
+ */
+static void *pmem_heap_pages_alloc(struct pmem_heap *heap, size_t npages, size_t align)
+{
+    struct pmem_heap_run **p;
+    size_t start;
+
+    for (p = &heap->runs; *p != NULL; p = &(*p)->next)
+    {
+        struct pmem_heap_run *run = *p;
+        size_t aligned = (run->start + align - 1) / align * align;
+        size_t head = aligned - run->start;
+
+        if (head + npages > run->npages)
+            continue;
+
+        // Keep the unaligned head and the tail of the run on the free list
+        if (head + npages < run->npages)
+        {
+            struct pmem_heap_run *tail = (struct pmem_heap_run *)malloc(sizeof(struct pmem_heap_run));
+            if (tail == NULL)
+                return NULL;
+            tail->start = aligned + npages;
+            tail->npages = run->npages - head - npages;
+            tail->next = run->next;
+            run->next = tail;
+        }
+        if (head)
+        {
+            run->npages = head;
+        }
+        else
+        {
+            *p = run->next;
+            free(run);
+        }
+        return heap->base + aligned * PMEM_HEAP_PAGE_SIZE;
+    }
+
+    start = (heap->top + align - 1) / align * align;
+    if (start + npages > heap->npages)
+        return NULL;
+    if (start > heap->top)
+    {
+        struct pmem_heap_run *gap = (struct pmem_heap_run *)malloc(sizeof(struct pmem_heap_run));
+        if (gap == NULL)
+            return NULL;
+        gap->start = heap->top;
+        gap->npages = start - heap->top;
+        gap->next = NULL;
+        for (p = &heap->runs; *p != NULL; p = &(*p)->next)
+            ;
+        *p = gap;
+    }
+    heap->top = start + npages;
+
+    return heap->base + start * PMEM_HEAP_PAGE_SIZE;
+}
+
+/**
+ * @brief Give pages back to the free list, merging with neighbouring runs. The caller holds the heap lock.
+ */
+static void pmem_heap_pages_free(struct pmem_heap *heap, void *ptr, size_t npages)
+{
+    size_t start = (size_t)((char *)ptr - heap->base) / PMEM_HEAP_PAGE_SIZE;
+    struct pmem_heap_run **p = &heap->runs;
+    struct pmem_heap_run *prev = NULL, *run;
+
+    if (npages >= PMEM_HEAP_PUNCH_PAGES)
+        (void)fallocate(heap->pfile->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                        (off_t)(start * PMEM_HEAP_PAGE_SIZE), (off_t)(npages * PMEM_HEAP_PAGE_SIZE));
+
+    while (*p != NULL && (*p)->start < start)
+    {
+        prev = *p;
+        p = &(*p)->next;
+    }
+
+    if (prev != NULL && prev->start + prev->npages == start)
+    {
+        prev->npages += npages;
+        run = prev;
+    }
+    else
+    {
+        run = (struct pmem_heap_run *)malloc(sizeof(struct pmem_heap_run));
+        if (run == NULL)
+        {
+            printf("[%s] lost %zu pages: malloc failed\n", __func__, npages);
+            return;
+        }
+        run->start = start;
+        run->npages = npages;
+        run->next = *p;
+        *p = run;
+    }
+
+    if (run->next != NULL && run->start + run->npages == run->next->start)
+    {
+        struct pmem_heap_run *next = run->next;
+        run->npages += next->npages;
+        run->next = next->next;
+        free(next);
+    }
+}
+
+/**
+ * @brief Create a heap backed by one sparse pmem region.
+ *
+ * @param dir Directory of the backing file.
+ * @param capacity Size of the region. Only the pages actually used take space on the PMEM.
+ * @param heap_ptr Pointer to the created heap.
+ * @return int
+ */
+int pmem_heap_create(const char *dir, size_t capacity, struct pmem_heap **heap_ptr)
+{
+    struct pmem_heap *heap;
+
+    capacity = (capacity + PMEM_HEAP_PAGE_SIZE - 1) / PMEM_HEAP_PAGE_SIZE * PMEM_HEAP_PAGE_SIZE;
+    if (capacity == 0)
+        return ERROR_INVALID;
+
+    heap = (struct pmem_heap *)calloc(1, sizeof(struct pmem_heap));
+    if (heap == NULL)
+        return ERROR_MALLOC;
+
+    heap->base = (char *)pmem_malloc(dir, NULL, capacity, &heap->pfile);
+    if (heap->base == NULL)
+    {
+        free(heap);
+        return ERROR_MMAP;
+    }
+    heap->npages = capacity / PMEM_HEAP_PAGE_SIZE;
+    pthread_mutex_init(&heap->lock, NULL);
+
+    *heap_ptr = heap;
+    return SUCCESS;
+}
+
+/**
+ * @brief Allocate a block from the heap.
+ *
+ * @param heap The heap.
+ * @param size Size of the block.
+ * @param alignment Alignment of the block, a power of two.
+ * @return void * The block, or NULL if the heap is exhausted.
+ */
+void *pmem_heap_alloc(struct pmem_heap *heap, size_t size, size_t alignment)
+{
+    int c;
+    void *ptr = NULL;
+
+    if (alignment == 0 || (alignment & (alignment - 1)))
+        return NULL;
+    if (size == 0)
+        size = 1;
+
+    pthread_mutex_lock(&heap->lock);
+    c = pmem_heap_class_index(size, alignment);
+    if (c >= 0)
+    {
+        struct pmem_heap_class *cls = &heap->classes[c];
+        size_t csize = pmem_heap_classes[c];
+
+        if (cls->free_list != NULL)
+        {
+            ptr = cls->free_list;
+            cls->free_list = *(void **)ptr;
+        }
+        else
+        {
+            if (cls->bump == NULL || cls->bump + csize > cls->end)
+            {
+                cls->bump = (char *)pmem_heap_pages_alloc(heap, PMEM_HEAP_SPAN_PAGES, 1);
+                cls->end = cls->bump ? cls->bump + PMEM_HEAP_SPAN_PAGES * PMEM_HEAP_PAGE_SIZE : NULL;
+            }
+            if (cls->bump != NULL)
+            {
+                ptr = cls->bump;
+                cls->bump += csize;
+            }
+        }
+    }
+    else
+    {
+        size_t align = alignment > PMEM_HEAP_PAGE_SIZE ? alignment / PMEM_HEAP_PAGE_SIZE : 1;
+        ptr = pmem_heap_pages_alloc(heap, (size + PMEM_HEAP_PAGE_SIZE - 1) / PMEM_HEAP_PAGE_SIZE, align);
+    }
+    pthread_mutex_unlock(&heap->lock);
+
+    return ptr;
+}
+
+/**
+ * @brief Free a block allocated by pmem_heap_alloc().
+ *
+ * @param heap The heap.
+ * @param ptr The block.
+ * @param size Size passed to pmem_heap_alloc().
+ * @param alignment Alignment passed to pmem_heap_alloc().
+ */
+void pmem_heap_free(struct pmem_heap *heap, void *ptr, size_t size, size_t alignment)
+{
+    int c;
+
+    if (ptr == NULL)
+        return;
+    if (size == 0)
+        size = 1;
+
+    pthread_mutex_lock(&heap->lock);
+    c = pmem_heap_class_index(size, alignment);
+    if (c >= 0)
+    {
+        *(void **)ptr = heap->classes[c].free_list;
+        heap->classes[c].free_list = ptr;
+    }
+    else
+    {
+        pmem_heap_pages_free(heap, ptr, (size + PMEM_HEAP_PAGE_SIZE - 1) / PMEM_HEAP_PAGE_SIZE);
+    }
+    pthread_mutex_unlock(&heap->lock);
+}
+
+/**
+ * @brief Check whether a pointer lies in the region of the heap. The region never moves, so no lock is taken.
+ *
+ * @param heap The heap.
+ * @param ptr Any pointer.
+ * @return int 1 if ptr points into the heap, 0 otherwise.
+ */
+int pmem_heap_contains(const struct pmem_heap *heap, const void *ptr)
+{
+    return (uintptr_t)ptr - (uintptr_t)heap->base < heap->npages * PMEM_HEAP_PAGE_SIZE;
+}
+
+/**
+ * @brief Copy the pages of the heap handed out so far into anonymous memory, e.g. in a fork() prepare handler, for
+ * pmem_heap_detach() in the child. Holes of the sparse region are skipped and stay unpopulated in the copy. The copy
+ * costs DRAM and time in proportion to the heap, hence the limit. Blocks written by other threads while it is taken
+ * may be copied in either state.
+ *
+ * @param heap The heap.
+ * @param limit Largest heap, in bytes up to the highest page handed out, to copy.
+ * @param snapshot Pointer to the copy. Unmap it with munmap(), or hand it to pmem_heap_detach().
+ * @param len Pointer to the length of the copy, at least one page.
+ * @return int ERROR_NOSPACE if the heap is larger than limit, ERROR_MMAP if there is not enough memory for the copy.
+ */
+int pmem_heap_snapshot(struct pmem_heap *heap, size_t limit, void **snapshot, size_t *len)
+{
+    off_t data, hole, end;
+    size_t top;
+    char *copy;
+
+    // Pages below top stay mapped, so only reading top needs the lock
+    pthread_mutex_lock(&heap->lock);
+    top = heap->top;
+    pthread_mutex_unlock(&heap->lock);
+    if (top > limit / PMEM_HEAP_PAGE_SIZE)
+        return ERROR_NOSPACE;
+    *len = (top ? top : 1) * PMEM_HEAP_PAGE_SIZE;
+    copy = (char *)mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (copy == MAP_FAILED)
+        return ERROR_MMAP;
+
+    end = (off_t)(top * PMEM_HEAP_PAGE_SIZE);
+    data = lseek(heap->pfile->fd, 0, SEEK_DATA);
+    if (data < 0 && errno != ENXIO) // no SEEK_DATA on this file system, copy everything
+        memcpy(copy, heap->base, (size_t)end);
+    for (; data >= 0 && data < end; data = lseek(heap->pfile->fd, hole, SEEK_DATA))
+    {
+        hole = lseek(heap->pfile->fd, data, SEEK_HOLE);
+        if (hole < 0 || hole > end)
+            hole = end;
+        memcpy(copy + data, heap->base + data, (size_t)(hole - data));
+    }
+
+    *snapshot = copy;
+    return SUCCESS;
+}
+
+/**
+ * @brief Replace the shared mapping of the heap region by a snapshot taken with pmem_heap_snapshot(), e.g. in a forked
+ * child, so that the child keeps the blocks as they were at fork() and neither process sees the writes of the other.
+ * The rest of the region becomes empty anonymous memory and the backing file is closed. The heap must not allocate or
+ * free afterwards.
+ *
+ * Without a snapshot, e.g. because none was asked for or it did not fit, the region is mapped privately copy-on-write:
+ * pages the other process changes are then seen until this process writes them.
+ *
+ * @param heap The heap.
+ * @param snapshot The snapshot, moved over the region, or NULL.
+ * @param len Length of the snapshot, 0 without one.
+ * @return int
+ */
+int pmem_heap_detach(struct pmem_heap *heap, void *snapshot, size_t len)
+{
+    size_t size = heap->npages * PMEM_HEAP_PAGE_SIZE;
+
+    if (snapshot == NULL)
+    {
+        if (mmap(heap->base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE | MAP_FIXED, heap->pfile->fd,
+                 0) == MAP_FAILED)
+            return ERROR_MMAP;
+        return SUCCESS;
+    }
+    if (mremap(snapshot, len, len, MREMAP_MAYMOVE | MREMAP_FIXED, heap->base) == MAP_FAILED)
+        return ERROR_MMAP;
+    if (len < size && mmap(heap->base + len, size - len, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED)
+        return ERROR_MMAP;
+    (void)close(heap->pfile->fd);
+    heap->pfile->fd = -1;
+
+    return SUCCESS;
+}
+
+const char *pmem_heap_path(const struct pmem_heap *heap)
+{
+    return heap->pfile->fullpath;
+}
+
+/**
+ * @brief Free the heap and remove its backing file. All blocks are released at once.
+ *
+ * @param heap The heap.
+ * @return int
+ */
+int pmem_heap_destroy(struct pmem_heap *heap)
+{
+    int err = pmem_free(heap->base, &heap->pfile);
+
+    while (heap->runs != NULL)
+    {
+        struct pmem_heap_run *next = heap->runs->next;
+        free(heap->runs);
+        heap->runs = next;
+    }
+    pthread_mutex_destroy(&heap->lock);
+    free(heap);
+
+    return err;
+}
@@ -0,0 +1,235 @@
+/**
+ * @brief Latency histograms of the library entry points. Every thread records into histograms of its own without
+ * locks or atomic read-modify-writes; pmem_hist_snapshot() merges those of all threads. The histograms of threads that
+ * exit are kept and taken over by new threads, so counts are never lost and memory stays bounded by the peak number of
+ * threads.
+ */
+
+#define _GNU_SOURCE
+#include <tmax_pmem_hist.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+
+struct pmem_hist_thread
+{
+    struct pmem_hist hist[PMEM_HIST_OPS];
+    struct pmem_hist_thread *next;
+    int in_use;
+};
+
+static struct pmem_hist_thread *pmem_hist_threads; // never shrinks
+static __thread struct pmem_hist_thread *pmem_hist_self __attribute__((tls_model("initial-exec")));
+static pthread_key_t pmem_hist_key;
+static pthread_once_t pmem_hist_once = PTHREAD_ONCE_INIT;
+
+static const char *pmem_hist_names[PMEM_HIST_OPS] = {"pmem_malloc", "pmem_free", "pmem_create_tmpfile", "mmap",
+                                                     "munmap"};
+
+static void pmem_hist_release(void *arg)
+{
+    struct pmem_hist_thread *t = (struct pmem_hist_thread *)arg;
+
+    pmem_hist_self = NULL;
+    __atomic_store_n(&t->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void pmem_hist_init(void)
+{
+    (void)pthread_key_create(&pmem_hist_key, pmem_hist_release);
+}
+
+/**
+ * @brief Histograms of the calling thread: one left by an exited thread, or new ones.
+ */
+static struct pmem_hist_thread *pmem_hist_attach(void)
+{
+    struct pmem_hist_thread *t;
+    int free_slot;
+    int op;
+
+    (void)pthread_once(&pmem_hist_once, pmem_hist_init);
+    for (t = __atomic_load_n(&pmem_hist_threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next)
+    {
+        free_slot = 0;
+        if (__atomic_compare_exchange_n(&t->in_use, &free_slot, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (t == NULL)
+    {
+        // Not malloc(): the library may be the allocator of the process
+        t = mmap(NULL, sizeof(*t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (t == MAP_FAILED)
+            return NULL;
+        for (op = 0; op < PMEM_HIST_OPS; op++)
+            t->hist[op].min = UINT64_MAX;
+        t->in_use = 1;
+        t->next = __atomic_load_n(&pmem_hist_threads, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&pmem_hist_threads, &t->next, t, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    (void)pthread_setspecific(pmem_hist_key, t);
+    pmem_hist_self = t;
+    return t;
+}
+
+static int pmem_hist_bucket(uint64_t ns)
+{
+    int e;
+
+    if (ns < (1ULL << PMEM_HIST_SUB_BITS))
+        return (int)ns;
+    e = 63 - __builtin_clzll(ns);
+    if (e >= PMEM_HIST_MAX_SHIFT)
+        return PMEM_HIST_BUCKETS - 1;
+    return ((e - PMEM_HIST_SUB_BITS + 1) << PMEM_HIST_SUB_BITS) +
+           (int)((ns >> (e - PMEM_HIST_SUB_BITS)) - (1ULL << PMEM_HIST_SUB_BITS));
+}
+
+/**
+ * @brief Largest value that falls into a bucket.
+ */
+static uint64_t pmem_hist_bucket_max(int bucket)
+{
+    int octave = bucket >> PMEM_HIST_SUB_BITS;
+    uint64_t sub = bucket & ((1 << PMEM_HIST_SUB_BITS) - 1);
+
+    if (octave == 0)
+        return (uint64_t)bucket;
+    if (bucket == PMEM_HIST_BUCKETS - 1)
+        return UINT64_MAX;
+    return (((1ULL << PMEM_HIST_SUB_BITS) + sub + 1) << (octave - 1)) - 1;
+}
+
+/**
+ * @brief Record a latency of the calling thread. Only the thread itself writes its histograms, so plain stores suffice;
+ * they are atomic to keep concurrent snapshots free of torn values.
+ *
+ * @param op One of PMEM_HIST_*.
+ * @param ns Latency in nanoseconds.
+ */
+void pmem_hist_record(int op, uint64_t ns)
+{
+    struct pmem_hist_thread *t = pmem_hist_self;
+    struct pmem_hist *h;
+    int b;
+
+    if (t == NULL && (t = pmem_hist_attach()) == NULL)
+        return;
+    h = &t->hist[op];
+    b = pmem_hist_bucket(ns);
+    __atomic_store_n(&h->buckets[b], h->buckets[b] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + ns, __ATOMIC_RELAXED);
+    if (ns < h->min)
+        __atomic_store_n(&h->min, ns, __ATOMIC_RELAXED);
+    if (ns > h->max)
+        __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+    // Last, so that a snapshot never sees more calls than bucket entries
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Add the counts of src to dst. dst may start zeroed.
+ */
+void pmem_hist_merge(struct pmem_hist *dst, const struct pmem_hist *src)
+{
+    int b;
+
+    if (src->count == 0)
+        return;
+    if (dst->count == 0 || src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    dst->count += src->count;
+    dst->sum += src->sum;
+    for (b = 0; b < PMEM_HIST_BUCKETS; b++)
+        dst->buckets[b] += src->buckets[b];
+}
+
+/**
+ * @brief Merge the histograms of all threads for one entry point. Calls in flight may be missing.
+ *
+ * @param op One of PMEM_HIST_*.
+ * @param hist Filled with the merged histogram.
+ * @return int ERROR_INVALID for an unknown op.
+ */
+int pmem_hist_snapshot(int op, struct pmem_hist *hist)
+{
+    const struct pmem_hist *h;
+    struct pmem_hist_thread *t;
+    uint64_t n, value, min, max;
+    int b;
+
+    if (op < 0 || op >= PMEM_HIST_OPS || hist == NULL)
+        return ERROR_INVALID;
+    memset(hist, 0, sizeof(*hist));
+    for (t = __atomic_load_n(&pmem_hist_threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next)
+    {
+        h = &t->hist[op];
+        if (__atomic_load_n(&h->count, __ATOMIC_ACQUIRE) == 0)
+            continue;
+        // The buckets may run ahead of the count; count what they hold
+        n = 0;
+        for (b = 0; b < PMEM_HIST_BUCKETS; b++)
+        {
+            value = __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+            hist->buckets[b] += value;
+            n += value;
+        }
+        min = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+        max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+        if (hist->count == 0 || min < hist->min)
+            hist->min = min;
+        if (max > hist->max)
+            hist->max = max;
+        hist->count += n;
+        hist->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+    }
+    return SUCCESS;
+}
+
+/**
+ * @brief Value below or at which the given percentage of the recorded latencies lie, accurate to 1/32 of the value.
+ *
+ * @param hist Histogram from pmem_hist_snapshot() or pmem_hist_merge().
+ * @param percentile Percentage in [0, 100], e.g. 99.9.
+ * @return uint64_t Latency in ns, 0 if the histogram is empty.
+ */
+uint64_t pmem_hist_percentile(const struct pmem_hist *hist, double percentile)
+{
+    uint64_t total = 0, rank, seen = 0;
+    uint64_t value;
+    int b;
+
+    for (b = 0; b < PMEM_HIST_BUCKETS; b++)
+        total += hist->buckets[b];
+    if (total == 0)
+        return 0;
+    if (percentile < 0)
+        percentile = 0;
+    if (percentile > 100)
+        percentile = 100;
+    rank = (uint64_t)(percentile / 100.0 * (double)(total - 1)) + 1;
+    for (b = 0; b < PMEM_HIST_BUCKETS - 1; b++)
+    {
+        seen += hist->buckets[b];
+        if (seen >= rank)
+            break;
+    }
+    value = pmem_hist_bucket_max(b);
+    // The exact extremes are known
+    if (value > hist->max)
+        value = hist->max;
+    if (value < hist->min)
+        value = hist->min;
+    return value;
+}
+
+/**
+ * @brief Name of an entry point, for reports.
+ */
+const char *pmem_hist_name(int op)
+{
+    return op >= 0 && op < PMEM_HIST_OPS ? pmem_hist_names[op] : "unknown";
+}
@@ -0,0 +1,612 @@
+/**
+ * @brief LD_PRELOAD interposer that moves the large allocations of unmodified binaries onto the PMEM.
+ *
+ *     TMAX_PMEM_PRELOAD_DIR=/pmem/tmp LD_PRELOAD=./libtmax_pmem_preload.so ./legacy
+ *
+ * malloc, calloc, realloc, reallocarray, posix_memalign, aligned_alloc, memalign, malloc_usable_size and free are
+ * interposed. Allocations of at least the threshold, or made directly from one of the configured call sites, come from
+ * a pmem heap; all others go to the next allocator, normally glibc. The heap is one sparse region that never moves, so
+ * free() tells the two apart with a range check. Its file is unlinked as soon as it is mapped and disappears with the
+ * process.
+ *
+ * Environment:
+ *   TMAX_PMEM_PRELOAD_DIR        directory of the heap file; nothing is redirected if unset
+ *   TMAX_PMEM_PRELOAD_THRESHOLD  smallest allocation sent to the PMEM, with an optional k/m/g suffix (default 1m)
+ *   TMAX_PMEM_PRELOAD_CAPACITY   size of the heap region (default 64g)
+ *   TMAX_PMEM_PRELOAD_SITES      comma separated names of functions whose allocations always go to the PMEM; only
+ *                                dynamic symbols can be matched
+ *   TMAX_PMEM_PRELOAD_FORK_COPY  largest heap copied for a forked child, with an optional k/m/g suffix (default 0)
+ *
+ * A forked child makes its allocations in DRAM. It maps the heap privately copy-on-write, so its writes do not reach
+ * the parent, but unlike anonymous memory it sees a page the parent changes until it writes that page itself;
+ * children should not read blocks the parent is still changing. Copying the heap instead would cost every fork(), e.g.
+ * every system() or popen(), a copy of the heap in DRAM, which the interposer exists to avoid. Where children do read
+ * such blocks, TMAX_PMEM_PRELOAD_FORK_COPY lets fork() copy heaps up to that size into anonymous memory for the child.
+ * The copy is taken just before the fork, so blocks written by other threads meanwhile may be in either state.
+ * posix_spawn() does not run fork handlers and is not affected.
+ */
+
+#define _GNU_SOURCE
+#include <tmax_pmem_heap.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define PMEM_PRELOAD_ALIGN 16UL
+#define PMEM_PRELOAD_BOOTSTRAP_SIZE 65536UL
+#define PMEM_PRELOAD_MAX_SITES 32
+#define PMEM_PRELOAD_SITE_LEN 128
+#define PMEM_PRELOAD_SITE_CACHE 4096UL // return addresses remembered, a power of two
+#define PMEM_PRELOAD_SITE_PROBES 16
+
+enum
+{
+    PMEM_PRELOAD_UNINITIALIZED,
+    PMEM_PRELOAD_INITIALIZING,
+    PMEM_PRELOAD_READY
+};
+
+// Precedes every block handed out by the interposer
+struct pmem_preload_header
+{
+    size_t size;      // size requested by the caller
+    size_t alignment; // distance from the start of the heap block, at least PMEM_PRELOAD_ALIGN
+};
+
+static void *(*real_malloc)(size_t);
+static void (*real_free)(void *);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static size_t (*real_malloc_usable_size)(void *);
+
+// Serves dlsym() and anything else that allocates before the real allocator is known; never freed
+static char pmem_preload_bootstrap[PMEM_PRELOAD_BOOTSTRAP_SIZE] __attribute__((aligned(PMEM_PRELOAD_ALIGN)));
+static size_t pmem_preload_bootstrap_used;
+
+static int pmem_preload_state = PMEM_PRELOAD_UNINITIALIZED;
+// Set while the interposer itself allocates, so that those allocations go to the real allocator
+static __thread int pmem_preload_busy __attribute__((tls_model("initial-exec")));
+
+static char pmem_preload_dir[PATH_MAX];
+static size_t pmem_preload_threshold = 1UL << 20;
+static size_t pmem_preload_capacity = 64UL << 30;
+static char pmem_preload_sites[PMEM_PRELOAD_MAX_SITES][PMEM_PRELOAD_SITE_LEN];
+static int pmem_preload_nsites;
+static uintptr_t pmem_preload_site_cache[PMEM_PRELOAD_SITE_CACHE]; // return address << 1 | is a site, 0 if empty
+
+static struct pmem_heap *pmem_preload_heap;  // heap to allocate from, created at the first pmem allocation
+static struct pmem_heap *pmem_preload_owner; // heap whose blocks free() recognises, kept in forked children
+static int pmem_preload_disabled;            // no more pmem allocations: the heap failed or this is a forked child
+static pthread_mutex_t pmem_preload_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t pmem_preload_fork_copy;  // largest heap copied for a forked child, 0 to map it copy-on-write
+static void *pmem_preload_snapshot;    // copy of the heap taken for a fork() in progress
+static size_t pmem_preload_snapshot_len;
+
+static int pmem_preload_parse_size(const char *s, size_t *size)
+{
+    char *end;
+    unsigned long long v;
+
+    errno = 0;
+    v = strtoull(s, &end, 10);
+    if (errno || end == s)
+        return ERROR_ENVIRON;
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        v <<= 10;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        v <<= 20;
+        end++;
+        break;
+    case 'g':
+    case 'G':
+        v <<= 30;
+        end++;
+        break;
+    }
+    if (*end != '\0')
+        return ERROR_ENVIRON;
+    *size = v;
+
+    return SUCCESS;
+}
+
+static int pmem_preload_parse_sites(const char *s)
+{
+    while (*s != '\0')
+    {
+        size_t len = strcspn(s, ",");
+
+        if (len > 0)
+        {
+            if (pmem_preload_nsites == PMEM_PRELOAD_MAX_SITES || len >= PMEM_PRELOAD_SITE_LEN)
+                return ERROR_ENVIRON;
+            memcpy(pmem_preload_sites[pmem_preload_nsites], s, len);
+            pmem_preload_sites[pmem_preload_nsites][len] = '\0';
+            pmem_preload_nsites++;
+        }
+        s += len;
+        if (*s == ',')
+            s++;
+    }
+
+    return SUCCESS;
+}
+
+// With TMAX_PMEM_PRELOAD_FORK_COPY, copy small heaps for the child; larger ones are mapped copy-on-write
+static void pmem_preload_atfork_prepare(void)
+{
+    struct pmem_heap *heap = __atomic_load_n(&pmem_preload_heap, __ATOMIC_ACQUIRE);
+
+    pmem_preload_snapshot = NULL;
+    pmem_preload_snapshot_len = 0;
+    if (heap != NULL && pmem_preload_fork_copy > 0 &&
+        pmem_heap_snapshot(heap, pmem_preload_fork_copy, &pmem_preload_snapshot, &pmem_preload_snapshot_len) != SUCCESS)
+        pmem_preload_snapshot = NULL;
+}
+
+static void pmem_preload_atfork_parent(void)
+{
+    if (pmem_preload_snapshot != NULL)
+        (void)munmap(pmem_preload_snapshot, pmem_preload_snapshot_len);
+    pmem_preload_snapshot = NULL;
+}
+
+static void pmem_preload_atfork_child(void)
+{
+    struct pmem_heap *heap = __atomic_load_n(&pmem_preload_heap, __ATOMIC_RELAXED);
+
+    // The heap metadata was copied, but the region is still shared with the parent
+    if (heap != NULL && pmem_heap_detach(heap, pmem_preload_snapshot, pmem_preload_snapshot_len) != SUCCESS)
+        fprintf(stderr, "[%s] could not detach from the pmem heap of the parent\n", __func__);
+    pmem_preload_snapshot = NULL;
+    __atomic_store_n(&pmem_preload_heap, NULL, __ATOMIC_RELAXED);
+    pmem_preload_disabled = 1;
+    pthread_mutex_init(&pmem_preload_lock, NULL);
+}
+
+/**
+ * @brief Resolve the real allocator and read the environment. Threads arriving during initialization wait for it,
+ * except the initializing thread itself, whose allocations are served from the bootstrap buffer.
+ */
+static void pmem_preload_init(void)
+{
+    int state = PMEM_PRELOAD_UNINITIALIZED;
+    int invalid = 0;
+    const char *env;
+
+    if (pmem_preload_busy)
+        return;
+    if (!__atomic_compare_exchange_n(&pmem_preload_state, &state, PMEM_PRELOAD_INITIALIZING, 0, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_ACQUIRE))
+    {
+        while (__atomic_load_n(&pmem_preload_state, __ATOMIC_ACQUIRE) != PMEM_PRELOAD_READY)
+            sched_yield();
+        return;
+    }
+    pmem_preload_busy = 1;
+
+    real_malloc = (void *(*)(size_t))dlsym(RTLD_NEXT, "malloc");
+    real_free = (void (*)(void *))dlsym(RTLD_NEXT, "free");
+    real_calloc = (void *(*)(size_t, size_t))dlsym(RTLD_NEXT, "calloc");
+    real_realloc = (void *(*)(void *, size_t))dlsym(RTLD_NEXT, "realloc");
+    real_posix_memalign = (int (*)(void **, size_t, size_t))dlsym(RTLD_NEXT, "posix_memalign");
+    real_malloc_usable_size = (size_t(*)(void *))dlsym(RTLD_NEXT, "malloc_usable_size");
+
+    env = getenv("TMAX_PMEM_PRELOAD_DIR");
+    if (env != NULL && *env != '\0' && strlen(env) < sizeof(pmem_preload_dir))
+        (void)strcpy(pmem_preload_dir, env);
+    env = getenv("TMAX_PMEM_PRELOAD_THRESHOLD");
+    if (env != NULL && pmem_preload_parse_size(env, &pmem_preload_threshold) != SUCCESS)
+        invalid = 1;
+    env = getenv("TMAX_PMEM_PRELOAD_CAPACITY");
+    if (env != NULL && pmem_preload_parse_size(env, &pmem_preload_capacity) != SUCCESS)
+        invalid = 1;
+    env = getenv("TMAX_PMEM_PRELOAD_SITES");
+    if (env != NULL && pmem_preload_parse_sites(env) != SUCCESS)
+        invalid = 1;
+    env = getenv("TMAX_PMEM_PRELOAD_FORK_COPY");
+    if (env != NULL && pmem_preload_parse_size(env, &pmem_preload_fork_copy) != SUCCESS)
+        invalid = 1;
+    if (invalid && pmem_preload_dir[0] != '\0')
+        fprintf(stderr, "[%s] invalid TMAX_PMEM_PRELOAD_* setting, allocations stay in DRAM\n", __func__);
+
+    if (invalid || pmem_preload_dir[0] == '\0' || real_malloc == NULL || real_free == NULL || real_calloc == NULL ||
+        real_realloc == NULL || real_posix_memalign == NULL || real_malloc_usable_size == NULL)
+        pmem_preload_disabled = 1;
+    else
+        (void)pthread_atfork(pmem_preload_atfork_prepare, pmem_preload_atfork_parent, pmem_preload_atfork_child);
+
+    pmem_preload_busy = 0;
+    __atomic_store_n(&pmem_preload_state, PMEM_PRELOAD_READY, __ATOMIC_RELEASE);
+}
+
+static inline int pmem_preload_ready(void)
+{
+    if (__builtin_expect(__atomic_load_n(&pmem_preload_state, __ATOMIC_ACQUIRE) == PMEM_PRELOAD_READY, 1))
+        return 1;
+    pmem_preload_init();
+    return __atomic_load_n(&pmem_preload_state, __ATOMIC_ACQUIRE) == PMEM_PRELOAD_READY;
+}
+
+static void *pmem_preload_bootstrap_alloc(size_t size, size_t alignment)
+{
+    struct pmem_preload_header *hdr;
+    size_t start;
+
+    if (alignment < PMEM_PRELOAD_ALIGN)
+        alignment = PMEM_PRELOAD_ALIGN;
+    start = (pmem_preload_bootstrap_used + sizeof(struct pmem_preload_header) + alignment - 1) & ~(alignment - 1);
+    if (start > PMEM_PRELOAD_BOOTSTRAP_SIZE || size > PMEM_PRELOAD_BOOTSTRAP_SIZE - start)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    hdr = (struct pmem_preload_header *)(pmem_preload_bootstrap + start) - 1;
+    hdr->size = size;
+    hdr->alignment = alignment;
+    pmem_preload_bootstrap_used = start + size;
+
+    return pmem_preload_bootstrap + start;
+}
+
+static inline int pmem_preload_is_bootstrap(const void *ptr)
+{
+    return (uintptr_t)ptr - (uintptr_t)pmem_preload_bootstrap < PMEM_PRELOAD_BOOTSTRAP_SIZE;
+}
+
+static inline int pmem_preload_is_pmem(const void *ptr)
+{
+    struct pmem_heap *owner = __atomic_load_n(&pmem_preload_owner, __ATOMIC_ACQUIRE);
+
+    return owner != NULL && pmem_heap_contains(owner, ptr);
+}
+
+static inline struct pmem_preload_header *pmem_preload_header_of(void *ptr)
+{
+    return (struct pmem_preload_header *)ptr - 1;
+}
+
+/**
+ * @brief Check whether the function containing a return address is one of the configured call sites. Answers are
+ * cached per return address, so dladdr() runs once per call site.
+ */
+static int pmem_preload_is_site(const void *caller)
+{
+    uintptr_t key = (uintptr_t)caller;
+    size_t i = (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (PMEM_PRELOAD_SITE_CACHE - 1);
+    size_t free_slot = PMEM_PRELOAD_SITE_CACHE;
+    Dl_info info;
+    int site = 0;
+    int n;
+
+    for (n = 0; n < PMEM_PRELOAD_SITE_PROBES; n++, i = (i + 1) & (PMEM_PRELOAD_SITE_CACHE - 1))
+    {
+        uintptr_t entry = __atomic_load_n(&pmem_preload_site_cache[i], __ATOMIC_RELAXED);
+        if (entry == 0)
+        {
+            free_slot = i;
+            break;
+        }
+        if (entry >> 1 == key)
+            return (int)(entry & 1);
+    }
+
+    pmem_preload_busy = 1;
+    if (dladdr(caller, &info) && info.dli_sname != NULL)
+    {
+        for (n = 0; n < pmem_preload_nsites && !site; n++)
+            site = strcmp(info.dli_sname, pmem_preload_sites[n]) == 0;
+    }
+    pmem_preload_busy = 0;
+
+    if (free_slot != PMEM_PRELOAD_SITE_CACHE)
+    {
+        uintptr_t empty = 0;
+        (void)__atomic_compare_exchange_n(&pmem_preload_site_cache[free_slot], &empty, key << 1 | (uintptr_t)site, 0,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+
+    return site;
+}
+
+static inline int pmem_preload_route(size_t size, const void *caller)
+{
+    if (pmem_preload_busy || pmem_preload_disabled)
+        return 0;
+    if (size >= pmem_preload_threshold)
+        return 1;
+    return pmem_preload_nsites > 0 && pmem_preload_is_site(caller);
+}
+
+static struct pmem_heap *pmem_preload_get_heap(void)
+{
+    struct pmem_heap *heap = __atomic_load_n(&pmem_preload_heap, __ATOMIC_ACQUIRE);
+
+    if (heap != NULL)
+        return heap;
+
+    pthread_mutex_lock(&pmem_preload_lock);
+    if (!pmem_preload_disabled && pmem_preload_heap == NULL)
+    {
+        pmem_preload_busy = 1;
+        if (pmem_heap_create(pmem_preload_dir, pmem_preload_capacity, &heap) == SUCCESS)
+        {
+            // The file lives as long as the mapping, even if the process is killed
+            (void)unlink(pmem_heap_path(heap));
+            __atomic_store_n(&pmem_preload_owner, heap, __ATOMIC_RELEASE);
+            __atomic_store_n(&pmem_preload_heap, heap, __ATOMIC_RELEASE);
+        }
+        else
+        {
+            fprintf(stderr, "[%s] could not create a pmem heap in %s, allocations stay in DRAM\n", __func__,
+                    pmem_preload_dir);
+            pmem_preload_disabled = 1;
+        }
+        pmem_preload_busy = 0;
+    }
+    heap = pmem_preload_heap;
+    pthread_mutex_unlock(&pmem_preload_lock);
+
+    return heap;
+}
+
+/**
+ * @brief Allocate from the pmem heap, or return NULL so that the caller falls back to the real allocator.
+ */
+static void *pmem_preload_alloc(size_t size, size_t alignment)
+{
+    struct pmem_heap *heap = pmem_preload_get_heap();
+    struct pmem_preload_header *hdr;
+    char *block;
+
+    if (heap == NULL)
+        return NULL;
+    // The header lives in the padding in front of the aligned block
+    if (alignment < PMEM_PRELOAD_ALIGN)
+        alignment = PMEM_PRELOAD_ALIGN;
+    if (size > SIZE_MAX - alignment)
+        return NULL;
+
+    pmem_preload_busy = 1;
+    block = (char *)pmem_heap_alloc(heap, size + alignment, alignment);
+    pmem_preload_busy = 0;
+    if (block == NULL)
+        return NULL;
+
+    hdr = pmem_preload_header_of(block + alignment);
+    hdr->size = size;
+    hdr->alignment = alignment;
+
+    return block + alignment;
+}
+
+static void pmem_preload_release(void *ptr)
+{
+    struct pmem_heap *heap = __atomic_load_n(&pmem_preload_heap, __ATOMIC_ACQUIRE);
+    struct pmem_preload_header *hdr = pmem_preload_header_of(ptr);
+    int busy = pmem_preload_busy;
+
+    // In a forked child the block is a private copy of a block of the parent
+    if (heap == NULL)
+        return;
+    pmem_preload_busy = 1;
+    pmem_heap_free(heap, (char *)ptr - hdr->alignment, hdr->size + hdr->alignment, hdr->alignment);
+    pmem_preload_busy = busy;
+}
+
+static void *pmem_preload_malloc(size_t size, const void *caller)
+{
+    void *ptr;
+
+    if (!pmem_preload_ready() || real_malloc == NULL)
+        return pmem_preload_bootstrap_alloc(size, PMEM_PRELOAD_ALIGN);
+    if (pmem_preload_route(size, caller) && (ptr = pmem_preload_alloc(size, PMEM_PRELOAD_ALIGN)) != NULL)
+        return ptr;
+
+    return real_malloc(size);
+}
+
+static int pmem_preload_memalign(void **memptr, size_t alignment, size_t size, const void *caller)
+{
+    void *ptr;
+
+    if (alignment == 0 || (alignment & (alignment - 1)) || alignment % sizeof(void *))
+        return EINVAL;
+    if (!pmem_preload_ready() || real_posix_memalign == NULL)
+    {
+        *memptr = pmem_preload_bootstrap_alloc(size, alignment);
+        return *memptr ? 0 : ENOMEM;
+    }
+    if (pmem_preload_route(size, caller) && (ptr = pmem_preload_alloc(size, alignment)) != NULL)
+    {
+        *memptr = ptr;
+        return 0;
+    }
+
+    return real_posix_memalign(memptr, alignment, size);
+}
+
+static void *pmem_preload_realloc(void *ptr, size_t size, const void *caller)
+{
+    size_t old_size;
+    void *new_ptr;
+
+    if (ptr == NULL)
+        return pmem_preload_malloc(size, caller);
+    if (size == 0)
+    {
+        free(ptr);
+        return NULL;
+    }
+    if (pmem_preload_is_bootstrap(ptr))
+    {
+        old_size = pmem_preload_header_of(ptr)->size;
+        if (size <= old_size)
+            return ptr;
+        new_ptr = pmem_preload_malloc(size, caller);
+        if (new_ptr != NULL)
+            memcpy(new_ptr, ptr, old_size);
+        return new_ptr;
+    }
+    if (!pmem_preload_ready() || real_realloc == NULL)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (pmem_preload_is_pmem(ptr))
+    {
+        // Shrink in place, move on growth since the heap has no in-place extension of blocks
+        old_size = pmem_preload_header_of(ptr)->size;
+        if (size <= old_size)
+            return ptr;
+        new_ptr = NULL;
+        if (pmem_preload_route(size, caller))
+            new_ptr = pmem_preload_alloc(size, PMEM_PRELOAD_ALIGN);
+        if (new_ptr == NULL)
+            new_ptr = real_malloc(size);
+        if (new_ptr == NULL)
+            return NULL;
+        memcpy(new_ptr, ptr, old_size);
+        pmem_preload_release(ptr);
+        return new_ptr;
+    }
+
+    // A DRAM block growing past the threshold moves to the PMEM
+    if (pmem_preload_route(size, caller) && (new_ptr = pmem_preload_alloc(size, PMEM_PRELOAD_ALIGN)) != NULL)
+    {
+        old_size = real_malloc_usable_size(ptr);
+        memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+        real_free(ptr);
+        return new_ptr;
+    }
+
+    return real_realloc(ptr, size);
+}
+
+void *malloc(size_t size)
+{
+    return pmem_preload_malloc(size, __builtin_return_address(0));
+}
+
+void free(void *ptr)
+{
+    if (ptr == NULL || pmem_preload_is_bootstrap(ptr))
+        return;
+    if (pmem_preload_is_pmem(ptr))
+    {
+        pmem_preload_release(ptr);
+        return;
+    }
+    if (real_free == NULL)
+        pmem_preload_init();
+    if (real_free != NULL)
+        real_free(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    size_t total;
+    void *ptr;
+
+    if (__builtin_mul_overflow(nmemb, size, &total))
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    // The bootstrap buffer is never reused, so it is still zero
+    if (!pmem_preload_ready() || real_calloc == NULL)
+        return pmem_preload_bootstrap_alloc(total, PMEM_PRELOAD_ALIGN);
+    if (pmem_preload_route(total, __builtin_return_address(0)) &&
+        (ptr = pmem_preload_alloc(total, PMEM_PRELOAD_ALIGN)) != NULL)
+    {
+        memset(ptr, 0, total);
+        return ptr;
+    }
+
+    return real_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    return pmem_preload_realloc(ptr, size, __builtin_return_address(0));
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+    size_t total;
+
+    if (__builtin_mul_overflow(nmemb, size, &total))
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return pmem_preload_realloc(ptr, total, __builtin_return_address(0));
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    return pmem_preload_memalign(memptr, alignment, size, __builtin_return_address(0));
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    void *ptr;
+    int err;
+
+    if (alignment < sizeof(void *))
+        alignment = sizeof(void *);
+    err = pmem_preload_memalign(&ptr, alignment, size, __builtin_return_address(0));
+    if (err)
+    {
+        errno = err;
+        return NULL;
+    }
+
+    return ptr;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    void *ptr;
+    int err;
+
+    if (alignment < sizeof(void *))
+        alignment = sizeof(void *);
+    err = pmem_preload_memalign(&ptr, alignment, size, __builtin_return_address(0));
+    if (err)
+    {
+        errno = err;
+        return NULL;
+    }
+
+    return ptr;
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+    if (ptr == NULL)
+        return 0;
+    if (pmem_preload_is_bootstrap(ptr) || pmem_preload_is_pmem(ptr))
+        return pmem_preload_header_of(ptr)->size;
+    if (!pmem_preload_ready() || real_malloc_usable_size == NULL)
+        return 0;
+
+    return real_malloc_usable_size(ptr);
+}
@@ -0,0 +1,352 @@
+/**
+ * @brief Sampling heap profiler of pmem allocations. Every thread samples one allocation about every rate bytes: the
+ * distance to the next sample is drawn from an exponential distribution, so that allocations of all sizes are sampled
+ * in proportion to their bytes, as in tcmalloc. A sample records the call stack; live and cumulative counts are kept per
+ * stack and written as a gperftools heap profile, which pprof reads:
+ *
+ *     pprof --inuse_space ./example1 tmax_pmem.1234.0001.heap
+ *
+ * The profiler is started with pmem_prof_start() or by the environment:
+ *
+ *     TMAX_PMEM_PROFILE         mean sampling interval in bytes, with k, m or g suffix; enables dumping at exit
+ *     TMAX_PMEM_PROFILE_SIGNAL  signal number that dumps a profile
+ *     TMAX_PMEM_PROFILE_PREFIX  profiles are written to <prefix>.<pid>.<seq>.heap (default tmax_pmem)
+ *
+ * Sampled regions are attributed their size at allocation, resizing does not change it.
+ */
+
+#define _GNU_SOURCE
+#include <tmax_pmem_prof.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PMEM_PROF_DEPTH 32
+#define PMEM_PROF_TABLE 1024
+
+struct pmem_prof_bucket
+{
+    struct pmem_prof_bucket *next;
+    uint64_t hash;
+    int depth;
+    void *stack[PMEM_PROF_DEPTH];
+    uint64_t alloc_count;
+    uint64_t alloc_bytes;
+    uint64_t live_count;
+    uint64_t live_bytes;
+};
+
+struct pmem_prof_sample
+{
+    struct pmem_prof_bucket *bucket;
+    size_t size;
+};
+
+static size_t pmem_prof_rate;         // 0 while not sampling
+static size_t pmem_prof_profile_rate; // rate written to profiles, kept after pmem_prof_stop()
+static pthread_mutex_t pmem_prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pmem_prof_bucket *pmem_prof_table[PMEM_PROF_TABLE];
+static pthread_once_t pmem_prof_env_once = PTHREAD_ONCE_INIT;
+static const char *pmem_prof_prefix = "tmax_pmem";
+static unsigned int pmem_prof_seq;
+static sem_t pmem_prof_sem;
+
+// Bytes the thread still allocates before its next sample, 0 if not drawn yet
+static __thread int64_t pmem_prof_until __attribute__((tls_model("initial-exec")));
+static __thread uint64_t pmem_prof_random __attribute__((tls_model("initial-exec")));
+
+static int pmem_prof_parse_size(const char *s, size_t *size)
+{
+    char *end;
+    unsigned long long v;
+
+    errno = 0;
+    v = strtoull(s, &end, 10);
+    if (errno || end == s)
+        return ERROR_ENVIRON;
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        v <<= 10;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        v <<= 20;
+        end++;
+        break;
+    case 'g':
+    case 'G':
+        v <<= 30;
+        end++;
+        break;
+    }
+    if (*end != '\0' || v == 0)
+        return ERROR_ENVIRON;
+    *size = v;
+    return SUCCESS;
+}
+
+/**
+ * @brief Distance to the next sample, exponentially distributed with mean rate.
+ */
+static int64_t pmem_prof_next(size_t rate)
+{
+    uint64_t x = pmem_prof_random;
+    double u;
+
+    if (x == 0)
+        x = (uint64_t)(uintptr_t)&pmem_prof_random ^ (uint64_t)time(NULL) ^ 0x9e3779b97f4a7c15ULL;
+    // xorshift64*
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    pmem_prof_random = x;
+    u = (double)((x * 0x2545f4914f6cdd1dULL) >> 11) / 9007199254740992.0; // [0, 1)
+    return (int64_t)(-log(1.0 - u) * (double)rate) + 1;
+}
+
+static void pmem_prof_signal(int sig)
+{
+    (void)sig;
+    (void)sem_post(&pmem_prof_sem);
+}
+
+static void pmem_prof_dump_next(void)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s.%d.%04u.heap", pmem_prof_prefix, (int)getpid(),
+             __atomic_add_fetch(&pmem_prof_seq, 1, __ATOMIC_RELAXED));
+    if (pmem_prof_dump(path) != SUCCESS)
+        printf("[%s] could not write %s\n", __func__, path);
+}
+
+// Dumps outside of the signal handler, which may have interrupted an allocation holding the lock
+static void *pmem_prof_dumper(void *arg)
+{
+    (void)arg;
+    for (;;)
+    {
+        while (sem_wait(&pmem_prof_sem) != 0 && errno == EINTR)
+            ;
+        pmem_prof_dump_next();
+    }
+    return NULL;
+}
+
+static void pmem_prof_env(void)
+{
+    const char *env = getenv("TMAX_PMEM_PROFILE");
+    struct sigaction sa;
+    pthread_t thread;
+    size_t rate;
+    int sig;
+
+    if (env == NULL)
+        return;
+    if (pmem_prof_parse_size(env, &rate) != SUCCESS)
+    {
+        printf("[%s] ignoring TMAX_PMEM_PROFILE=%s: expected a size\n", __func__, env);
+        return;
+    }
+    if (getenv("TMAX_PMEM_PROFILE_PREFIX") != NULL)
+        pmem_prof_prefix = getenv("TMAX_PMEM_PROFILE_PREFIX");
+    (void)pmem_prof_start(rate);
+    (void)atexit(pmem_prof_dump_next);
+
+    env = getenv("TMAX_PMEM_PROFILE_SIGNAL");
+    if (env == NULL)
+        return;
+    sig = atoi(env);
+    if (sig <= 0 || sig >= NSIG || sem_init(&pmem_prof_sem, 0, 0) ||
+        pthread_create(&thread, NULL, pmem_prof_dumper, NULL))
+    {
+        printf("[%s] not dumping on TMAX_PMEM_PROFILE_SIGNAL=%s\n", __func__, env);
+        return;
+    }
+    (void)pthread_detach(thread);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = pmem_prof_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    (void)sigaction(sig, &sa, NULL);
+}
+
+/**
+ * @brief Start sampling, or change the rate.
+ *
+ * @param rate Mean number of bytes allocated per thread between two samples.
+ * @return int ERROR_INVALID if rate is 0.
+ */
+int pmem_prof_start(size_t rate)
+{
+    void *stack[2];
+
+    if (rate == 0)
+        return ERROR_INVALID;
+    // The first backtrace() loads the unwinder, which must not happen first inside an allocation
+    (void)backtrace(stack, 2);
+    __atomic_store_n(&pmem_prof_profile_rate, rate, __ATOMIC_RELAXED);
+    __atomic_store_n(&pmem_prof_rate, rate, __ATOMIC_RELAXED);
+    return SUCCESS;
+}
+
+/**
+ * @brief Stop sampling. The samples taken so far stay and their frees are still counted.
+ *
+ * @return int
+ */
+int pmem_prof_stop(void)
+{
+    __atomic_store_n(&pmem_prof_rate, 0, __ATOMIC_RELAXED);
+    return SUCCESS;
+}
+
+/**
+ * @brief Sample a new region, on average once every rate bytes per thread.
+ */
+void pmem_prof_alloc(struct pmem_file *pfile, size_t size)
+{
+    struct pmem_prof_bucket *b;
+    struct pmem_prof_sample *sample;
+    void *stack[PMEM_PROF_DEPTH + 1];
+    uint64_t hash = 0;
+    size_t rate;
+    int depth, i;
+
+    pfile->sample = NULL;
+    (void)pthread_once(&pmem_prof_env_once, pmem_prof_env);
+    rate = __atomic_load_n(&pmem_prof_rate, __ATOMIC_RELAXED);
+    if (rate == 0)
+        return;
+    if (pmem_prof_until == 0)
+        pmem_prof_until = pmem_prof_next(rate);
+    pmem_prof_until -= (int64_t)size;
+    if (pmem_prof_until > 0)
+        return;
+    pmem_prof_until = pmem_prof_next(rate);
+
+    // Leave out this function
+    depth = backtrace(stack, PMEM_PROF_DEPTH + 1) - 1;
+    if (depth <= 0)
+        return;
+    for (i = 0; i < depth; i++)
+        hash = (hash ^ (uint64_t)(uintptr_t)stack[i + 1]) * 0x100000001b3ULL;
+
+    sample = (struct pmem_prof_sample *)malloc(sizeof(*sample));
+    if (sample == NULL)
+        return;
+    pthread_mutex_lock(&pmem_prof_lock);
+    for (b = pmem_prof_table[hash % PMEM_PROF_TABLE]; b != NULL; b = b->next)
+        if (b->hash == hash && b->depth == depth && memcmp(b->stack, stack + 1, depth * sizeof(void *)) == 0)
+            break;
+    if (b == NULL)
+    {
+        b = (struct pmem_prof_bucket *)calloc(1, sizeof(*b));
+        if (b == NULL)
+        {
+            pthread_mutex_unlock(&pmem_prof_lock);
+            free(sample);
+            return;
+        }
+        b->hash = hash;
+        b->depth = depth;
+        memcpy(b->stack, stack + 1, depth * sizeof(void *));
+        b->next = pmem_prof_table[hash % PMEM_PROF_TABLE];
+        pmem_prof_table[hash % PMEM_PROF_TABLE] = b;
+    }
+    b->alloc_count++;
+    b->alloc_bytes += size;
+    b->live_count++;
+    b->live_bytes += size;
+    pthread_mutex_unlock(&pmem_prof_lock);
+
+    sample->bucket = b;
+    sample->size = size;
+    pfile->sample = sample;
+}
+
+/**
+ * @brief Take a region that goes away out of the live counts, if it was sampled.
+ */
+void pmem_prof_free(struct pmem_file *pfile)
+{
+    struct pmem_prof_sample *sample = pfile->sample;
+
+    if (sample == NULL)
+        return;
+    pthread_mutex_lock(&pmem_prof_lock);
+    sample->bucket->live_count--;
+    sample->bucket->live_bytes -= sample->size;
+    pthread_mutex_unlock(&pmem_prof_lock);
+    free(sample);
+    pfile->sample = NULL;
+}
+
+/**
+ * @brief Write the samples as a gperftools heap profile (heap_v2), followed by the mappings of the process, which pprof
+ * needs to symbolise the stacks. pprof scales the sampled counts by the last rate set, so changing the rate while
+ * profiling skews the estimates.
+ *
+ * @param path File to write.
+ * @return int ERROR_INVALID if the file cannot be written.
+ */
+int pmem_prof_dump(const char *path)
+{
+    struct pmem_prof_bucket *b;
+    uint64_t live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+    size_t rate = __atomic_load_n(&pmem_prof_profile_rate, __ATOMIC_RELAXED);
+    char line[4096];
+    FILE *out, *maps;
+    int i, j;
+
+    out = fopen(path, "w");
+    if (out == NULL)
+        return ERROR_INVALID;
+
+    pthread_mutex_lock(&pmem_prof_lock);
+    for (i = 0; i < PMEM_PROF_TABLE; i++)
+        for (b = pmem_prof_table[i]; b != NULL; b = b->next)
+        {
+            live_count += b->live_count;
+            live_bytes += b->live_bytes;
+            alloc_count += b->alloc_count;
+            alloc_bytes += b->alloc_bytes;
+        }
+    fprintf(out, "heap profile: %6lu: %8lu [%6lu: %8lu] @ heap_v2/%lu\n", (unsigned long)live_count,
+            (unsigned long)live_bytes, (unsigned long)alloc_count, (unsigned long)alloc_bytes,
+            (unsigned long)(rate ? rate : 1));
+    for (i = 0; i < PMEM_PROF_TABLE; i++)
+        for (b = pmem_prof_table[i]; b != NULL; b = b->next)
+        {
+            fprintf(out, "%6lu: %8lu [%6lu: %8lu] @", (unsigned long)b->live_count, (unsigned long)b->live_bytes,
+                    (unsigned long)b->alloc_count, (unsigned long)b->alloc_bytes);
+            for (j = 0; j < b->depth; j++)
+                fprintf(out, " %p", b->stack[j]);
+            fputc('\n', out);
+        }
+    pthread_mutex_unlock(&pmem_prof_lock);
+
+    fputs("\nMAPPED_LIBRARIES:\n", out);
+    maps = fopen("/proc/self/maps", "r");
+    if (maps != NULL)
+    {
+        while (fgets(line, sizeof(line), maps) != NULL)
+            fputs(line, out);
+        fclose(maps);
+    }
+
+    return fclose(out) == 0 ? SUCCESS : ERROR_INVALID;
+}
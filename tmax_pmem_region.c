@@ -0,0 +1,163 @@
+/**
+ * @brief Fault and residency accounting of single regions: how much of a region is really backed, whether it is
+ * mapped with 2 MiB (PMD) entries, as DAX file systems do for aligned regions, and how many faults populating it took.
+ */
+
+#define _GNU_SOURCE
+#include <tmax_pmem_region.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+// Pages examined per mincore() and pagemap read
+#define PMEM_REGION_CHUNK 4096
+
+#define PMEM_PAGEMAP_PRESENT (1ULL << 63)
+
+/**
+ * @brief Populate a whole region like pmem_prefault() and count the page faults it took in the region descriptor.
+ * The counts come from the per-thread fault counters of the kernel, which unlike the perf software events also include
+ * faults taken by madvise(MADV_POPULATE_WRITE) on behalf of the thread.
+ *
+ * @param addr Start of the region.
+ * @param pfile_ptr Pointer to the pmem_file struct.
+ * @return int
+ */
+int pmem_prefault_region(void *addr, struct pmem_file **pfile_ptr)
+{
+    struct rusage before, after;
+    int err;
+
+    if (getrusage(RUSAGE_THREAD, &before))
+        return pmem_prefault(addr, (*pfile_ptr)->current_size);
+    err = pmem_prefault(addr, (*pfile_ptr)->current_size);
+    if (getrusage(RUSAGE_THREAD, &after) == 0)
+    {
+        (*pfile_ptr)->minor_faults += after.ru_minflt - before.ru_minflt;
+        (*pfile_ptr)->major_faults += after.ru_majflt - before.ru_majflt;
+    }
+    return err;
+}
+
+static int pmem_region_mincore(char *start, size_t len, size_t pagesize, size_t *resident)
+{
+    unsigned char vec[PMEM_REGION_CHUNK];
+    size_t pages = len / pagesize, n, i;
+
+    for (; pages > 0; pages -= n, start += n * pagesize)
+    {
+        n = pages < PMEM_REGION_CHUNK ? pages : PMEM_REGION_CHUNK;
+        if (mincore(start, n * pagesize, vec))
+            return ERROR_RUNTIME;
+        for (i = 0; i < n; i++)
+            *resident += (vec[i] & 1) * pagesize;
+    }
+    return SUCCESS;
+}
+
+static int pmem_region_pagemap(char *start, size_t len, size_t pagesize, size_t *present)
+{
+    uint64_t entries[PMEM_REGION_CHUNK];
+    size_t pages = len / pagesize, n, i;
+    ssize_t got;
+    int fd;
+
+    fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return ERROR_UNAVAILABLE;
+    for (; pages > 0; pages -= n, start += n * pagesize)
+    {
+        n = pages < PMEM_REGION_CHUNK ? pages : PMEM_REGION_CHUNK;
+        got = pread(fd, entries, n * sizeof(uint64_t), (off_t)((uintptr_t)start / pagesize * sizeof(uint64_t)));
+        if (got != (ssize_t)(n * sizeof(uint64_t)))
+        {
+            (void)close(fd);
+            return ERROR_RUNTIME;
+        }
+        for (i = 0; i < n; i++)
+            if (entries[i] & PMEM_PAGEMAP_PRESENT)
+                *present += pagesize;
+    }
+    (void)close(fd);
+    return SUCCESS;
+}
+
+/**
+ * @brief Sum the dirty and PMD mapped bytes of the mappings overlapping [start, end) from /proc/self/smaps. smaps only
+ * has totals per mapping, so mappings that partly overlap are counted whole; vma_size gets the size of all of them.
+ * File regions are mappings of their own, but the kernel merges anonymous regions with compatible neighbours.
+ */
+static int pmem_region_smaps(uintptr_t start, uintptr_t end, size_t *dirty, size_t *pmd_mapped, size_t *vma_size)
+{
+    unsigned long lo, hi, kb;
+    char line[512];
+    int inside = 0;
+    FILE *fp;
+
+    fp = fopen("/proc/self/smaps", "r");
+    if (fp == NULL)
+        return ERROR_UNAVAILABLE;
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        // Mapping headers start with the address range, field lines with a name and a colon
+        if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2)
+        {
+            inside = lo < end && hi > start;
+            if (inside)
+                *vma_size += hi - lo;
+            continue;
+        }
+        if (!inside)
+            continue;
+        if (sscanf(line, "Shared_Dirty: %lu kB", &kb) == 1 || sscanf(line, "Private_Dirty: %lu kB", &kb) == 1)
+            *dirty += kb << 10;
+        else if (sscanf(line, "FilePmdMapped: %lu kB", &kb) == 1 || sscanf(line, "ShmemPmdMapped: %lu kB", &kb) == 1 ||
+                 sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+            *pmd_mapped += kb << 10;
+    }
+    fclose(fp);
+    return SUCCESS;
+}
+
+/**
+ * @brief Describe how much of a region is backed and how. This walks the page tables of the region and the mappings
+ * of the process, so it is meant for diagnostics, not for hot paths.
+ *
+ * resident and present are exact for the region. dirty and pmd_mapped are totals of the mappings the region lies in,
+ * which cover more than the region when vma_size is larger than the mapped length, e.g. for an anonymous region merged
+ * with its neighbours; pmd_mapped is capped at present.
+ *
+ * @param addr Start of the region.
+ * @param pfile Descriptor of the region.
+ * @param info Filled with the residency and fault counts of the region.
+ * @return int ERROR_UNAVAILABLE if /proc is not mounted.
+ */
+int pmem_region_info(void *addr, const struct pmem_file *pfile, struct pmem_region_info *info)
+{
+    size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t len = (pfile->current_size + pagesize - 1) & ~(pagesize - 1);
+    int err;
+
+    memset(info, 0, sizeof(*info));
+    info->size = pfile->current_size;
+    info->minor_faults = pfile->minor_faults;
+    info->major_faults = pfile->major_faults;
+    if (len == 0)
+        return SUCCESS;
+
+    err = pmem_region_mincore((char *)addr, len, pagesize, &info->resident);
+    if (err == SUCCESS)
+        err = pmem_region_pagemap((char *)addr, len, pagesize, &info->present);
+    if (err == SUCCESS)
+        err = pmem_region_smaps((uintptr_t)addr, (uintptr_t)addr + len, &info->dirty, &info->pmd_mapped,
+                                &info->vma_size);
+    if (info->pmd_mapped > info->present)
+        info->pmd_mapped = info->present;
+    info->pte_mapped = info->present - info->pmd_mapped;
+
+    return err;
+}
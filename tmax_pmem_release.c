@@ -0,0 +1,229 @@
+/**
+ * @brief Deferred release of freed regions. Closing and unlinking the file of a region frees its extents, which can
+ * take milliseconds for a large file on a DAX file system. With deferral enabled pmem_free() only unmaps the region and
+ * queues the file to a reaper thread, so the caller does not wait for the file system. The queue is bounded: when it is
+ * full pmem_free() releases the file itself, as without deferral.
+ *
+ * Deferral is enabled with pmem_release_async() or by the environment:
+ *
+ *     TMAX_PMEM_ASYNC_FREE   capacity of the queue in files
+ *
+ * Files still queued at exit are released before the process exits; pmem_release_flush() does the same at any time.
+ */
+
+#define _GNU_SOURCE
+#include <tmax_pmem_release.h>
+#include <tmax_pmem_stats.h>
+#include <tmax_pmem_probes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct pmem_release_item
+{
+    int fd;
+    char *fullpath; // NULL for anonymous regions
+};
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // items queued
+    pthread_cond_t idle; // queue drained
+    struct pmem_release_item *ring;
+    size_t capacity; // 0 while deferral is disabled
+    size_t head;
+    size_t count;
+    int running;
+    int busy;
+} pmem_release = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static pthread_once_t pmem_release_once = PTHREAD_ONCE_INIT;
+
+static void pmem_release_file(struct pmem_release_item *item)
+{
+    uint64_t start = pmem_stats_clock();
+    uint64_t ns;
+
+    if (item->fullpath != NULL && unlink(item->fullpath) != 0)
+    {
+        printf("[%s] unlink failed\n", __func__);
+        PMEM_PROBE3(unlink, item->fullpath, pmem_stats_clock() - start, ERROR_RUNTIME);
+        (void)pmem_stats_failure(ERROR_RUNTIME);
+    }
+    else if (item->fullpath != NULL)
+    {
+        ns = pmem_stats_syscall(PMEM_STATS_UNLINK, start);
+        PMEM_PROBE3(unlink, item->fullpath, ns, SUCCESS);
+    }
+    // The extents are freed by the last close of the unlinked file
+    (void)close(item->fd);
+    free(item->fullpath);
+}
+
+static void *pmem_release_reaper(void *arg)
+{
+    struct pmem_release_item item;
+
+    (void)arg;
+    pthread_mutex_lock(&pmem_release.lock);
+    for (;;)
+    {
+        while (pmem_release.count == 0)
+        {
+            pmem_release.busy = 0;
+            pthread_cond_broadcast(&pmem_release.idle);
+            pthread_cond_wait(&pmem_release.cond, &pmem_release.lock);
+        }
+        item = pmem_release.ring[pmem_release.head];
+        pmem_release.head = (pmem_release.head + 1) % pmem_release.capacity;
+        pmem_release.count--;
+        pmem_release.busy = 1;
+        pthread_mutex_unlock(&pmem_release.lock);
+
+        pmem_release_file(&item);
+
+        pthread_mutex_lock(&pmem_release.lock);
+    }
+    return NULL;
+}
+
+static void pmem_release_atexit(void)
+{
+    (void)pmem_release_flush();
+}
+
+// The reaper does not survive fork(); the queued files are released by the parent, the child closes its copies
+static void pmem_release_atfork_child(void)
+{
+    size_t i;
+
+    pthread_mutex_init(&pmem_release.lock, NULL);
+    pthread_cond_init(&pmem_release.cond, NULL);
+    pthread_cond_init(&pmem_release.idle, NULL);
+    for (i = 0; i < pmem_release.count; i++)
+    {
+        (void)close(pmem_release.ring[(pmem_release.head + i) % pmem_release.capacity].fd);
+        free(pmem_release.ring[(pmem_release.head + i) % pmem_release.capacity].fullpath);
+    }
+    free(pmem_release.ring);
+    pmem_release.ring = NULL;
+    pmem_release.capacity = 0;
+    pmem_release.head = 0;
+    pmem_release.count = 0;
+    pmem_release.running = 0;
+    pmem_release.busy = 0;
+}
+
+// Swap the queue for one of the given capacity once the reaper has drained it
+static int pmem_release_configure(size_t queue)
+{
+    struct pmem_release_item *ring = NULL;
+    pthread_t thread;
+
+    if (queue > 0)
+    {
+        ring = (struct pmem_release_item *)malloc(queue * sizeof(struct pmem_release_item));
+        if (ring == NULL)
+            return ERROR_MALLOC;
+    }
+
+    pthread_mutex_lock(&pmem_release.lock);
+    if (queue > 0 && !pmem_release.running)
+    {
+        if (pthread_create(&thread, NULL, pmem_release_reaper, NULL))
+        {
+            pthread_mutex_unlock(&pmem_release.lock);
+            printf("[%s] could not start the reaper thread\n", __func__);
+            free(ring);
+            return ERROR_RUNTIME;
+        }
+        (void)pthread_detach(thread);
+        pmem_release.running = 1;
+    }
+    while (pmem_release.count > 0 || pmem_release.busy)
+        pthread_cond_wait(&pmem_release.idle, &pmem_release.lock);
+    free(pmem_release.ring);
+    pmem_release.ring = ring;
+    pmem_release.head = 0;
+    __atomic_store_n(&pmem_release.capacity, queue, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pmem_release.lock);
+
+    return SUCCESS;
+}
+
+static void pmem_release_init(void)
+{
+    const char *env = getenv("TMAX_PMEM_ASYNC_FREE");
+    long queue;
+
+    (void)atexit(pmem_release_atexit);
+    (void)pthread_atfork(NULL, NULL, pmem_release_atfork_child);
+    if (env == NULL)
+        return;
+    queue = atol(env);
+    if (queue <= 0 || pmem_release_configure((size_t)queue) != SUCCESS)
+        printf("[%s] not deferring releases on TMAX_PMEM_ASYNC_FREE=%s\n", __func__, env);
+}
+
+/**
+ * @brief Enable or disable deferred release of freed regions, see above. Files already queued are released first.
+ *
+ * @param queue Capacity of the queue in files, 0 to release files in pmem_free() again.
+ * @return int ERROR_MALLOC or ERROR_RUNTIME if the queue or the reaper thread cannot be created.
+ */
+int pmem_release_async(size_t queue)
+{
+    (void)pthread_once(&pmem_release_once, pmem_release_init);
+    return pmem_release_configure(queue);
+}
+
+/**
+ * @brief Wait until every file queued by pmem_free() is closed and unlinked, e.g. at shutdown or before measuring the
+ * free space of the PMEM.
+ *
+ * @return int
+ */
+int pmem_release_flush(void)
+{
+    pthread_mutex_lock(&pmem_release.lock);
+    while (pmem_release.count > 0 || pmem_release.busy)
+        pthread_cond_wait(&pmem_release.idle, &pmem_release.lock);
+    pthread_mutex_unlock(&pmem_release.lock);
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Queue the file of a freed region to the reaper thread.
+ *
+ * @param fd Descriptor of the file, closed by the reaper.
+ * @param fullpath Path of the file, unlinked and freed by the reaper, or NULL.
+ * @return int ERROR_UNAVAILABLE if deferral is disabled, ERROR_NOSPACE if the queue is full; the caller keeps the file.
+ */
+int pmem_release_defer(int fd, char *fullpath)
+{
+    int err;
+
+    (void)pthread_once(&pmem_release_once, pmem_release_init);
+    if (__atomic_load_n(&pmem_release.capacity, __ATOMIC_RELAXED) == 0)
+        return ERROR_UNAVAILABLE;
+
+    pthread_mutex_lock(&pmem_release.lock);
+    if (pmem_release.capacity == 0 || pmem_release.count == pmem_release.capacity)
+    {
+        err = pmem_release.capacity == 0 ? ERROR_UNAVAILABLE : ERROR_NOSPACE;
+        pthread_mutex_unlock(&pmem_release.lock);
+        return err;
+    }
+    pmem_release.ring[(pmem_release.head + pmem_release.count) % pmem_release.capacity].fd = fd;
+    pmem_release.ring[(pmem_release.head + pmem_release.count) % pmem_release.capacity].fullpath = fullpath;
+    pmem_release.count++;
+    pmem_release.busy = 1;
+    pthread_cond_signal(&pmem_release.cond);
+    pthread_mutex_unlock(&pmem_release.lock);
+
+    return SUCCESS;
+}
@@ -0,0 +1,366 @@
+/**
+ * @brief Parallel sort for large record arrays in pmem_malloc regions, which keeps writes to the PMEM low.
+ *
+ * Generic in-place sorts rewrite every record O(log n) times, and PMEM writes are several times slower than reads.
+ * Here runs are sorted in DRAM buffers and stored once to scratch space, then merged back into the array, so every
+ * record is written to the PMEM at most twice. If the whole array fits in the DRAM budget, the scratch space is DRAM
+ * and every record is written once.
+ */
+
+#include <tmax_pmem_sort.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define PMEM_SORT_SAMPLES 64          // samples per run used to choose the merge splitters
+#define PMEM_SORT_STAGING (256UL << 10) // DRAM staging buffer per merging thread
+
+struct pmem_sort_ctx
+{
+    char *base;
+    char *scratch;
+    size_t nmemb;
+    size_t size;
+    int (*compar)(const void *, const void *);
+    size_t run_len;   // records per run
+    size_t nruns;
+    int scratch_dram; // scratch is DRAM, sort the runs in place
+    int nparts;       // number of merge partitions
+    size_t *bounds;     // (nparts + 1) x nruns, start of every partition in every run
+    const char **head;  // nparts x nruns, merge position of every partition in every run
+    const char **end;   // nparts x nruns
+    size_t *heap;       // nparts x nruns
+    char *staging;      // nparts x staging_len records
+    size_t staging_len; // records per staging buffer
+    size_t next;        // next run to generate
+    int err;
+};
+
+struct pmem_sort_worker
+{
+    struct pmem_sort_ctx *ctx;
+    int id;
+};
+
+static inline char *pmem_sort_run(struct pmem_sort_ctx *ctx, size_t r)
+{
+    return ctx->scratch + r * ctx->run_len * ctx->size;
+}
+
+static inline size_t pmem_sort_run_len(struct pmem_sort_ctx *ctx, size_t r)
+{
+    size_t start = r * ctx->run_len;
+    return ctx->nmemb - start < ctx->run_len ? ctx->nmemb - start : ctx->run_len;
+}
+
+static void *pmem_sort_generate(void *arg)
+{
+    struct pmem_sort_worker *worker = (struct pmem_sort_worker *)arg;
+    struct pmem_sort_ctx *ctx = worker->ctx;
+    char *buf = NULL;
+    size_t r;
+
+    if (!ctx->scratch_dram)
+    {
+        buf = (char *)malloc(ctx->run_len * ctx->size);
+        if (buf == NULL)
+        {
+            __atomic_store_n(&ctx->err, ERROR_MALLOC, __ATOMIC_RELAXED);
+            return NULL;
+        }
+    }
+
+    while ((r = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED)) < ctx->nruns)
+    {
+        size_t len = pmem_sort_run_len(ctx, r);
+        char *src = ctx->base + r * ctx->run_len * ctx->size;
+
+        if (ctx->scratch_dram)
+        {
+            memcpy(pmem_sort_run(ctx, r), src, len * ctx->size);
+            qsort(pmem_sort_run(ctx, r), len, ctx->size, ctx->compar);
+        }
+        else
+        {
+            memcpy(buf, src, len * ctx->size);
+            qsort(buf, len, ctx->size, ctx->compar);
+            pmem_memcpy_nt(pmem_sort_run(ctx, r), buf, len * ctx->size);
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+/**
+ * @brief First record of run r which is not less than key.
+ */
+static size_t pmem_sort_lower_bound(struct pmem_sort_ctx *ctx, size_t r, const void *key)
+{
+    const char *run = pmem_sort_run(ctx, r);
+    size_t lo = 0, hi = pmem_sort_run_len(ctx, r);
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ctx->compar(run + mid * ctx->size, key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/**
+ * @brief Split the merge into nparts partitions with about the same number of records.
+ *
+ * Splitters are taken from a sorted sample of all runs, and every run is cut at the lower bound of each splitter, so
+ * partitions are disjoint in key space and their output ranges follow from the cut positions.
+ */
+static int pmem_sort_partition(struct pmem_sort_ctx *ctx)
+{
+    size_t nsamples = 0, r, s;
+    char *samples;
+    int p;
+
+    if (ctx->nruns > SIZE_MAX / sizeof(size_t) / (ctx->nparts + 1) ||
+        ctx->nruns > SIZE_MAX / PMEM_SORT_SAMPLES / ctx->size)
+        return ERROR_MALLOC;
+    ctx->bounds = (size_t *)malloc((ctx->nparts + 1) * ctx->nruns * sizeof(size_t));
+    samples = (char *)malloc(ctx->nruns * PMEM_SORT_SAMPLES * ctx->size);
+    if (ctx->bounds == NULL || samples == NULL)
+    {
+        free(samples);
+        return ERROR_MALLOC;
+    }
+
+    for (r = 0; r < ctx->nruns; r++)
+    {
+        size_t len = pmem_sort_run_len(ctx, r);
+        for (s = 0; s < PMEM_SORT_SAMPLES && s < len; s++)
+            memcpy(samples + nsamples++ * ctx->size, pmem_sort_run(ctx, r) + (s * len / PMEM_SORT_SAMPLES) * ctx->size,
+                   ctx->size);
+    }
+    qsort(samples, nsamples, ctx->size, ctx->compar);
+
+    for (r = 0; r < ctx->nruns; r++)
+    {
+        ctx->bounds[r] = 0;
+        ctx->bounds[ctx->nparts * ctx->nruns + r] = pmem_sort_run_len(ctx, r);
+    }
+    for (p = 1; p < ctx->nparts; p++)
+    {
+        const void *splitter = samples + (p * nsamples / ctx->nparts) * ctx->size;
+        for (r = 0; r < ctx->nruns; r++)
+            ctx->bounds[p * ctx->nruns + r] = pmem_sort_lower_bound(ctx, r, splitter);
+    }
+
+    free(samples);
+    return SUCCESS;
+}
+
+/**
+ * @brief Allocate the buffers of all merge partitions. This happens before any partition writes to the array, so a
+ * failure leaves the array as it was.
+ */
+static int pmem_sort_merge_alloc(struct pmem_sort_ctx *ctx)
+{
+    size_t n = (size_t)ctx->nparts * ctx->nruns;
+
+    ctx->staging_len = PMEM_SORT_STAGING / ctx->size ? PMEM_SORT_STAGING / ctx->size : 1;
+    if (n > SIZE_MAX / sizeof(size_t) || ctx->staging_len > SIZE_MAX / ctx->size / ctx->nparts)
+        return ERROR_MALLOC;
+    ctx->head = (const char **)malloc(n * sizeof(char *));
+    ctx->end = (const char **)malloc(n * sizeof(char *));
+    ctx->heap = (size_t *)malloc(n * sizeof(size_t));
+    ctx->staging = (char *)malloc(ctx->nparts * ctx->staging_len * ctx->size);
+    if (ctx->head == NULL || ctx->end == NULL || ctx->heap == NULL || ctx->staging == NULL)
+        return ERROR_MALLOC;
+
+    return SUCCESS;
+}
+
+static void pmem_sort_heap_down(struct pmem_sort_ctx *ctx, size_t *heap, const char **head, size_t n, size_t i)
+{
+    for (;;)
+    {
+        size_t l = 2 * i + 1, m = i;
+        if (l < n && ctx->compar(head[heap[l]], head[heap[m]]) < 0)
+            m = l;
+        if (l + 1 < n && ctx->compar(head[heap[l + 1]], head[heap[m]]) < 0)
+            m = l + 1;
+        if (m == i)
+            return;
+        size_t t = heap[i];
+        heap[i] = heap[m];
+        heap[m] = t;
+        i = m;
+    }
+}
+
+/**
+ * @brief Merge one partition of all runs into its range of the array through a DRAM staging buffer.
+ */
+static void *pmem_sort_merge(void *arg)
+{
+    struct pmem_sort_worker *worker = (struct pmem_sort_worker *)arg;
+    struct pmem_sort_ctx *ctx = worker->ctx;
+    size_t *lo = &ctx->bounds[worker->id * ctx->nruns];
+    size_t *hi = &ctx->bounds[(worker->id + 1) * ctx->nruns];
+    size_t staging_len = ctx->staging_len;
+    const char **head = &ctx->head[worker->id * ctx->nruns];
+    const char **end = &ctx->end[worker->id * ctx->nruns];
+    size_t *heap = &ctx->heap[worker->id * ctx->nruns];
+    char *staging = ctx->staging + worker->id * staging_len * ctx->size;
+    char *out;
+    size_t n = 0, r, staged = 0, offset = 0;
+
+    for (r = 0; r < ctx->nruns; r++)
+    {
+        offset += lo[r];
+        head[r] = pmem_sort_run(ctx, r) + lo[r] * ctx->size;
+        end[r] = pmem_sort_run(ctx, r) + hi[r] * ctx->size;
+        if (head[r] < end[r])
+            heap[n++] = r;
+    }
+    out = ctx->base + offset * ctx->size;
+
+    for (r = n / 2; r-- > 0;)
+        pmem_sort_heap_down(ctx, heap, head, n, r);
+
+    while (n)
+    {
+        size_t top = heap[0];
+
+        memcpy(staging + staged * ctx->size, head[top], ctx->size);
+        if (++staged == staging_len)
+        {
+            pmem_memcpy_nt(out, staging, staged * ctx->size);
+            out += staged * ctx->size;
+            staged = 0;
+        }
+
+        head[top] += ctx->size;
+        if (head[top] == end[top])
+            heap[0] = heap[--n];
+        pmem_sort_heap_down(ctx, heap, head, n, 0);
+    }
+    if (staged)
+        pmem_memcpy_nt(out, staging, staged * ctx->size);
+
+    return NULL;
+}
+
+static int pmem_sort_run_threads(struct pmem_sort_ctx *ctx, int nthreads, void *(*fn)(void *))
+{
+    pthread_t *threads = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+    struct pmem_sort_worker *workers = (struct pmem_sort_worker *)malloc(nthreads * sizeof(struct pmem_sort_worker));
+    int i, started = 0;
+
+    if (threads == NULL || workers == NULL)
+    {
+        free(threads);
+        free(workers);
+        return ERROR_MALLOC;
+    }
+
+    // The calling thread takes the last share itself, and the shares of the threads which could not be started, so
+    // every share is done once a pass is under way
+    for (i = 0; i < nthreads; i++)
+    {
+        workers[i].ctx = ctx;
+        workers[i].id = i;
+    }
+    while (started < nthreads - 1 && pthread_create(&threads[started], NULL, fn, &workers[started]) == 0)
+        started++;
+    for (i = started; i < nthreads; i++)
+        fn(&workers[i]);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+    free(workers);
+    return ctx->err;
+}
+
+/**
+ * @brief Sort an array of records, like qsort(), writing each record to the PMEM at most twice.
+ *
+ * @param base The array, usually in a pmem_malloc region.
+ * @param nmemb Number of records.
+ * @param size Size of a record.
+ * @param compar Comparison function. Called from several threads at once.
+ * @param dir Directory for the scratch region, used when the array does not fit in dram_bytes.
+ * @param dram_bytes DRAM the sort may use for its buffers.
+ * @param nthreads Number of threads, or 0 for the number of online CPUs.
+ * @return int ERROR_INVALID if nmemb * size overflows. On failure the array is left as it was.
+ */
+int pmem_sort(void *base, size_t nmemb, size_t size, int (*compar)(const void *, const void *), const char *dir,
+              size_t dram_bytes, int nthreads)
+{
+    struct pmem_sort_ctx ctx;
+    struct pmem_file *pfile = NULL;
+    int err;
+
+    if (size == 0 || compar == NULL || nmemb > SIZE_MAX / size)
+        return ERROR_INVALID;
+    if (nmemb < 2)
+        return SUCCESS;
+    if (nthreads <= 0)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0)
+        nthreads = 1;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.base = (char *)base;
+    ctx.nmemb = nmemb;
+    ctx.size = size;
+    ctx.compar = compar;
+
+    if (nmemb * size <= dram_bytes)
+    {
+        ctx.scratch = (char *)malloc(nmemb * size);
+        ctx.scratch_dram = ctx.scratch != NULL;
+    }
+    if (!ctx.scratch_dram)
+    {
+        ctx.scratch = (char *)pmem_malloc(dir, NULL, nmemb * size, &pfile);
+        if (ctx.scratch == NULL)
+            return ERROR_MMAP;
+    }
+
+    // Runs sorted in DRAM buffers have to fit the budget together
+    ctx.run_len = (ctx.scratch_dram ? nmemb / nthreads : dram_bytes / nthreads / size);
+    if (ctx.run_len == 0)
+        ctx.run_len = 1;
+    ctx.nruns = (nmemb + ctx.run_len - 1) / ctx.run_len;
+
+    err = pmem_sort_run_threads(&ctx, nthreads, pmem_sort_generate);
+    if (err)
+        goto exit;
+
+    ctx.nparts = nthreads;
+    err = pmem_sort_partition(&ctx);
+    if (err)
+        goto exit;
+    err = pmem_sort_merge_alloc(&ctx);
+    if (err)
+        goto exit;
+    err = pmem_sort_run_threads(&ctx, nthreads, pmem_sort_merge);
+
+exit:
+    free(ctx.bounds);
+    free(ctx.head);
+    free(ctx.end);
+    free(ctx.heap);
+    free(ctx.staging);
+    if (ctx.scratch_dram)
+        free(ctx.scratch);
+    else
+        (void)pmem_free(ctx.scratch, &pfile);
+    return err;
+}
@@ -0,0 +1,458 @@
+/**
+ * @brief Spill space for sort and hash-join runs on the PMEM.
+ *
+ * A run is written once by appending blocks, sealed, then read back sequentially and deleted. Its data lives in a
+ * chain of pmem_malloc segments which grow geometrically, written with non-temporal stores. When the capacity given
+ * to the manager is used up, or the PMEM itself is full, the rest of the run goes to an unlinked temporary file in the
+ * fallback directory.
+ */
+
+#define _GNU_SOURCE
+
+#include <tmax_pmem_spill.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define PMEM_SPILL_MIN_SEGMENT (1UL << 20)
+#define PMEM_SPILL_MAX_SEGMENT (64UL << 20)
+#define PMEM_SPILL_PREFETCH (4UL << 20)
+
+struct pmem_spill
+{
+    char *dir;          // directory of the pmem segments
+    char *fallback_dir; // directory of the disk files, NULL if there is no fallback
+    size_t capacity;    // bytes of pmem the runs may use together
+    size_t used;        // bytes of pmem currently used by the runs
+};
+
+struct pmem_spill_segment
+{
+    char *addr;
+    struct pmem_file *pfile;
+    size_t size; // mapped size
+    size_t len;  // bytes written
+};
+
+struct pmem_spill_run
+{
+    struct pmem_spill *spill;
+    struct pmem_spill_segment *segments;
+    size_t nsegments;
+    size_t max_segments;
+    int fd;           // disk file once the run overflowed, -1 before
+    size_t disk_len;  // bytes written to the disk file
+    size_t size;      // total bytes in the run
+    int sealed;
+};
+
+struct pmem_spill_reader
+{
+    struct pmem_spill_run *run;
+    size_t segment;   // current segment, nsegments once reading the disk file
+    size_t offset;    // offset in the current segment or the disk file
+    size_t advised;   // offset up to which the current segment or the disk file was prefetched
+};
+
+/**
+ * @brief Create a spill manager.
+ *
+ * @param dir Directory on the PMEM for the runs.
+ * @param capacity Bytes of PMEM all runs may use together.
+ * @param fallback_dir Directory for the runs which do not fit in capacity or on the PMEM, or NULL to fail instead.
+ * @param spill_ptr Pointer to the created manager.
+ * @return int
+ */
+int pmem_spill_create(const char *dir, size_t capacity, const char *fallback_dir, struct pmem_spill **spill_ptr)
+{
+    struct pmem_spill *spill;
+
+    if (access(dir, F_OK) || (fallback_dir != NULL && access(fallback_dir, F_OK)))
+        return ERROR_INVALID;
+
+    spill = (struct pmem_spill *)calloc(1, sizeof(struct pmem_spill));
+    if (spill == NULL)
+        return ERROR_MALLOC;
+    spill->dir = strdup(dir);
+    spill->fallback_dir = fallback_dir ? strdup(fallback_dir) : NULL;
+    if (spill->dir == NULL || (fallback_dir != NULL && spill->fallback_dir == NULL))
+    {
+        free(spill->dir);
+        free(spill->fallback_dir);
+        free(spill);
+        return ERROR_MALLOC;
+    }
+    spill->capacity = capacity;
+
+    *spill_ptr = spill;
+    return SUCCESS;
+}
+
+/**
+ * @brief Open a new, empty run.
+ *
+ * @param spill The manager.
+ * @param run_ptr Pointer to the created run.
+ * @return int
+ */
+int pmem_spill_open(struct pmem_spill *spill, struct pmem_spill_run **run_ptr)
+{
+    struct pmem_spill_run *run = (struct pmem_spill_run *)calloc(1, sizeof(struct pmem_spill_run));
+    if (run == NULL)
+        return ERROR_MALLOC;
+    run->spill = spill;
+    run->fd = -1;
+
+    *run_ptr = run;
+    return SUCCESS;
+}
+
+/**
+ * @brief Add a pmem segment to the run if the manager has capacity left for it. The blocks of the segment are allocated
+ * up front, so a full file system fails here rather than with SIGBUS on a store to the mapping.
+ */
+static int pmem_spill_grow(struct pmem_spill_run *run)
+{
+    struct pmem_spill *spill = run->spill;
+    struct pmem_spill_segment *seg;
+    size_t size = PMEM_SPILL_MIN_SEGMENT;
+    size_t used;
+    int err;
+
+    if (run->nsegments)
+    {
+        size = run->segments[run->nsegments - 1].size * 2;
+        if (size > PMEM_SPILL_MAX_SEGMENT)
+            size = PMEM_SPILL_MAX_SEGMENT;
+    }
+
+    used = __atomic_add_fetch(&spill->used, size, __ATOMIC_RELAXED);
+    if (used > spill->capacity)
+    {
+        __atomic_fetch_sub(&spill->used, size, __ATOMIC_RELAXED);
+        return ERROR_NOSPACE;
+    }
+
+    if (run->nsegments == run->max_segments)
+    {
+        size_t max = run->max_segments ? 2 * run->max_segments : 8;
+        struct pmem_spill_segment *segments =
+            (struct pmem_spill_segment *)realloc(run->segments, max * sizeof(struct pmem_spill_segment));
+        if (segments == NULL)
+        {
+            __atomic_fetch_sub(&spill->used, size, __ATOMIC_RELAXED);
+            return ERROR_MALLOC;
+        }
+        run->segments = segments;
+        run->max_segments = max;
+    }
+
+    seg = &run->segments[run->nsegments];
+    seg->addr = (char *)pmem_malloc(spill->dir, NULL, size, &seg->pfile);
+    if (seg->addr == NULL)
+    {
+        __atomic_fetch_sub(&spill->used, size, __ATOMIC_RELAXED);
+        return ERROR_MMAP;
+    }
+    err = posix_fallocate(seg->pfile->fd, 0, (off_t)size);
+    if (err)
+    {
+        printf("[%s] posix_fallocate failed: errno=%d\n", __func__, err);
+        (void)pmem_free(seg->addr, &seg->pfile);
+        __atomic_fetch_sub(&spill->used, size, __ATOMIC_RELAXED);
+        return ERROR_NOSPACE;
+    }
+    seg->size = size;
+    seg->len = 0;
+    run->nsegments++;
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Switch the run to an unlinked temporary file in the fallback directory. The file is created directly in the
+ * directory: it is not a PMEM region, so it gets no owner subdirectory or lease there.
+ */
+static int pmem_spill_overflow(struct pmem_spill_run *run)
+{
+    char path[PATH_MAX];
+    int fd;
+
+    if (run->spill->fallback_dir == NULL)
+        return ERROR_NOSPACE;
+
+    // The file only has to live as long as its descriptor
+    fd = open(run->spill->fallback_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        if (snprintf(path, sizeof(path), "%s/pmem.spill.XXXXXX", run->spill->fallback_dir) >= (int)sizeof(path))
+            return ERROR_INVALID;
+        fd = mkostemp(path, O_CLOEXEC);
+        if (fd == -1)
+        {
+            printf("[%s] could not create a file in %s: errno=%d\n", __func__, run->spill->fallback_dir, errno);
+            return ERROR_RUNTIME;
+        }
+        (void)unlink(path);
+    }
+    run->fd = fd;
+
+    return SUCCESS;
+}
+
+static int pmem_spill_write_disk(struct pmem_spill_run *run, const char *buf, size_t len)
+{
+    while (len)
+    {
+        ssize_t n = write(run->fd, buf, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            printf("[%s] write failed: errno=%d\n", __func__, errno);
+            return ERROR_RUNTIME;
+        }
+        buf += n;
+        len -= n;
+        run->disk_len += n;
+        run->size += n;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Append a block to an open run.
+ *
+ * @param run The run.
+ * @param buf The block.
+ * @param len Length of the block.
+ * @return int
+ */
+int pmem_spill_append(struct pmem_spill_run *run, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+    int err;
+
+    if (run->sealed)
+        return ERROR_INVALID;
+
+    while (len && run->fd == -1)
+    {
+        struct pmem_spill_segment *seg = run->nsegments ? &run->segments[run->nsegments - 1] : NULL;
+        size_t n;
+
+        if (seg == NULL || seg->len == seg->size)
+        {
+            // Any failure to get PMEM, the budget or the file system, moves the rest of the run to the fallback
+            err = pmem_spill_grow(run);
+            if (err && run->spill->fallback_dir != NULL)
+                err = pmem_spill_overflow(run);
+            if (err)
+                return err;
+            continue;
+        }
+
+        n = seg->size - seg->len;
+        if (n > len)
+            n = len;
+        pmem_memcpy_nt(seg->addr + seg->len, p, n);
+        seg->len += n;
+        run->size += n;
+        p += n;
+        len -= n;
+    }
+
+    if (len)
+        return pmem_spill_write_disk(run, p, len);
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Finish writing a run. After this the run can only be read or deleted.
+ *
+ * @param run The run.
+ * @return int
+ */
+int pmem_spill_seal(struct pmem_spill_run *run)
+{
+    if (run->sealed)
+        return ERROR_INVALID;
+    run->sealed = 1;
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Number of bytes in the run.
+ */
+size_t pmem_spill_size(struct pmem_spill_run *run)
+{
+    return run->size;
+}
+
+/**
+ * @brief Open a sequential reader on a sealed run. A run may have several readers.
+ *
+ * @param run The run.
+ * @param reader_ptr Pointer to the created reader.
+ * @return int
+ */
+int pmem_spill_reader_open(struct pmem_spill_run *run, struct pmem_spill_reader **reader_ptr)
+{
+    struct pmem_spill_reader *reader;
+
+    if (!run->sealed)
+        return ERROR_INVALID;
+
+    reader = (struct pmem_spill_reader *)calloc(1, sizeof(struct pmem_spill_reader));
+    if (reader == NULL)
+        return ERROR_MALLOC;
+    reader->run = run;
+
+    *reader_ptr = reader;
+    return SUCCESS;
+}
+
+/**
+ * @brief Ask the kernel to populate the next window ahead of the reader.
+ */
+static void pmem_spill_prefetch(struct pmem_spill_reader *reader)
+{
+    struct pmem_spill_run *run = reader->run;
+
+    if (reader->offset + PMEM_SPILL_PREFETCH / 2 < reader->advised)
+        return;
+
+    if (reader->segment < run->nsegments)
+    {
+        struct pmem_spill_segment *seg = &run->segments[reader->segment];
+        size_t end = reader->advised + PMEM_SPILL_PREFETCH;
+
+        if (end > seg->len)
+            end = seg->len;
+        if (end > reader->advised)
+            (void)madvise(seg->addr + reader->advised, end - reader->advised, MADV_WILLNEED);
+        reader->advised = reader->advised + PMEM_SPILL_PREFETCH;
+    }
+    else
+    {
+        (void)posix_fadvise(run->fd, (off_t)reader->advised, PMEM_SPILL_PREFETCH, POSIX_FADV_WILLNEED);
+        reader->advised += PMEM_SPILL_PREFETCH;
+    }
+}
+
+/**
+ * @brief Read the next bytes of the run.
+ *
+ * @param reader The reader.
+ * @param buf Buffer receiving the data.
+ * @param len Size of buf.
+ * @param nread Number of bytes read, 0 at the end of the run.
+ * @return int
+ */
+int pmem_spill_read(struct pmem_spill_reader *reader, void *buf, size_t len, size_t *nread)
+{
+    struct pmem_spill_run *run = reader->run;
+    char *p = (char *)buf;
+
+    *nread = 0;
+    while (len && reader->segment < run->nsegments)
+    {
+        struct pmem_spill_segment *seg = &run->segments[reader->segment];
+        size_t n = seg->len - reader->offset;
+
+        if (n == 0)
+        {
+            reader->segment++;
+            reader->offset = 0;
+            reader->advised = 0;
+            continue;
+        }
+        pmem_spill_prefetch(reader);
+        if (n > len)
+            n = len;
+        pmem_memcpy_from(p, seg->addr + reader->offset, n);
+        reader->offset += n;
+        p += n;
+        len -= n;
+        *nread += n;
+    }
+
+    while (len && run->fd != -1 && reader->offset < run->disk_len)
+    {
+        ssize_t n;
+
+        pmem_spill_prefetch(reader);
+        n = pread(run->fd, p, len, (off_t)reader->offset);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            printf("[%s] pread failed: errno=%d\n", __func__, errno);
+            return ERROR_RUNTIME;
+        }
+        if (n == 0)
+            break;
+        reader->offset += n;
+        p += n;
+        len -= n;
+        *nread += n;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Close a reader.
+ */
+int pmem_spill_reader_close(struct pmem_spill_reader *reader)
+{
+    free(reader);
+    return SUCCESS;
+}
+
+/**
+ * @brief Delete a run and give its PMEM back to the manager. Readers of the run must be closed first.
+ *
+ * @param run The run.
+ * @return int
+ */
+int pmem_spill_delete(struct pmem_spill_run *run)
+{
+    size_t i;
+    int err = SUCCESS;
+
+    for (i = 0; i < run->nsegments; i++)
+    {
+        struct pmem_spill_segment *seg = &run->segments[i];
+        if (pmem_free(seg->addr, &seg->pfile))
+            err = ERROR_RUNTIME;
+        __atomic_fetch_sub(&run->spill->used, seg->size, __ATOMIC_RELAXED);
+    }
+    if (run->fd != -1)
+        (void)close(run->fd);
+    free(run->segments);
+    free(run);
+
+    return err;
+}
+
+/**
+ * @brief Free the manager. Its runs must be deleted first.
+ */
+int pmem_spill_destroy(struct pmem_spill *spill)
+{
+    free(spill->dir);
+    free(spill->fallback_dir);
+    free(spill);
+
+    return SUCCESS;
+}
@@ -0,0 +1,606 @@
+/**
+ * @brief Allocation statistics of the library. The counters are kept per CPU, each set on its own cache lines, so
+ * recording costs one uncontended atomic add; pmem_stats() sums them up.
+ *
+ * pmem_stats_publish() copies them periodically into the shared memory segment /dev/shm/tmax_pmem_stats.<pid>, from
+ * where pmemtop reads them. Updates are guarded by a sequence counter, so readers only retry and never block the
+ * process. Setting TMAX_PMEM_STATS_SHM to an interval in milliseconds publishes from the first allocation on.
+ */
+
+#define _GNU_SOURCE
+#include <tmax_pmem_stats.h>
+#include <tmax_pmem_dir.h>
+#include <tmax_pmem_hist.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+// CPUs beyond this share the counters of CPU % PMEM_STATS_CPUS
+#define PMEM_STATS_CPUS 256
+
+struct pmem_stats_cpu
+{
+    struct pmem_stats stats;
+} __attribute__((aligned(64)));
+
+static struct pmem_stats_cpu pmem_stats_cpus[PMEM_STATS_CPUS];
+
+// Directories in use, claimed on first use and never released; directories beyond the table are not counted
+static struct
+{
+    int state; // 0 free, 1 being claimed, 2 path set
+    struct pmem_stats_dir dir;
+} pmem_stats_dir_table[PMEM_STATS_DIRS];
+
+// Call sites by return address, open addressing; sites beyond the table are not counted
+#define PMEM_STATS_SITES 256
+#define PMEM_STATS_SITE_PROBES 16
+
+static struct
+{
+    uintptr_t caller;
+    uint64_t allocs;
+    uint64_t bytes;
+} pmem_stats_site_table[PMEM_STATS_SITES];
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int running;
+    int stop;
+    pid_t owner; // process that created the segment, so that forked children do not remove it
+    char name[64];
+    struct pmem_stats_segment *segment;
+} pmem_stats_shm = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static pthread_once_t pmem_stats_env_once = PTHREAD_ONCE_INIT;
+
+static struct pmem_stats *pmem_stats_local(void)
+{
+    int cpu = sched_getcpu();
+
+    // Threads migrate, so the counters are still updated atomically; the CPU only keeps them apart
+    return &pmem_stats_cpus[cpu < 0 ? 0 : cpu % PMEM_STATS_CPUS].stats;
+}
+
+#define PMEM_STATS_ADD(field, value) __atomic_fetch_add(&(field), (value), __ATOMIC_RELAXED)
+
+/**
+ * @brief Size class of a region of size bytes.
+ *
+ * @param size Size of the region.
+ * @return int Index into allocs and frees of struct pmem_stats.
+ */
+int pmem_stats_size_class(size_t size)
+{
+    int cls = 0;
+
+    if (size > (size_t)1 << PMEM_STATS_MIN_SHIFT)
+        cls = 64 - __builtin_clzl((size - 1) >> PMEM_STATS_MIN_SHIFT);
+    return cls < PMEM_STATS_SIZE_CLASSES ? cls : PMEM_STATS_SIZE_CLASSES - 1;
+}
+
+/**
+ * @brief Monotonic time in nanoseconds, for pmem_stats_syscall().
+ */
+uint64_t pmem_stats_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Count a system call that started at start, a value of pmem_stats_clock().
+ *
+ * @return uint64_t Duration of the call in ns.
+ */
+uint64_t pmem_stats_syscall(int call, uint64_t start)
+{
+    struct pmem_stats *s = pmem_stats_local();
+    uint64_t ns = pmem_stats_clock() - start;
+
+    PMEM_STATS_ADD(s->syscalls[call], 1);
+    PMEM_STATS_ADD(s->syscall_ns[call], ns);
+    if (call == PMEM_STATS_MMAP)
+        pmem_hist_record(PMEM_HIST_MMAP, ns);
+    else if (call == PMEM_STATS_MUNMAP)
+        pmem_hist_record(PMEM_HIST_MUNMAP, ns);
+    return ns;
+}
+
+/**
+ * @brief Count the latency of an allocation or free that started at start, a value of pmem_stats_clock().
+ *
+ * @return uint64_t Latency in ns.
+ */
+uint64_t pmem_stats_latency(int op, uint64_t start)
+{
+    uint64_t ns = pmem_stats_clock() - start;
+    int bucket = ns ? 63 - __builtin_clzl(ns) : 0;
+
+    if (bucket >= PMEM_STATS_LATENCY_BUCKETS)
+        bucket = PMEM_STATS_LATENCY_BUCKETS - 1;
+    PMEM_STATS_ADD(pmem_stats_local()->latency[op][bucket], 1);
+    pmem_hist_record(op == PMEM_STATS_ALLOC ? PMEM_HIST_MALLOC : PMEM_HIST_FREE, ns);
+    return ns;
+}
+
+static void pmem_stats_env(void)
+{
+    const char *env = getenv("TMAX_PMEM_STATS_SHM");
+    char *end;
+    unsigned long ms;
+
+    if (env == NULL)
+        return;
+    ms = strtoul(env, &end, 10);
+    if (end == env || *end != '\0' || ms == 0)
+    {
+        printf("[%s] ignoring TMAX_PMEM_STATS_SHM=%s: expected an interval in milliseconds\n", __func__, env);
+        return;
+    }
+    (void)pmem_stats_publish(ms);
+}
+
+/**
+ * @brief Count a new region. alloc is set for regions created by the library rather than opened.
+ */
+void pmem_stats_map(size_t committed, size_t mapped, int alloc)
+{
+    struct pmem_stats *s = pmem_stats_local();
+
+    (void)pthread_once(&pmem_stats_env_once, pmem_stats_env);
+
+    PMEM_STATS_ADD(s->live_regions, 1);
+    PMEM_STATS_ADD(s->bytes_mapped, (int64_t)mapped);
+    PMEM_STATS_ADD(s->bytes_committed, (int64_t)committed);
+    if (alloc)
+        PMEM_STATS_ADD(s->allocs[pmem_stats_size_class(committed)], 1);
+}
+
+/**
+ * @brief Count a region going away. alloc is set for regions whose file is deleted.
+ */
+void pmem_stats_unmap(size_t committed, size_t mapped, int alloc)
+{
+    struct pmem_stats *s = pmem_stats_local();
+
+    PMEM_STATS_ADD(s->live_regions, -1);
+    PMEM_STATS_ADD(s->bytes_mapped, -(int64_t)mapped);
+    PMEM_STATS_ADD(s->bytes_committed, -(int64_t)committed);
+    if (alloc)
+        PMEM_STATS_ADD(s->frees[pmem_stats_size_class(committed)], 1);
+}
+
+/**
+ * @brief Count a change in size of a live region.
+ */
+void pmem_stats_resize(int64_t committed, int64_t mapped)
+{
+    struct pmem_stats *s = pmem_stats_local();
+
+    PMEM_STATS_ADD(s->bytes_mapped, mapped);
+    PMEM_STATS_ADD(s->bytes_committed, committed);
+}
+
+/**
+ * @brief Count a change in the regions and committed bytes of the directory of a file.
+ *
+ * @param fullpath Path of the file, or NULL for regions without one.
+ */
+void pmem_stats_dir(const char *fullpath, int64_t regions, int64_t committed)
+{
+    const char *slash = fullpath != NULL ? strrchr(fullpath, '/') : NULL;
+    const char *dir = slash != NULL ? fullpath : "(anonymous)";
+    size_t len = slash != NULL ? (size_t)(slash - fullpath) : strlen(dir);
+    const char *owner, *next;
+    int i, state;
+
+    // Regions in the subdirectory of the process, or a shard of it, count for the directory it was created in
+    owner = NULL;
+    next = slash != NULL ? strstr(fullpath, "/" PMEM_DIR_OWNER_PREFIX) : NULL;
+    while (next != NULL && next < slash)
+    {
+        owner = next;
+        next = strstr(next + 1, "/" PMEM_DIR_OWNER_PREFIX);
+    }
+    if (owner != NULL)
+        for (len = (size_t)(owner - fullpath); len > 1 && fullpath[len - 1] == '/'; len--)
+            ;
+    if (len == 0 && slash != NULL)
+        dir = "/", len = 1;
+    if (len >= PMEM_STATS_PATH_LEN)
+        len = PMEM_STATS_PATH_LEN - 1;
+    for (i = 0; i < PMEM_STATS_DIRS; i++)
+    {
+        state = __atomic_load_n(&pmem_stats_dir_table[i].state, __ATOMIC_ACQUIRE);
+        if (state == 0 && __atomic_compare_exchange_n(&pmem_stats_dir_table[i].state, &state, 1, 0, __ATOMIC_ACQUIRE,
+                                                      __ATOMIC_ACQUIRE))
+        {
+            memcpy(pmem_stats_dir_table[i].dir.path, dir, len);
+            pmem_stats_dir_table[i].dir.path[len] = '\0';
+            __atomic_store_n(&pmem_stats_dir_table[i].state, 2, __ATOMIC_RELEASE);
+            state = 2;
+        }
+        while (state == 1)
+            state = __atomic_load_n(&pmem_stats_dir_table[i].state, __ATOMIC_ACQUIRE);
+        if (strncmp(pmem_stats_dir_table[i].dir.path, dir, len) == 0 && pmem_stats_dir_table[i].dir.path[len] == '\0')
+        {
+            PMEM_STATS_ADD(pmem_stats_dir_table[i].dir.regions, regions);
+            PMEM_STATS_ADD(pmem_stats_dir_table[i].dir.committed, committed);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Count an allocation of size bytes made from the return address caller.
+ */
+void pmem_stats_site(const void *caller, size_t size)
+{
+    uintptr_t key = (uintptr_t)caller;
+    uintptr_t cur;
+    size_t i = (size_t)((key * 0x9e3779b97f4a7c15ULL) >> 56) % PMEM_STATS_SITES;
+    int probe;
+
+    for (probe = 0; probe < PMEM_STATS_SITE_PROBES; probe++, i = (i + 1) % PMEM_STATS_SITES)
+    {
+        cur = __atomic_load_n(&pmem_stats_site_table[i].caller, __ATOMIC_RELAXED);
+        if (cur == 0 && __atomic_compare_exchange_n(&pmem_stats_site_table[i].caller, &cur, key, 0, __ATOMIC_RELAXED,
+                                                    __ATOMIC_RELAXED))
+            cur = key;
+        if (cur == key)
+        {
+            PMEM_STATS_ADD(pmem_stats_site_table[i].allocs, 1);
+            PMEM_STATS_ADD(pmem_stats_site_table[i].bytes, size);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Count a failed call of the library.
+ *
+ * @param err Error code returned to the caller.
+ * @return int err, to be returned.
+ */
+int pmem_stats_failure(int err)
+{
+    int i = -err;
+
+    if (i <= 0 || i >= PMEM_STATS_ERRORS)
+        i = PMEM_STATS_ERRORS - 1;
+    PMEM_STATS_ADD(pmem_stats_local()->failures[i], 1);
+    return err;
+}
+
+/**
+ * @brief Sum up the statistics of all CPUs. Counters keep running meanwhile, so the sums are not an exact snapshot;
+ * live regions and bytes may be off by the calls in flight.
+ *
+ * @param stats Filled with the statistics of the process.
+ * @return int
+ */
+int pmem_stats(struct pmem_stats *stats)
+{
+    const uint64_t *src;
+    uint64_t *dst = (uint64_t *)stats;
+    size_t n = sizeof(struct pmem_stats) / sizeof(uint64_t);
+    size_t cpu, i;
+
+    if (stats == NULL)
+        return ERROR_INVALID;
+    // All fields are 64-bit counters, and the signed ones wrap into place when summed as unsigned
+    memset(stats, 0, sizeof(*stats));
+    for (cpu = 0; cpu < PMEM_STATS_CPUS; cpu++)
+    {
+        src = (const uint64_t *)&pmem_stats_cpus[cpu].stats;
+        for (i = 0; i < n; i++)
+            dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * @brief Copy the directories in use.
+ *
+ * @param dirs Array of max entries.
+ * @return int Number of entries filled.
+ */
+int pmem_stats_dirs(struct pmem_stats_dir *dirs, int max)
+{
+    int i, n = 0;
+
+    for (i = 0; i < PMEM_STATS_DIRS && n < max; i++)
+    {
+        if (__atomic_load_n(&pmem_stats_dir_table[i].state, __ATOMIC_ACQUIRE) != 2)
+            continue;
+        memcpy(dirs[n].path, pmem_stats_dir_table[i].dir.path, PMEM_STATS_PATH_LEN);
+        dirs[n].regions = __atomic_load_n(&pmem_stats_dir_table[i].dir.regions, __ATOMIC_RELAXED);
+        dirs[n].committed = __atomic_load_n(&pmem_stats_dir_table[i].dir.committed, __ATOMIC_RELAXED);
+        n++;
+    }
+    return n;
+}
+
+/**
+ * @brief Copy the call sites that allocated the most bytes, with their names resolved by dladdr().
+ *
+ * @param sites Array of max entries.
+ * @return int Number of entries filled, largest first.
+ */
+int pmem_stats_sites(struct pmem_stats_site *sites, int max)
+{
+    uintptr_t callers[PMEM_STATS_TOP_SITES];
+    Dl_info info;
+    uintptr_t caller;
+    uint64_t bytes;
+    int i, j, n = 0;
+
+    if (max > PMEM_STATS_TOP_SITES)
+        max = PMEM_STATS_TOP_SITES;
+    // Insertion into the sorted top list
+    for (i = 0; i < PMEM_STATS_SITES; i++)
+    {
+        caller = __atomic_load_n(&pmem_stats_site_table[i].caller, __ATOMIC_RELAXED);
+        bytes = __atomic_load_n(&pmem_stats_site_table[i].bytes, __ATOMIC_RELAXED);
+        if (caller == 0 || (n == max && bytes <= sites[n - 1].bytes))
+            continue;
+        j = n < max ? n++ : n - 1;
+        for (; j > 0 && sites[j - 1].bytes < bytes; j--)
+        {
+            sites[j] = sites[j - 1];
+            callers[j] = callers[j - 1];
+        }
+        sites[j].bytes = bytes;
+        sites[j].allocs = __atomic_load_n(&pmem_stats_site_table[i].allocs, __ATOMIC_RELAXED);
+        callers[j] = caller;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        if (!dladdr((void *)callers[i], &info))
+            snprintf(sites[i].name, PMEM_STATS_SITE_LEN, "0x%lx", (unsigned long)callers[i]);
+        else if (info.dli_sname != NULL)
+            snprintf(sites[i].name, PMEM_STATS_SITE_LEN, "%s+0x%lx", info.dli_sname,
+                     (unsigned long)(callers[i] - (uintptr_t)info.dli_saddr));
+        else
+            snprintf(sites[i].name, PMEM_STATS_SITE_LEN, "%s+0x%lx",
+                     strrchr(info.dli_fname, '/') ? strrchr(info.dli_fname, '/') + 1 : info.dli_fname,
+                     (unsigned long)(callers[i] - (uintptr_t)info.dli_fbase));
+    }
+    return n;
+}
+
+/**
+ * @brief Copy a segment published by some process, retrying while it is being updated.
+ *
+ * @param shared Segment mapped from shared memory.
+ * @param copy Consistent copy of it.
+ * @return int ERROR_INVALID if the segment is not a statistics segment, ERROR_UNAVAILABLE if no consistent copy could
+ * be taken.
+ */
+int pmem_stats_read_segment(const struct pmem_stats_segment *shared, struct pmem_stats_segment *copy)
+{
+    uint64_t seq;
+    int retry;
+
+    if (shared->magic != PMEM_STATS_SEGMENT_MAGIC || shared->version != PMEM_STATS_SEGMENT_VERSION)
+        return ERROR_INVALID;
+    for (retry = 0; retry < 1000; retry++)
+    {
+        seq = __atomic_load_n(&shared->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+        {
+            sched_yield();
+            continue;
+        }
+        memcpy(copy, (const void *)shared, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shared->seq, __ATOMIC_RELAXED) == seq)
+            return SUCCESS;
+    }
+    return ERROR_UNAVAILABLE;
+}
+
+static void pmem_stats_update(struct pmem_stats_segment *segment)
+{
+    struct pmem_stats stats;
+    struct pmem_stats_dir dirs[PMEM_STATS_DIRS];
+    struct pmem_stats_site sites[PMEM_STATS_TOP_SITES];
+    struct timespec ts;
+
+    // Collect first, so that the segment is odd only for the time of the copy
+    memset(dirs, 0, sizeof(dirs));
+    memset(sites, 0, sizeof(sites));
+    (void)pmem_stats(&stats);
+    (void)pmem_stats_dirs(dirs, PMEM_STATS_DIRS);
+    (void)pmem_stats_sites(sites, PMEM_STATS_TOP_SITES);
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    __atomic_store_n(&segment->seq, segment->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    segment->updated_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    segment->stats = stats;
+    memcpy(segment->dirs, dirs, sizeof(dirs));
+    memcpy(segment->sites, sites, sizeof(sites));
+    __atomic_store_n(&segment->seq, segment->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void *pmem_stats_publisher(void *arg)
+{
+    unsigned int interval_ms = *(unsigned int *)arg;
+    struct timespec deadline;
+
+    free(arg);
+    pthread_mutex_lock(&pmem_stats_shm.lock);
+    while (!pmem_stats_shm.stop)
+    {
+        pmem_stats_update(pmem_stats_shm.segment);
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += interval_ms / 1000;
+        deadline.tv_nsec += (long)(interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (!pmem_stats_shm.stop &&
+               pthread_cond_timedwait(&pmem_stats_shm.cond, &pmem_stats_shm.lock, &deadline) != ETIMEDOUT)
+            ;
+    }
+    pthread_mutex_unlock(&pmem_stats_shm.lock);
+    return NULL;
+}
+
+static void pmem_stats_atexit(void)
+{
+    if (pmem_stats_shm.owner == getpid())
+        (void)pmem_stats_unpublish();
+}
+
+// The publisher thread does not survive fork(), and the segment stays with the parent
+static void pmem_stats_atfork_child(void)
+{
+    pthread_mutex_init(&pmem_stats_shm.lock, NULL);
+    pthread_cond_init(&pmem_stats_shm.cond, NULL);
+    pmem_stats_shm.running = 0;
+    pmem_stats_shm.segment = NULL;
+}
+
+/**
+ * @brief Start publishing the statistics of the process into the shared memory segment
+ * /dev/shm/tmax_pmem_stats.<pid>, updated every interval_ms by a background thread. The segment is removed by
+ * pmem_stats_unpublish() or at exit.
+ *
+ * @param interval_ms Update interval.
+ * @return int ERROR_INVALID if already publishing.
+ */
+int pmem_stats_publish(unsigned int interval_ms)
+{
+    static int registered;
+    struct pmem_stats_segment *segment;
+    unsigned int *arg;
+    FILE *fp;
+    int fd;
+    int err = SUCCESS;
+
+    if (interval_ms == 0)
+        return ERROR_INVALID;
+    pthread_mutex_lock(&pmem_stats_shm.lock);
+    if (pmem_stats_shm.running)
+    {
+        err = ERROR_INVALID;
+        goto exit;
+    }
+
+    snprintf(pmem_stats_shm.name, sizeof(pmem_stats_shm.name), "/" PMEM_STATS_SEGMENT_PREFIX "%d", (int)getpid());
+    fd = shm_open(pmem_stats_shm.name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        printf("[%s] shm_open %s failed: errno=%d\n", __func__, pmem_stats_shm.name, errno);
+        err = ERROR_RUNTIME;
+        goto exit;
+    }
+    if (ftruncate(fd, sizeof(*segment)))
+    {
+        (void)close(fd);
+        (void)shm_unlink(pmem_stats_shm.name);
+        err = ERROR_RUNTIME;
+        goto exit;
+    }
+    segment = mmap(NULL, sizeof(*segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    (void)close(fd);
+    if (segment == MAP_FAILED)
+    {
+        (void)shm_unlink(pmem_stats_shm.name);
+        err = ERROR_MMAP;
+        goto exit;
+    }
+
+    segment->version = PMEM_STATS_SEGMENT_VERSION;
+    segment->interval_ms = interval_ms;
+    segment->pid = getpid();
+    fp = fopen("/proc/self/comm", "r");
+    if (fp != NULL)
+    {
+        if (fgets(segment->comm, sizeof(segment->comm), fp) != NULL)
+            segment->comm[strcspn(segment->comm, "\n")] = '\0';
+        fclose(fp);
+    }
+    pmem_stats_update(segment);
+    // Readers recognise the segment only once it is complete
+    __atomic_store_n(&segment->magic, PMEM_STATS_SEGMENT_MAGIC, __ATOMIC_RELEASE);
+
+    arg = malloc(sizeof(*arg));
+    if (arg == NULL)
+    {
+        err = ERROR_MALLOC;
+        goto unmap;
+    }
+    *arg = interval_ms;
+    pmem_stats_shm.segment = segment;
+    pmem_stats_shm.stop = 0;
+    if (pthread_create(&pmem_stats_shm.thread, NULL, pmem_stats_publisher, arg))
+    {
+        free(arg);
+        err = ERROR_RUNTIME;
+        goto unmap;
+    }
+    pmem_stats_shm.running = 1;
+    pmem_stats_shm.owner = getpid();
+    if (!registered)
+        registered = atexit(pmem_stats_atexit) == 0 && pthread_atfork(NULL, NULL, pmem_stats_atfork_child) == 0;
+    pthread_mutex_unlock(&pmem_stats_shm.lock);
+
+    return SUCCESS;
+
+unmap:
+    (void)munmap(segment, sizeof(*segment));
+    (void)shm_unlink(pmem_stats_shm.name);
+    pmem_stats_shm.segment = NULL;
+exit:
+    pthread_mutex_unlock(&pmem_stats_shm.lock);
+    return err;
+}
+
+/**
+ * @brief Stop publishing and remove the shared memory segment.
+ *
+ * @return int ERROR_INVALID if not publishing.
+ */
+int pmem_stats_unpublish(void)
+{
+    pthread_mutex_lock(&pmem_stats_shm.lock);
+    if (!pmem_stats_shm.running)
+    {
+        pthread_mutex_unlock(&pmem_stats_shm.lock);
+        return ERROR_INVALID;
+    }
+    pmem_stats_shm.stop = 1;
+    pthread_cond_signal(&pmem_stats_shm.cond);
+    pthread_mutex_unlock(&pmem_stats_shm.lock);
+    (void)pthread_join(pmem_stats_shm.thread, NULL);
+
+    pthread_mutex_lock(&pmem_stats_shm.lock);
+    (void)shm_unlink(pmem_stats_shm.name);
+    (void)munmap(pmem_stats_shm.segment, sizeof(*pmem_stats_shm.segment));
+    pmem_stats_shm.segment = NULL;
+    pmem_stats_shm.running = 0;
+    pthread_mutex_unlock(&pmem_stats_shm.lock);
+
+    return SUCCESS;
+}